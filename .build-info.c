@@ -0,0 +1,2 @@
+char *mpdm_build_git_rev = "5b9d4f87837f4d4f26e20c2cfe65131d71913cb0";
+char *mpdm_build_timestamp = "2026/10/17 00:54:30";
@@ -0,0 +1,27 @@
+/* automatically created by config.sh - do not modify */
+#define VERSION "2.53-dev"
+#define CONFOPT_PREFIX "/usr/local"
+#define CONFOPT_GLOB_H 1
+#define CONFOPT_SYSTEM_REGEX 1
+#define CONFOPT_UNISTD_H 1
+#define CONFOPT_SYS_TYPES_H 1
+#define CONFOPT_SYS_WAIT_H 1
+#define CONFOPT_SYS_STAT_H 1
+#define CONFOPT_PWD_H 1
+#define CONFOPT_SYS_SOCKET_H 1
+#define CONFOPT_NETDB_H 1
+#define CONFOPT_CHOWN 1
+#define CONFOPT_MMAP 1
+#define CONFOPT_GETTEXT 1
+#define CONFOPT_ICONV 1
+#define CONFOPT_WCWIDTH 1
+#define CONFOPT_CANONICALIZE_FILE_NAME 1
+#define CONFOPT_NANOSLEEP 1
+#define CONFOPT_STRPTIME 1
+#define CONFOPT_GETTIMEOFDAY 1
+#define CONFOPT_PTHREADS 1
+#define CONFOPT_POSIXSEMS 1
+#define CONFOPT_TLS 1
+#define CONFOPT_ATOMICS 1
+#define CONFOPT_SSE2 1
+#define CONFOPT_AVX2 1
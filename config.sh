@@ -31,6 +31,8 @@ while [ $# -gt 0 ] ; do
     --without-wcwidth)      WITHOUT_WCWIDTH=1 ;;
     --without-zlib)         WITHOUT_ZLIB=1 ;;
     --with-zlib)            WITHOUT_ZLIB=0 ;;
+    --with-debug)           WITH_DEBUG=1 ;;
+    --without-simd)         WITHOUT_SIMD=1 ;;
     --help)                 CONFIG_HELP=1 ;;
 
     --mingw32-prefix=*)     MINGW32_PREFIX=`echo $1 | sed -e 's/--mingw32-prefix=//'`
@@ -71,6 +73,8 @@ if [ "$CONFIG_HELP" = "1" ] ; then
     echo "--mingw32               Build using the mingw32 compiler."
     echo "--with-zlib             Enable Zlib support."
     echo "--without-zlib          Disable Zlib support."
+    echo "--with-debug            Debug build (no value allocator, poisoning)."
+    echo "--without-simd          Disable SSE2 / AVX2 string transcoding."
     echo
     echo "Environment variables:"
     echo "CC                    C Compiler."
@@ -138,6 +142,30 @@ else
     CFLAGS=""
 fi
 
+# struct mpdm_val uses anonymous unions
+echo -n "Testing for C11... "
+echo "#if __STDC_VERSION__ < 201112L" > .tmp.c
+echo "#error C11 needed" >> .tmp.c
+echo "#endif" >> .tmp.c
+echo "struct s { union { int i; double r; }; };" >> .tmp.c
+echo "int main(void) { struct s v; v.i = 0; return v.i; }" >> .tmp.c
+
+$CC $CFLAGS .tmp.c -o .tmp.o 2>> .config.log
+
+if [ $? = 0 ] ; then
+    echo "OK"
+else
+    $CC $CFLAGS -std=gnu11 .tmp.c -o .tmp.o 2>> .config.log
+
+    if [ $? = 0 ] ; then
+        echo "OK (using -std=gnu11)"
+        CFLAGS="$CFLAGS -std=gnu11"
+    else
+        echo "No (a C11 compiler is needed)"
+        exit 1
+    fi
+fi
+
 echo "CFLAGS=$CFLAGS" >> makefile.opts
 
 # Add CFLAGS to CC
@@ -369,6 +397,21 @@ else
     echo "No"
 fi
 
+# mmap() detection
+echo -n "Testing for mmap()... "
+echo "#include <sys/types.h>" > .tmp.c
+echo "#include <sys/mman.h>" >> .tmp.c
+echo "int main(void) { void *p = mmap(0, 1, PROT_READ, MAP_PRIVATE, 0, 0); munmap(p, 1); return 0; }" >> .tmp.c
+
+$CC .tmp.c -o .tmp.o 2>> .config.log
+
+if [ $? = 0 ] ; then
+    echo "#define CONFOPT_MMAP 1" >> config.h
+    echo "OK"
+else
+    echo "No"
+fi
+
 # gettext support
 echo -n "Testing for gettext... "
 
@@ -635,6 +678,68 @@ else
     echo "MP_DOCCER=no" >> makefile.opts
 fi
 
+echo -n "Testing for thread-local storage... "
+echo "__thread int i; int main(void) { i = 1; return i; }" > .tmp.c
+
+$CC .tmp.c -o .tmp.o 2>> .config.log
+
+if [ $? = 0 ] ; then
+    echo "#define CONFOPT_TLS 1" >> config.h
+    echo "OK"
+else
+    echo "No"
+fi
+
+echo -n "Testing for atomic builtins... "
+echo "int main(void) { int i = 0; __atomic_add_fetch(&i, 1, __ATOMIC_RELAXED); return __atomic_sub_fetch(&i, 1, __ATOMIC_ACQ_REL); }" > .tmp.c
+
+$CC .tmp.c -o .tmp.o 2>> .config.log
+
+if [ $? = 0 ] ; then
+    echo "#define CONFOPT_ATOMICS 1" >> config.h
+    echo "OK"
+else
+    echo "No"
+fi
+
+echo -n "Testing for SSE2 intrinsics... "
+
+if [ "$WITHOUT_SIMD" = "1" ] ; then
+    echo "Disabled"
+else
+    echo "#include <emmintrin.h>" > .tmp.c
+    echo "int main(void) { __m128i z = _mm_setzero_si128(); return _mm_movemask_epi8(z); }" >> .tmp.c
+
+    $CC .tmp.c -o .tmp.o 2>> .config.log
+
+    if [ $? = 0 ] ; then
+        echo "#define CONFOPT_SSE2 1" >> config.h
+        echo "OK"
+
+        echo -n "Testing for AVX2 runtime selection... "
+        echo "#include <immintrin.h>" > .tmp.c
+        echo "__attribute__((target(\"avx2\"))) int f(void) { __m256i z = _mm256_setzero_si256(); return _mm256_movemask_epi8(z); }" >> .tmp.c
+        echo "int main(void) { return __builtin_cpu_supports(\"avx2\") ? f() : 0; }" >> .tmp.c
+
+        $CC .tmp.c -o .tmp.o 2>> .config.log
+
+        if [ $? = 0 ] ; then
+            echo "#define CONFOPT_AVX2 1" >> config.h
+            echo "OK"
+        else
+            echo "No"
+        fi
+    else
+        echo "No"
+    fi
+fi
+
+if [ "$WITH_DEBUG" = "1" ] ; then
+    echo "Selecting debug build"
+
+    echo "#define CONFOPT_DEBUG 1" >> config.h
+fi
+
 if [ "$WITH_NULL_HASH" = "1" ] ; then
     echo "Selecting NULL hash function"
 
@@ -30,18 +30,73 @@ typedef enum {
     MPDM_TYPE_FUNCTION,
     MPDM_TYPE_PROGRAM,
 	MPDM_TYPE_INTEGER,
-	MPDM_TYPE_REAL
+	MPDM_TYPE_REAL,
+    MPDM_TYPE_BYTES
 } mpdm_type_t;
 
 /* mpdm values */
 typedef struct mpdm_val *mpdm_t;
 
-/* a value */
+/* a value (its anonymous unions need C11) */
 struct mpdm_val {
     mpdm_type_t type;   /* value type */
     int ref;            /* reference count */
     int size;           /* data size */
-    const void *data;   /* the real data */
+    int flags;          /* internal flags */
+    union {
+        struct {
+            int alloc;      /* allocated elements (arrays) */
+            int head;       /* free elements before data (arrays) */
+        };
+        unsigned int hash;  /* cached hash (strings) */
+    };
+    union {
+        const void *data;   /* the real data */
+        int ival;           /* integer value */
+        double rval;        /* real value */
+    };
+};
+
+/* value flags */
+#define MPDM_F_CLASS    0x0000000f  /* allocator size class */
+#define MPDM_F_INLINE   0x00000010  /* data is stored after the value */
+#define MPDM_F_SHARED   0x00000020  /* value is shared between threads */
+#define MPDM_F_COLOR    0x000000c0  /* cycle collector color (0, black) */
+#define MPDM_F_GRAY     0x00000040
+#define MPDM_F_WHITE    0x00000080
+#define MPDM_F_PURPLE   0x000000c0
+#define MPDM_F_BUFFERED 0x00000100  /* value is a cycle candidate */
+#define MPDM_F_DEAD     0x00000200  /* destroyed while buffered */
+#define MPDM_F_HASHED   0x00000400  /* the hash field is valid */
+#define MPDM_F_LATIN1   0x00000800  /* string stored in 1 byte chars */
+#define MPDM_F_UCS2     0x00001000  /* string stored in 2 byte chars */
+#define MPDM_F_UTF8     0x00002000  /* string stored in UTF-8 */
+#define MPDM_F_SLICE    0x00004000  /* string is a part of another */
+#define MPDM_F_SLICED   0x00008000  /* string has slices (counted in hash) */
+#define MPDM_F_ROPE     0x00010000  /* string is a concatenation of two */
+
+/* strings with both flags are 7 bit ASCII (valid as both) */
+#define MPDM_F_ASCII    (MPDM_F_LATIN1 | MPDM_F_UTF8)
+
+/* strings with data other than a wide character one */
+#define MPDM_F_REPR     (MPDM_F_LATIN1 | MPDM_F_UCS2 | MPDM_F_UTF8 | \
+                         MPDM_F_SLICE | MPDM_F_ROPE)
+
+/* integers from 0 to this - 1 are cached */
+#define MPDM_SMALL_INTS 256
+
+/* string builder (a zeroed structure is an empty one) */
+struct mpdm_sb {
+    wchar_t *ptr;       /* the string */
+    int size;           /* size in characters */
+    int alloc;          /* allocated characters */
+};
+
+/* UTF-8 byte string builder (a zeroed structure is an empty one) */
+struct mpdm_bb {
+    char *ptr;          /* the bytes */
+    int size;           /* size in bytes */
+    int alloc;          /* allocated bytes */
 };
 
 /* function typedefs */
@@ -67,6 +122,7 @@ typedef mpdm_t mpdm_func3_t(mpdm_t, mpdm_t, mpdm_t);
 #define MPDM_NS(s,n)    mpdm_new_wcs(s, n, 1)
 #define MPDM_ENS(s,n)   mpdm_new_wcs(s, n, 0)
 #define MPDM_C(t,p,s)   mpdm_new_copy(t, p, s)
+#define MPDM_B(p,s)     mpdm_new_b(p, s)
 
 #define MPDM_I(i)       mpdm_new_i((i))
 #define MPDM_R(r)       mpdm_new_r((r))
@@ -84,20 +140,29 @@ mpdm_func1_t *mpdm_destroy;
 mpdm_t mpdm_real_destroy(mpdm_t v);
 mpdm_t mpdm_dummy__destroy(mpdm_t v);
 mpdm_t mpdm_new(mpdm_type_t type, const void *data, int size);
+mpdm_t mpdm_new_inline(mpdm_type_t type, int bytes, int size);
 mpdm_type_t mpdm_type(mpdm_t v);
 wchar_t *mpdm_type_wcs(mpdm_t v);
 mpdm_t mpdm_ref(mpdm_t v);
 mpdm_t mpdm_unref(mpdm_t v);
 mpdm_t mpdm_unrefnd(mpdm_t v);
+mpdm_t mpdm_share(mpdm_t v);
+int mpdm_destroy_budget(int budget);
+int mpdm_gc(void);
+int mpdm_gc_threshold(int threshold);
+int mpdm_gc_check(void);
+mpdm_t mpdm_gc_stats(void);
 int mpdm_size(const mpdm_t v);
 mpdm_t mpdm_root(void);
 mpdm_t mpdm_void(mpdm_t v);
 int mpdm_is_null(mpdm_t v);
 mpdm_t mpdm_store(mpdm_t *v, mpdm_t w);
 mpdm_t mpdm_new_copy(mpdm_type_t type, void *ptr, int size);
+mpdm_t mpdm_new_b(const void *ptr, int size);
 int mpdm_wrap_pointers(mpdm_t v, int offset, int *del);
 int mpdm_startup(void);
 void mpdm_shutdown(void);
+void mpdm_thread_exit(void);
 
 extern wchar_t * (*mpdm_dump_1) (const mpdm_t v, int l, wchar_t *ptr, int *size);
 mpdm_t mpdm_dumper(const mpdm_t v);
@@ -105,6 +170,7 @@ void mpdm_dump(const mpdm_t v);
 
 mpdm_t mpdm_array__destroy(mpdm_t a);
 mpdm_t mpdm_new_a(int size);
+mpdm_t mpdm_reserve(mpdm_t a, int size);
 mpdm_t mpdm_expand(mpdm_t a, int index, int num);
 mpdm_t mpdm_collapse(mpdm_t a, int index, int num);
 mpdm_t mpdm_get_i(const mpdm_t a, int index);
@@ -132,20 +198,48 @@ void *mpdm_poke(void *dst, int *dsize, const void *org, int osize, int esize);
 wchar_t *mpdm_pokewsn(wchar_t *dst, int *dsize, const wchar_t *str, int slen);
 wchar_t *mpdm_pokews(wchar_t *dst, int *dsize, const wchar_t *str);
 wchar_t *mpdm_pokev(wchar_t *dst, int *dsize, const mpdm_t v);
+void mpdm_sb_init(struct mpdm_sb *sb);
+void mpdm_sb_reserve(struct mpdm_sb *sb, int size);
+void mpdm_sb_add_wcsn(struct mpdm_sb *sb, const wchar_t *str, int size);
+void mpdm_sb_add_wcs(struct mpdm_sb *sb, const wchar_t *str);
+void mpdm_sb_add_wc(struct mpdm_sb *sb, wchar_t wc);
+void mpdm_sb_add_v(struct mpdm_sb *sb, const mpdm_t v);
+wchar_t *mpdm_sb_detach(struct mpdm_sb *sb, int *size);
+mpdm_t mpdm_sb_finish(struct mpdm_sb *sb);
+void mpdm_bb_init(struct mpdm_bb *bb);
+void mpdm_bb_reserve(struct mpdm_bb *bb, int size);
+void mpdm_bb_add_wcsn(struct mpdm_bb *bb, const wchar_t *str, int size);
+void mpdm_bb_add_v(struct mpdm_bb *bb, const mpdm_t v);
+char *mpdm_bb_detach(struct mpdm_bb *bb, int *size);
+int mpdm_ascii_to_wcs(const char *str, int size, wchar_t *wcs);
+int mpdm_ascii_to_mbs(const wchar_t *wcs, int size, char *str);
+int mpdm_utf8_to_wcs(const char *str, int size, wchar_t *wcs);
+int mpdm_wcs_to_utf8(const wchar_t *wcs, int size, char *str);
 wchar_t *mpdm_mbstowcs(const char *str, int *s, int l);
 char *mpdm_wcstombs(const wchar_t * str, int *s);
 mpdm_t mpdm_new_wcs(const wchar_t *str, int size, int cpy);
 mpdm_t mpdm_new_mbstowcs(const char *str, int l);
 mpdm_t mpdm_new_wcstombs(const wchar_t *str);
+mpdm_t mpdm_new_compact(const wchar_t *str, int size, int cpy);
+mpdm_t mpdm_new_utf8(const char *str, int size, int cpy);
+mpdm_t mpdm_new_slice_2(const mpdm_t v, int offset, int size, int boffset);
+mpdm_t mpdm_new_slice(const mpdm_t v, int offset, int size);
+mpdm_t mpdm_string__destroy(mpdm_t v);
+mpdm_t mpdm_number__destroy(mpdm_t v);
 mpdm_t mpdm_new_i(int ival);
 mpdm_t mpdm_new_r(double rval);
+int mpdm_string_n(const mpdm_t v, int offset, wchar_t *buf, int size);
+const char *mpdm_utf8(const mpdm_t v, int *size);
 wchar_t *mpdm_string(const mpdm_t v);
 int mpdm_cmp_wcs(const mpdm_t v1, const wchar_t *v2);
+int mpdm_cmp_s(const mpdm_t v1, const mpdm_t v2);
 mpdm_t mpdm_strcat_wcsn(const mpdm_t s1, const wchar_t *s2, int size);
 mpdm_t mpdm_strcat_wcs(const mpdm_t s1, const wchar_t *s2);
 mpdm_t mpdm_strcat(const mpdm_t s1, const mpdm_t s2);
+int mpdm_ival_wcs(const wchar_t *str);
 int mpdm_ival_mbs(char *str);
 int mpdm_ival(mpdm_t v);
+double mpdm_rval_wcs(const wchar_t *str);
 double mpdm_rval_mbs(char *str);
 double mpdm_rval(mpdm_t v);
 mpdm_t mpdm_gettext(const mpdm_t str);
@@ -163,6 +257,9 @@ mpdm_t mpdm_new_o(void);
 mpdm_t mpdm_get_wcs(const mpdm_t o, const wchar_t *i);
 int mpdm_exists(const mpdm_t h, const mpdm_t i);
 mpdm_t mpdm_set_wcs(mpdm_t o, mpdm_t v, const wchar_t *i);
+mpdm_t mpdm_intern_wcs(const wchar_t *str, int size);
+mpdm_t mpdm_intern(mpdm_t v);
+mpdm_t mpdm_key(const wchar_t *str);
 
 wchar_t *mpdm_read_mbs(FILE *f, int *s);
 int mpdm_write_wcs(FILE * f, const wchar_t * str);
@@ -176,6 +273,10 @@ int mpdm_fseek(const mpdm_t fd, long offset, int whence);
 long mpdm_ftell(const mpdm_t fd);
 int mpdm_feof(const mpdm_t fd);
 FILE * mpdm_get_filehandle(const mpdm_t fd);
+mpdm_t mpdm_bread(mpdm_t fd, int size);
+int mpdm_bwrite(mpdm_t fd, mpdm_t v, int size);
+mpdm_t mpdm_fline(mpdm_t fd, int n);
+int mpdm_flines(mpdm_t fd);
 int mpdm_encoding(mpdm_t charset);
 int mpdm_unlink(const mpdm_t filename);
 int mpdm_rename(const mpdm_t o, const mpdm_t n);
@@ -36,6 +36,10 @@ mpdm_t mpdm_array__destroy(mpdm_t a)
     for (n = 0; n < mpdm_size(a); n++)
         mpdm_unref(mpdm_get_i(a, n));
 
+    /* the memory block starts before the data */
+    free((mpdm_t *) a->data - a->head);
+    a->data = NULL;
+
     return a;
 }
 
@@ -45,17 +49,62 @@ mpdm_t mpdm_new_a(int size)
 {
     mpdm_t v;
 
-    /* creates and expands */
+    /* creates, reserves exactly and expands */
     v = mpdm_new(MPDM_TYPE_ARRAY, NULL, 0);
 
+    mpdm_reserve(v, size);
     mpdm_expand(v, 0, size);
 
     return v;
 }
 
 
+static void set_alloc(mpdm_t a, int alloc)
+/* sets the number of allocated elements of an array,
+   moving the elements to the start of the memory block */
+{
+    if (alloc != a->alloc || a->head) {
+        mpdm_t *p = (mpdm_t *) a->data - a->head;
+
+        if (a->head) {
+            memmove(p, a->data, a->size * sizeof(mpdm_t));
+            a->head = 0;
+        }
+
+        if (alloc)
+            a->data = realloc(p, alloc * sizeof(mpdm_t));
+        else {
+            free(p);
+            a->data = NULL;
+        }
+
+        a->alloc = alloc;
+    }
+}
+
+
 /* interface */
 
+/**
+ * mpdm_reserve - Reserves memory for an array.
+ * @a: the array
+ * @size: number of elements
+ *
+ * Makes room in the @a array to hold up to @size elements without
+ * further reallocations. The array size is not changed. Useful
+ * when the final size of an array being filled is known in advance,
+ * as arrays otherwise grow geometrically.
+ * [Arrays]
+ */
+mpdm_t mpdm_reserve(mpdm_t a, int size)
+{
+    if (size > a->alloc)
+        set_alloc(a, size);
+
+    return a;
+}
+
+
 /**
  * mpdm_expand - Expands an array.
  * @a: the array
@@ -73,21 +122,66 @@ mpdm_t mpdm_expand(mpdm_t a, int index, int num)
 
     /* sanity checks */
     if (num > 0) {
+        if (index == 0 && num > a->head && a->size) {
+            /* inserting at the start without enough head room:
+               move the elements to a block with room to grow
+               geometrically at the start, as it's done at the end */
+            int head = a->size / 2;
+
+            if (head < 4)
+                head = 4;
+            if (head < num)
+                head = num;
+
+            /* if there is no memory for it, the array is left
+               unchanged and the elements are moved up as usual */
+            if ((p = malloc((head + a->alloc) * sizeof(mpdm_t))) != NULL) {
+                memcpy(p + head, a->data, a->size * sizeof(mpdm_t));
+                free((mpdm_t *) a->data - a->head);
+
+                a->data = p + head;
+                a->head = head;
+            }
+        }
+
+        if (index == 0 && num <= a->head) {
+            /* inserting at the start: use the free head room */
+            a->data = (mpdm_t *) a->data - num;
+            a->head -= num;
+            a->alloc += num;
+        }
+        else {
+            if (a->size + num > a->alloc) {
+                int alloc = a->alloc + a->head;
+
+                /* if the free head room is big enough, just move
+                   the elements down; otherwise, grow geometrically */
+                if (a->head * 2 < a->size || alloc < a->size + num) {
+                    alloc += alloc / 2;
+
+                    if (alloc < 4)
+                        alloc = 4;
+                    if (alloc < a->size + num)
+                        alloc = a->size + num;
+                }
+
+                set_alloc(a, alloc);
+            }
+
+            p = (mpdm_t *) a->data;
+
+            /* moves up from top of the array */
+            memmove(&p[index + num], &p[index], (a->size - index) * sizeof(mpdm_t));
+        }
+
         /* add size */
         a->size += num;
 
-        /* expand */
-        p = (mpdm_t *) realloc((mpdm_t *) a->data, a->size * sizeof(mpdm_t));
-
-        /* moves up from top of the array */
-        for (n = a->size - 1; n >= index + num; n--)
-            p[n] = p[n - num];
+        p = (mpdm_t *) a->data;
 
         /* fills the new space with blanks */
-        for (; n >= index; n--)
+        for (n = index; n < index + num; n++)
             p[n] = NULL;
-
-        a->data = p;
     }
 
     return a;
@@ -123,12 +217,22 @@ mpdm_t mpdm_collapse(mpdm_t a, int index, int num)
         /* array is now shorter */
         a->size -= num;
 
-        /* moves down the elements */
-        for (n = index; n < a->size; n++)
-            p[n] = p[n + num];
+        if (index == 0) {
+            /* deleting from the start: the elements
+               are left as free head room */
+            a->data = p + num;
+            a->head += num;
+            a->alloc -= num;
+        }
+        else {
+            /* moves down the elements */
+            memmove(&p[index], &p[index + num], (a->size - index) * sizeof(mpdm_t));
+        }
 
-        /* finally shrinks the memory block */
-        a->data = realloc(p, a->size * sizeof(mpdm_t));
+        /* shrink the memory block only if it's mostly unused,
+           leaving room to grow again */
+        if (a->size * 4 <= a->alloc + a->head)
+            set_alloc(a, a->size ? a->size * 2 : 0);
     }
 
     return a;
@@ -180,6 +284,10 @@ mpdm_t mpdm_set_i(mpdm_t a, mpdm_t e, int index)
 
     mpdm_t *p = (mpdm_t *) a->data;
 
+    /* values inside shared arrays are also shared */
+    if (a->flags & MPDM_F_SHARED)
+        mpdm_share(e);
+
     mpdm_store(&p[index], e);
 
     return e;
@@ -335,14 +443,14 @@ mpdm_t mpdm_clone(const mpdm_t v)
 {
     int n;
     mpdm_t w = NULL;
+    mpdm_t e, i;
 
     switch (mpdm_type(v)) {
     case MPDM_TYPE_ARRAY:
-    case MPDM_TYPE_OBJECT:
         mpdm_ref(v);
 
         /* creates a similar value */
-        w = mpdm_type(v) == MPDM_TYPE_OBJECT ? MPDM_O() : MPDM_A(0);
+        w = MPDM_A(0);
 
         /* fills each element with duplicates of the original */
         for (n = 0; n < v->size; n++)
@@ -351,6 +459,19 @@ mpdm_t mpdm_clone(const mpdm_t v)
         mpdm_unref(v);
         break;
 
+    case MPDM_TYPE_OBJECT:
+        mpdm_ref(v);
+
+        w = MPDM_O();
+
+        /* fills each pair with duplicates of the original values */
+        n = 0;
+        while (mpdm_iterator(v, &n, &e, &i))
+            mpdm_set(w, mpdm_clone(e), i);
+
+        mpdm_unref(v);
+        break;
+
     default:
         w = v;
         break;
@@ -568,6 +689,47 @@ mpdm_t mpdm_sort_cb(mpdm_t a, int step, mpdm_t cb)
 }
 
 
+static const char *find_bytes(const char *str, int size, const char *sep, int ss)
+/* finds the first occurrence of the sep bytes in str, or NULL */
+{
+    const char *end = str + size - ss;
+
+    for (; str <= end; str++) {
+        if ((str = memchr(str, *sep, end - str + 1)) == NULL)
+            break;
+
+        if (memcmp(str, sep, ss) == 0)
+            return str;
+    }
+
+    return NULL;
+}
+
+
+static int utf8_count(const char *str, int size)
+/* counts the characters in size bytes of UTF-8 */
+{
+    int n, c = 0;
+
+    for (n = 0; n < size; n++) {
+        if ((str[n] & 0xc0) != 0x80)
+            c++;
+    }
+
+    return c;
+}
+
+
+static mpdm_t split_part(const mpdm_t v, const wchar_t *str, const wchar_t *ptr, int size)
+/* returns the part of v (of str string) from ptr */
+{
+    if (mpdm_type(v) == MPDM_TYPE_STRING)
+        return mpdm_new_slice(v, ptr - str, size);
+
+    return MPDM_NS(ptr, size);
+}
+
+
 /**
  * mpdm_split_wcs - Separates a string into an array of pieces (string version).
  * @v: the value to be separated
@@ -589,6 +751,8 @@ mpdm_t mpdm_split_wcs(const mpdm_t v, const wchar_t *s)
 
     if (v != NULL) {
         const wchar_t *ptr;
+        const char *bstr;
+        int bs;
 
         mpdm_ref(v);
 
@@ -596,23 +760,56 @@ mpdm_t mpdm_split_wcs(const mpdm_t v, const wchar_t *s)
 
         /* NULL separator? special case: split string in characters */
         if (s == NULL) {
-            for (ptr = mpdm_string(v); ptr && *ptr != '\0'; ptr++)
+            ptr = mpdm_string(v);
+            mpdm_reserve(w, wcslen(ptr));
+
+            for (; *ptr != '\0'; ptr++)
                 mpdm_push(w, MPDM_NS(ptr, 1));
         }
+        else
+        if (*s && (bstr = mpdm_utf8(v, &bs)) != NULL) {
+            /* UTF-8 strings are splitted without converting them */
+            const char *bptr, *sptr;
+            const char *end = bstr + bs;
+            struct mpdm_bb bb;
+            char *sep;
+            int ss;
+            int sc = wcslen(s);
+            int o = 0;
+
+            mpdm_bb_init(&bb);
+            mpdm_bb_add_wcsn(&bb, s, sc);
+            sep = mpdm_bb_detach(&bb, &ss);
+
+            for (bptr = bstr;
+                 bptr < end && (sptr = find_bytes(bptr, end - bptr, sep, ss)) != NULL;
+                 bptr = sptr + ss) {
+                int c = utf8_count(bptr, sptr - bptr);
+
+                mpdm_push(w, mpdm_new_slice_2(v, o, c, bptr - bstr));
+                o += c + sc;
+            }
+
+            /* add last part */
+            mpdm_push(w, mpdm_new_slice_2(v, o, utf8_count(bptr, end - bptr), bptr - bstr));
+
+            free(sep);
+        }
         else {
+            const wchar_t *str;
             wchar_t *sptr;
             int ss;
 
             ss = wcslen(s);
 
             /* travels the string finding separators and creating new values */
-            for (ptr = v->data;
+            for (ptr = str = mpdm_string(v);
                  *ptr != L'\0' && (sptr = wcsstr(ptr, s)) != NULL;
                  ptr = sptr + ss)
-                mpdm_push(w, MPDM_NS(ptr, sptr - ptr));
+                mpdm_push(w, split_part(v, str, ptr, sptr - ptr));
 
             /* add last part */
-            mpdm_push(w, MPDM_S(ptr));
+            mpdm_push(w, split_part(v, str, ptr, wcslen(ptr)));
         }
 
         mpdm_unref(v);
@@ -661,9 +858,10 @@ mpdm_t mpdm_split(const mpdm_t v, const mpdm_t s)
 mpdm_t mpdm_join_wcs(const mpdm_t a, const wchar_t *s)
 {
     int n, c;
-    wchar_t *ptr = NULL;
-    int l = 0;
-    int ss;
+    struct mpdm_sb sb;
+    struct mpdm_bb bb;
+    int ss, bs;
+    int u = 0;
     mpdm_t v, r = NULL;
 
     mpdm_ref(a);
@@ -674,18 +872,44 @@ mpdm_t mpdm_join_wcs(const mpdm_t a, const wchar_t *s)
 
         n = c = 0;
         ss = s ? wcslen(s) : 0;
+        mpdm_sb_init(&sb);
+        mpdm_bb_init(&bb);
 
         while (mpdm_iterator(a, &n, &v, NULL)) {
-            /* add separator */
-            if (c && ss)
-                ptr = mpdm_pokewsn(ptr, &l, s, ss);
+            /* if the first element is UTF-8 (like the lines
+               of a file), the result is built in UTF-8 */
+            if (c == 0)
+                u = mpdm_utf8(v, &bs) != NULL;
+
+            if (u) {
+                if (c && ss)
+                    mpdm_bb_add_wcsn(&bb, s, ss);
+
+                mpdm_bb_add_v(&bb, v);
+            }
+            else {
+                /* add separator */
+                if (c && ss)
+                    mpdm_sb_add_wcsn(&sb, s, ss);
+
+                /* add element */
+                mpdm_sb_add_v(&sb, v);
+            }
 
-            /* add element */
-            ptr = mpdm_pokev(ptr, &l, v);
             c++;
         }
 
-        r = ptr == NULL ? MPDM_S(L"") : MPDM_ENS(ptr, l);
+        if (u) {
+            char *bptr;
+            int l;
+
+            if ((bptr = mpdm_bb_detach(&bb, &l)) != NULL)
+                r = mpdm_new_utf8(bptr, l, 0);
+            else
+                r = MPDM_S(L"");
+        }
+        else
+            r = mpdm_sb_finish(&sb);
 
         break;
 
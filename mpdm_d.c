@@ -26,8 +26,8 @@ wchar_t *(*mpdm_dump_1) (const mpdm_t v, int l, wchar_t *ptr, int *size) = NULL;
 
 /** code **/
 
-static wchar_t *dump_1(const mpdm_t v, int l, wchar_t *ptr, int *size)
-/* dumps one value to the ptr dynamic string with 'l' indenting level */
+static void dump_sb(struct mpdm_sb *sb, const mpdm_t v, int l)
+/* dumps one value to the sb string builder with 'l' indenting level */
 {
     int n;
     wchar_t *wptr;
@@ -36,7 +36,7 @@ static wchar_t *dump_1(const mpdm_t v, int l, wchar_t *ptr, int *size)
 
     /* indent */
     for (n = 0; n < l; n++)
-        ptr = mpdm_pokews(ptr, size, L"  ");
+        mpdm_sb_add_wcs(sb, L"  ");
 
     if (v != NULL) {
         char tmp[256];
@@ -49,38 +49,52 @@ static wchar_t *dump_1(const mpdm_t v, int l, wchar_t *ptr, int *size)
         str = mpdm_string(v);
 
         /* add data type */
-        ptr = mpdm_pokews(ptr, size, mpdm_type_wcs(v));
+        mpdm_sb_add_wcs(sb, mpdm_type_wcs(v));
 
         sprintf(tmp, "(%d,%d):", v->ref - 1, (int) v->size);
 
         /* add refcount, size and flags */
         wptr = mpdm_mbstowcs(tmp, &s, -1);
-        ptr = mpdm_pokews(ptr, size, wptr);
+        mpdm_sb_add_wcsn(sb, wptr, s);
         free(wptr);
 
         /* add the visual representation of the value */
-        ptr = mpdm_pokews(ptr, size, str);
-        ptr = mpdm_pokews(ptr, size, L"\n");
+        mpdm_sb_add_wcs(sb, str);
+        mpdm_sb_add_wcs(sb, L"\n");
 
         if (mpdm_type(v) == MPDM_TYPE_ARRAY) {
             while (mpdm_iterator(v, &c, &w, NULL)) {
-                ptr = dump_1(w, l + 1, ptr, size);
+                dump_sb(sb, w, l + 1);
             }
         }
         else
         if (mpdm_type(v) == MPDM_TYPE_OBJECT) {
             while (mpdm_iterator(v, &c, &w, &i)) {
-                ptr = dump_1(i, l + 1, ptr, size);
-                ptr = dump_1(w, l + 2, ptr, size);
+                dump_sb(sb, i, l + 1);
+                dump_sb(sb, w, l + 2);
             }
         }
     }
     else
-        ptr = mpdm_pokews(ptr, size, L"[NULL]\n");
+        mpdm_sb_add_wcs(sb, L"[NULL]\n");
 
     mpdm_unrefnd(v);
+}
 
-    return ptr;
+
+static wchar_t *dump_1(const mpdm_t v, int l, wchar_t *ptr, int *size)
+/* dumps one value to the ptr dynamic string with 'l' indenting level */
+{
+    struct mpdm_sb sb;
+
+    /* ptr was grown by mpdm_pokews(), so it has room for the null */
+    sb.ptr   = ptr;
+    sb.size  = *size;
+    sb.alloc = ptr ? *size + 1 : 0;
+
+    dump_sb(&sb, v, l);
+
+    return mpdm_sb_detach(&sb, size);
 }
 
 
@@ -70,6 +70,10 @@
 #include <sys/stat.h>
 #endif
 
+#ifdef CONFOPT_MMAP
+#include <sys/mman.h>
+#endif
+
 #include "mpdm.h"
 
 #ifdef CONFOPT_ICONV
@@ -78,6 +82,15 @@
 
 #define MAX_EOL 2
 
+/* size of the byte buffers */
+#define FILE_BUF_SIZE 32768
+
+/* maximum number of bytes taken at once from the read buffer */
+#define FILE_SPAN_MAX (1 << 30)
+
+/* one of each this many lines of mapped files is indexed */
+#define LINE_INDEX_STEP 64
+
 /* file structure */
 struct mpdm_file {
     FILE *in;
@@ -86,6 +99,26 @@ struct mpdm_file {
     int sock;
     int is_pipe;
 
+    /* read buffer */
+    unsigned char *rbuf;
+    long rpos;
+    long rsize;
+    long roff;          /* offset of rbuf from the start */
+    int eof;
+    int chunked;        /* 1: fill by chunks, -1: by lines, 0: unknown */
+    int mapped;         /* rbuf is a read-only map of the whole file */
+
+    /* line index (mapped files only) */
+    long start;         /* offset of the first line (after any BOM) */
+    long *lidx;         /* offsets of one of each LINE_INDEX_STEP lines */
+    int lidx_n;
+    int lines;          /* lines found so far */
+    long lend;          /* offset after the last line found */
+
+    /* write buffer (pipes and sockets only) */
+    char *wbuf;
+    int wsize;
+
     wchar_t eol[MAX_EOL + 1];
     int auto_chomp;
 
@@ -117,36 +150,198 @@ static void store_syserr(void)
 }
 
 
-static int get_byte(struct mpdm_file *f)
-/* reads a byte from a file structure */
+static int is_buffered(struct mpdm_file *f)
+/* returns true if f is a pipe or socket (that has a write buffer) */
 {
-    int c = EOF;
+    return f->is_pipe || f->sock != -1;
+}
 
+
+static int put_raw(const char *ptr, int s, struct mpdm_file *f)
+/* writes s bytes in the buffer in ptr to f */
+{
 #ifdef CONFOPT_WIN32
 
-    if (f->hin != NULL) {
-        char tmp;
+    if (f->hout != NULL) {
         DWORD n;
 
-        if (ReadFile(f->hin, &tmp, 1, &n, NULL) && n > 0)
-            c = (int) tmp;
+        if (WriteFile(f->hout, ptr, s, &n, NULL) && n > 0)
+            s = n;
     }
+    else
+#endif                          /* CONFOPT_WIN32 */
+
+    if (f->out != NULL)
+        s = fwrite(ptr, s, 1, f->out);
+
+    if (f->sock != -1)
+        s = send(f->sock, ptr, s, 0);
+
+    return s;
+}
+
+
+static void flush_buf(struct mpdm_file *f)
+/* sends the pending bytes in the write buffer */
+{
+    if (f->wsize) {
+        put_raw(f->wbuf, f->wsize, f);
+        f->wsize = 0;
+    }
+}
+
+
+static int is_regular(FILE *f)
+/* returns true if f is a regular file */
+{
+    int r = 0;
+
+#if defined(CONFOPT_SYS_STAT_H) && defined(S_ISREG)
+    struct stat s;
+
+    r = fstat(fileno(f), &s) == 0 && S_ISREG(s.st_mode);
+#endif
+
+    return r;
+}
+
+
+static int get_raw(unsigned char *ptr, int s, struct mpdm_file *f)
+/* reads up to s bytes from f into ptr (from pipes and sockets, only
+   the ones available); returns how many (0 on EOF or error) */
+{
+    int n = -1;
+
+#ifdef CONFOPT_WIN32
+
+    if (f->hin != NULL) {
+        DWORD r;
 
+        if (ReadFile(f->hin, ptr, s, &r, NULL))
+            n = r;
+    }
+    else
 #endif /* CONFOPT_WIN32 */
 
-    if (f->in != NULL) {
-        /* read (converting to positive if needed) */
-        if ((c = fgetc(f->in)) < 0 && !feof(f->in))
-            c += 256;
+    if (f->sock != -1)
+        n = recv(f->sock, (char *) ptr, s, 0);
+    else
+    if (f->is_pipe)
+        n = read(fileno(f->in), ptr, s);
+    else
+    if (f->in != NULL)
+        n = fread(ptr, 1, s, f->in);
+
+    if (n <= 0) {
+        n = 0;
+        f->eof = 1;
     }
 
-    if (f->sock != -1) {
-        char b;
+    return n;
+}
 
-        if (recv(f->sock, &b, sizeof(b), 0) == sizeof(b))
-            c = b;
+
+static int buf_avail(struct mpdm_file *f)
+/* returns the number of unread bytes in the read buffer (in spans,
+   as the map of a big file can have more than an int can count) */
+{
+    long k = f->rsize - f->rpos;
+
+    return k > FILE_SPAN_MAX ? FILE_SPAN_MAX : (int) k;
+}
+
+
+static int fill_buf(struct mpdm_file *f)
+/* reads more bytes into the read buffer (after the unread ones), waiting
+   only until some are available; returns how many (0 on EOF or error) */
+{
+    int n = 0;
+    int k = f->rsize - f->rpos;
+
+    /* mapped files have nothing more to read */
+    if (f->mapped) {
+        f->eof = 1;
+        return 0;
     }
 
+    /* pending requests must be sent before waiting for the answer */
+    flush_buf(f);
+
+    if (f->rbuf == NULL)
+        f->rbuf = malloc(FILE_BUF_SIZE);
+
+    /* move the unread bytes to the start */
+    memmove(f->rbuf, f->rbuf + f->rpos, k);
+    f->roff += f->rpos;
+    f->rpos  = 0;
+    f->rsize = k;
+
+    if (f->chunked == 0 && !is_buffered(f) && f->in != NULL)
+        f->chunked = is_regular(f->in) ? 1 : -1;
+
+    if (f->chunked == -1) {
+        /* terminals and the like: not past the end of the line */
+        int c;
+
+        while (k + n < FILE_BUF_SIZE && (c = getc(f->in)) != EOF) {
+            f->rbuf[k + n++] = c;
+
+            if (c == '\n')
+                break;
+        }
+
+        if (n == 0)
+            f->eof = 1;
+    }
+    else
+        n = get_raw(f->rbuf + k, FILE_BUF_SIZE - k, f);
+
+    f->rsize += n;
+
+    return n;
+}
+
+
+static void unread_buf(struct mpdm_file *f)
+/* gives the unread bytes back to the stream, if possible */
+{
+    if (f->mapped)
+        fseek(f->in, f->rpos, SEEK_SET);
+    else
+    if (f->rpos < f->rsize && !is_buffered(f) && f->in != NULL) {
+        fseek(f->in, f->rpos - f->rsize, SEEK_CUR);
+
+        f->roff += f->rpos;
+        f->rpos = f->rsize = 0;
+    }
+}
+
+
+static void rewind_start(struct mpdm_file *f, int pos)
+/* goes back to pos bytes from the start after detecting BOMs or
+   encodings, inside the read buffer if it still has them */
+{
+    if (f->roff == 0 && pos <= f->rsize)
+        f->rpos = pos;
+    else
+    if (!is_buffered(f)) {
+        fseek(f->in, pos, SEEK_SET);
+
+        f->roff = pos;
+        f->rpos = f->rsize = 0;
+        f->eof  = 0;
+    }
+}
+
+
+static int get_byte(struct mpdm_file *f)
+/* reads a byte from a file structure */
+{
+    int c = EOF;
+
+    if (f->rpos < f->rsize || fill_buf(f))
+        c = f->rbuf[f->rpos++];
+
     return c;
 }
 
@@ -154,22 +349,31 @@ static int get_byte(struct mpdm_file *f)
 static int put_buf(const char *ptr, int s, struct mpdm_file *f)
 /* writes s bytes in the buffer in ptr to f */
 {
-#ifdef CONFOPT_WIN32
+    if (is_buffered(f)) {
+        int n = s;
 
-    if (f->hout != NULL) {
-        DWORD n;
+        if (f->wbuf == NULL)
+            f->wbuf = malloc(FILE_BUF_SIZE);
 
-        if (WriteFile(f->hout, ptr, s, &n, NULL) && n > 0)
-            s = n;
-    }
-    else
-#endif                          /* CONFOPT_WIN32 */
+        /* big writes go straight after the pending bytes */
+        if (f->wsize + n > FILE_BUF_SIZE) {
+            flush_buf(f);
 
-    if (f->out != NULL)
-        s = fwrite(ptr, s, 1, f->out);
+            if (n > FILE_BUF_SIZE)
+                s = put_raw(ptr, n, f);
+        }
 
-    if (f->sock != -1)
-        s = send(f->sock, ptr, s, 0);
+        if (n <= FILE_BUF_SIZE) {
+            memcpy(f->wbuf + f->wsize, ptr, n);
+            f->wsize += n;
+        }
+    }
+    else {
+        /* files open for update write where the reading stopped */
+        unread_buf(f);
+
+        s = put_raw(ptr, s, f);
+    }
 
     return s;
 }
@@ -187,65 +391,139 @@ static int put_char(int c, struct mpdm_file *f)
 }
 
 
-static int store_in_line(wchar_t **ptr, int *s, int *eol, wchar_t wc)
-/* store the c in the line, keeping track for EOLs */
+static int write_chunks(struct mpdm_file *f, const wchar_t *str, int w,
+                        int (*enc) (const wchar_t *, int, unsigned char *))
+/* writes str encoding it by chunks with enc, that converts n chars
+   (taking up to w bytes each) and returns the number of bytes;
+   returns the total number of bytes or -1 on error */
 {
-    int done = 0;
+    unsigned char tmp[4096];
+    int cnt = 0;
+    int l = wcslen(str);
+
+    while (cnt != -1 && l > 0) {
+        int n = l < (int) sizeof(tmp) / w ? l : (int) sizeof(tmp) / w;
+        int s = enc(str, n, tmp);
 
-    /* track EOL sequence position */
-    if (eol && *eol == -1) {
-        if (wc == L'\r' || wc == L'\n')
-            *eol = *s;
+        if (s && put_buf((char *) tmp, s, f) <= 0)
+            cnt = -1;
+        else
+            cnt += s;
+
+        str += n;
+        l   -= n;
     }
 
-    /* store */
-    *ptr = mpdm_pokewsn(*ptr, s, &wc, 1);
+    return cnt;
+}
 
-    /* end of line? finish */
-    if (wc == L'\n')
-        done = 1;
 
-    return done;
+static int line_bytes(const unsigned char *ptr, int n)
+/* returns the number of bytes in ptr up to the first newline */
+{
+    const unsigned char *e = memchr(ptr, '\n', n);
+
+    return e ? e - ptr + 1 : n;
 }
 
 
-static wchar_t *read_mbs(struct mpdm_file *f, int *s, int *eol)
-/* reads a multibyte string from a mpdm_file into a dynamic string */
+static wchar_t *read_line(struct mpdm_file *f, int *s, int *eol,
+                          int (*dec) (struct mpdm_file *, const unsigned char *,
+                                      int, wchar_t *, int *))
+/* reads a line, decoding the read buffer by chunks with dec, that
+   returns the chars decoded from up to n bytes (stopping after a
+   newline or before an incomplete sequence) and the bytes used */
 {
-    char tmp[128];
-    wchar_t *ptr = NULL;
-    int c, i = 0;
-    wchar_t wc;
-    mbstate_t ps;
+    struct mpdm_sb sb;
+    int done = 0;
 
-    while ((c = get_byte(f)) != EOF) {
-        int r = -1;
+    mpdm_sb_init(&sb);
 
-        if (i < sizeof(tmp)) {
-            tmp[i++] = c;
+    while (!done && (f->rpos < f->rsize || fill_buf(f))) {
+        int n = buf_avail(f);
+        int o = sb.size;
+        int u = 0;
 
-            /* try to convert what is read by now */
-            memset(&ps, '\0', sizeof(ps));
-            r = mbrtowc(&wc, tmp, i, &ps);
+        /* up to the first newline byte (plus the rest of
+           a wide newline char), as no char takes less than a byte */
+        if ((n = line_bytes(f->rbuf + f->rpos, n) + 3) > buf_avail(f))
+            n = buf_avail(f);
 
-            /* incomplete sequence? keep trying */
-            if (r == -2)
-                continue;
+        mpdm_sb_reserve(&sb, n);
+        sb.size += dec(f, f->rbuf + f->rpos, n, sb.ptr + sb.size, &u);
+        f->rpos += u;
+
+        /* track EOL sequence position */
+        if (eol && *eol == -1) {
+            for (; o < sb.size && sb.ptr[o] != L'\r' && sb.ptr[o] != L'\n'; o++);
+
+            if (o < sb.size)
+                *eol = o;
         }
 
-        if (r == -1) {
-            /* too many failing bytes or invalid sequence;
-               use the Unicode replacement char */
-            wc = L'\xfffd';
+        if (sb.size && sb.ptr[sb.size - 1] == L'\n')
+            done = 1;
+        else
+        if (u == 0 && !fill_buf(f)) {
+            /* incomplete sequence at EOF */
+            mpdm_sb_add_wc(&sb, L'\xfffd');
+            f->rpos = f->rsize;
         }
+    }
 
-        i = 0;
+    return mpdm_sb_detach(&sb, s);
+}
 
-        if (store_in_line(&ptr, s, eol, wc))
-            break;
+
+static int dec_mbs(struct mpdm_file *f, const unsigned char *ptr, int n, wchar_t *wcs, int *u)
+/* multibyte (locale) decoder */
+{
+    int l = line_bytes(ptr, n);
+    int i = 0, o = 0;
+    mbstate_t ps;
+
+    while (i < l) {
+        if (ptr[i] < 0x80) {
+            /* ASCII is the same in all locales */
+            int r = mpdm_ascii_to_wcs((const char *) ptr + i, l - i, wcs + o);
+
+            i += r;
+            o += r;
+        }
+        else {
+            size_t r;
+
+            memset(&ps, '\0', sizeof(ps));
+            r = mbrtowc(wcs + o, (const char *) ptr + i, l - i, &ps);
+
+            /* incomplete sequence at the end of the buffer? wait */
+            if (r == (size_t) -2 && l == n)
+                break;
+
+            if (r == (size_t) -1 || r == (size_t) -2) {
+                /* invalid sequence; use the Unicode replacement char */
+                wcs[o] = L'\xfffd';
+                r = 1;
+            }
+            else
+            if (r == 0)
+                r = 1;
+
+            i += r;
+            o++;
+        }
     }
 
-    return ptr;
+    *u = i;
+
+    return o;
+}
+
+
+static wchar_t *read_mbs(struct mpdm_file *f, int *s, int *eol)
+/* reads a multibyte string from a mpdm_file into a dynamic string */
+{
+    return read_line(f, s, eol, dec_mbs);
 }
 
 
@@ -265,89 +543,81 @@ static int write_wcs(struct mpdm_file *f, const wchar_t *str)
 
 #ifdef CONFOPT_ICONV
 
-static wchar_t *read_iconv(struct mpdm_file *f, int *s, int *eol)
-/* reads a multibyte string transforming with iconv */
+static int dec_iconv(struct mpdm_file *f, const unsigned char *ptr, int n, wchar_t *wcs, int *u)
+/* iconv decoder */
 {
-    char tmp[128];
-    wchar_t *ptr = NULL;
-    int c, i = 0;
-    wchar_t wc;
+    int l = line_bytes(ptr, n);
+    char *iptr = (char *) ptr;
+    char *optr = (char *) wcs;
+    size_t il = l;
+    size_t ol = n * sizeof(wchar_t);
 
-    /* resets the decoder */
-    iconv(f->ic_dec, NULL, NULL, NULL, NULL);
-
-    while ((c = get_byte(f)) != EOF) {
-        size_t il, ol;
-        char *iptr, *optr;
-
-        tmp[i++] = c;
+    while (il && iconv(f->ic_dec, &iptr, &il, &optr, &ol) == (size_t) -1) {
+        /* incomplete sequence at the end of the buffer? wait */
+        if (errno == E2BIG || (errno == EINVAL && l == n))
+            break;
 
-        /* too big? shouldn't happen */
-        if (i == sizeof(tmp))
+        if (ol < sizeof(wchar_t))
             break;
 
-        il = i;
-        iptr = tmp;
-        ol = sizeof(wchar_t);
-        optr = (char *) &wc;
+        /* invalid sequence; use the Unicode replacement char */
+        *((wchar_t *) optr) = L'\xfffd';
+        optr += sizeof(wchar_t);
+        ol   -= sizeof(wchar_t);
+        iptr++;
+        il--;
+    }
 
-        /* write to file */
-        if (iconv(f->ic_dec, &iptr, &il, &optr, &ol) == (size_t) - 1) {
-            /* found incomplete multibyte character */
-            if (errno == EINVAL)
-                continue;
+    *u = iptr - (char *) ptr;
 
-            /* otherwise, return '?' */
-            wc = L'\xfffd';
-        }
+    return (optr - (char *) wcs) / sizeof(wchar_t);
+}
 
-        i = 0;
 
-        if (store_in_line(&ptr, s, eol, wc))
-            break;
-    }
+static wchar_t *read_iconv(struct mpdm_file *f, int *s, int *eol)
+/* reads a multibyte string transforming with iconv */
+{
+    /* resets the decoder */
+    iconv(f->ic_dec, NULL, NULL, NULL, NULL);
 
-    return ptr;
+    return read_line(f, s, eol, dec_iconv);
 }
 
 
 static int write_iconv(struct mpdm_file *f, const wchar_t *str)
 /* writes a wide string to a stream using iconv */
 {
-    char tmp[128];
+    char tmp[4096];
     int cnt = 0;
+    char *iptr = (char *) str;
+    size_t il = wcslen(str) * sizeof(wchar_t);
 
     /* resets the encoder */
     iconv(f->ic_enc, NULL, NULL, NULL, NULL);
 
-    /* convert char by char */
-    for (; *str != L'\0'; str++) {
-        size_t il, ol;
-        char *iptr, *optr;
+    /* convert by chunks */
+    while (cnt != -1 && il) {
+        char *optr = tmp;
+        size_t ol = sizeof(tmp) - 16;
         int n;
 
-        il = sizeof(wchar_t);
-        iptr = (char *) str;
-        ol = sizeof(tmp);
-        optr = tmp;
-
-        /* write to file */
-        if (iconv(f->ic_enc, &iptr, &il, &optr, &ol) == (size_t) - 1) {
-            /* error converting; convert a '?' instead */
+        if (iconv(f->ic_enc, &iptr, &il, &optr, &ol) == (size_t) - 1 && errno != E2BIG) {
+            /* error converting; convert a '?' instead (in the room left) */
             wchar_t q = L'?';
+            char *qptr = (char *) &q;
+            size_t ql = sizeof(wchar_t);
 
-            il = sizeof(wchar_t);
-            iptr = (char *) &q;
-            ol = sizeof(tmp);
-            optr = tmp;
+            ol += 16;
+            iconv(f->ic_enc, &qptr, &ql, &optr, &ol);
 
-            iconv(f->ic_enc, &iptr, &il, &optr, &ol);
+            iptr += sizeof(wchar_t);
+            il   -= sizeof(wchar_t);
         }
 
-        for (n = 0; n < (int) (sizeof(tmp) - ol); n++, cnt++) {
-            if (put_char(tmp[n], f) == EOF)
-                return -1;
-        }
+        if ((n = optr - tmp) && put_buf(tmp, n, f) <= 0)
+            cnt = -1;
+        else
+            cnt += n;
     }
 
     return cnt;
@@ -356,98 +626,97 @@ static int write_iconv(struct mpdm_file *f, const wchar_t *str)
 
 #endif /* CONFOPT_ICONV */
 
-#define BYTE_OR_BREAK(c, f) if((c = get_byte(f)) == EOF) break
+static int dec_utf8(struct mpdm_file *f, const unsigned char *ptr, int n, wchar_t *wcs, int *u)
+/* utf8 decoder */
+{
+    int l = line_bytes(ptr, n);
+
+    /* leave an incomplete sequence at the end of the buffer for later */
+    if (l == n) {
+        int i;
+
+        for (i = l - 1; i >= 0 && i >= l - 3 && (ptr[i] & 0xc0) == 0x80; i--);
+
+        if (i >= 0 && ptr[i] >= 0xc0 &&
+            i + (ptr[i] >= 0xf0 ? 4 : ptr[i] >= 0xe0 ? 3 : 2) > l)
+            l = i;
+    }
+
+    *u = l;
+
+    return mpdm_utf8_to_wcs((const char *) ptr, l, wcs);
+}
+
 
 static wchar_t *read_utf8(struct mpdm_file *f, int *s, int *eol)
 /* utf8 reader */
 {
-    wchar_t *ptr = NULL;
-    wchar_t wc;
-    int c;
+    return read_line(f, s, eol, dec_utf8);
+}
 
-    for (;;) {
-        wc = L'\0';
 
-        BYTE_OR_BREAK(c, f);
+static char *read_utf8_raw(struct mpdm_file *f, int *s, int *eol)
+/* utf8 reader that does not decode (s and eol are in bytes) */
+{
+    char *ptr = NULL;
+    int size = 0;
+    int c = 0;
 
-        if ((c & 0x80) == 0x00)
-            wc = c;
-        else
-        if ((c & 0xe0) == 0xc0) {
-            wc = (c & 0x1f) << 6;
-            BYTE_OR_BREAK(c, f);
-            wc |= (c & 0x3f);
-        }
-        else
-        if ((c & 0xf0) == 0xe0) {
-            wc = (c & 0x0f) << 12;
-            BYTE_OR_BREAK(c, f);
-            wc |= (c & 0x3f) << 6;
-            BYTE_OR_BREAK(c, f);
-            wc |= (c & 0x3f);
+    while (c != '\n' && (f->rpos < f->rsize || fill_buf(f))) {
+        /* take as much of the line as possible from the read buffer */
+        const unsigned char *p = f->rbuf + f->rpos;
+        int n = line_bytes(p, buf_avail(f));
+
+        f->rpos += n;
+        c = p[n - 1];
+
+        /* make room for the bytes and the null terminator */
+        if (*s + n + 1 > size) {
+            size = size ? size * 2 : 64;
+
+            if (size < *s + n + 1)
+                size = *s + n + 1;
+
+            ptr = realloc(ptr, size);
         }
-        else
-        if ((c & 0xf8) == 0xf0) {
-#ifndef CONFOPT_WIN32
-            wc = (c & 0x07) << 18;
-#endif
-            BYTE_OR_BREAK(c, f);
-            wc |= (c & 0x3f) << 12;
-            BYTE_OR_BREAK(c, f);
-            wc |= (c & 0x3f) << 6;
-            BYTE_OR_BREAK(c, f);
-            wc |= (c & 0x3f);
+
+        /* track EOL sequence position */
+        if (*eol == -1) {
+            const unsigned char *e = memchr(p, '\r', n);
+
+            if (e != NULL || c == '\n')
+                *eol = *s + (e != NULL ? e - p : n - 1);
         }
 
-        if (store_in_line(&ptr, s, eol, wc))
-            break;
+        memcpy(ptr + *s, p, n);
+        *s += n;
+    }
+
+    if (ptr != NULL) {
+        ptr[*s] = '\0';
+        ptr = realloc(ptr, *s + 1);
     }
 
     return ptr;
 }
 
 
-static int write_utf8(struct mpdm_file *f, const wchar_t *str)
-/* utf8 writer */
+static int enc_utf8(const wchar_t *wcs, int n, unsigned char *ptr)
+/* utf8 encoder */
 {
-    int cnt = 0;
-    wchar_t wc;
-
-    /* convert char by char */
-    for (; (wc = *str) != L'\0'; str++) {
-        if (wc < 0x80)
-            put_char((int) wc, f);
-        else
-        if (wc < 0x800) {
-            put_char((int) (0xc0 | (wc >> 6)), f);
-            put_char((int) (0x80 | (wc & 0x3f)), f);
-            cnt++;
-        }
-        else
-        if (wc < 0x10000) {
-            put_char((int) (0xe0 | (wc >> 12)), f);
-            put_char((int) (0x80 | ((wc >> 6) & 0x3f)), f);
-            put_char((int) (0x80 | (wc & 0x3f)), f);
-            cnt += 2;
-        }
-        else
-        if (wc < 0x200000) {
-            put_char((int) (0xf0 | (wc >> 18)), f);
-            put_char((int) (0x80 | ((wc >> 12) & 0x3f)), f);
-            put_char((int) (0x80 | ((wc >> 6) & 0x3f)), f);
-            put_char((int) (0x80 | (wc & 0x3f)), f);
-            cnt += 3;
-        }
+    return mpdm_wcs_to_utf8(wcs, n, (char *) ptr);
+}
 
-        cnt++;
-    }
 
-    return cnt;
+static int write_utf8(struct mpdm_file *f, const wchar_t *str)
+/* utf8 writer */
+{
+    return write_chunks(f, str, 4, enc_utf8);
 }
 
 
-static wchar_t *read_utf8_bom(struct mpdm_file *f, int *s, int *eol)
-/* utf-8 reader with BOM detection */
+static void detect_utf8_bom(struct mpdm_file *f)
+/* utf-8 BOM detection */
 {
     wchar_t *enc = L"";
 
@@ -458,13 +727,20 @@ static wchar_t *read_utf8_bom(struct mpdm_file *f, int *s, int *eol)
         enc = L"utf-8bom";
     else {
         enc = L"utf-8";
-        fseek(f->in, 0, SEEK_SET);
+        rewind_start(f, 0);
     }
 
     mpdm_set_wcs(mpdm_root(), MPDM_S(enc), L"DETECTED_ENCODING");
 
     /* we're utf-8 from now on */
     f->f_read = read_utf8;
+}
+
+
+static wchar_t *read_utf8_bom(struct mpdm_file *f, int *s, int *eol)
+/* utf-8 reader with BOM detection */
+{
+    detect_utf8_bom(f);
 
     return f->f_read(f, s, eol);
 }
@@ -485,112 +761,192 @@ static int write_utf8_bom(struct mpdm_file *f, const wchar_t *str)
 }
 
 
-static wchar_t *read_iso8859_1(struct mpdm_file *f, int *s, int *eol)
-/* iso8859-1 reader */
+static int dec_8bit(const unsigned char *ptr, int n, wchar_t *wcs, int *u, wchar_t *cp)
+/* 8 bit decoder; chars over 127 are taken from cp, if any */
 {
-    wchar_t *ptr = NULL;
-    wchar_t wc;
-    int c;
+    int l = line_bytes(ptr, n);
+    int i = 0, o = 0;
 
-    while ((c = get_byte(f)) != EOF) {
-        wc = c;
+    while (i < l) {
+        int c = ptr[i];
 
-        if (store_in_line(&ptr, s, eol, wc))
-            break;
+        if (c < 0x80) {
+            /* copy a run of ASCII chars at once */
+            int r = mpdm_ascii_to_wcs((const char *) ptr + i, l - i, wcs + o);
+
+            i += r;
+            o += r;
+        }
+        else {
+            wcs[o++] = cp != NULL && c > 127 ? cp[c - 127] : (wchar_t) c;
+            i++;
+        }
     }
 
-    return ptr;
+    *u = l;
+
+    return o;
 }
 
 
-static int write_iso8859_1(struct mpdm_file *f, const wchar_t *str)
-/* iso8859-1 writer */
+static int dec_iso8859_1(struct mpdm_file *f, const unsigned char *ptr, int n, wchar_t *wcs, int *u)
+/* iso8859-1 decoder */
 {
-    int cnt = 0;
-    wchar_t wc;
+    return dec_8bit(ptr, n, wcs, u, NULL);
+}
 
-    /* convert char by char */
-    for (; (wc = *str) != L'\0'; str++)
-        put_char(wc <= 0xff ? (int) wc : '?', f);
 
-    return cnt;
+static wchar_t *read_iso8859_1(struct mpdm_file *f, int *s, int *eol)
+/* iso8859-1 reader */
+{
+    return read_line(f, s, eol, dec_iso8859_1);
 }
 
 
-static wchar_t *read_utf16ae(struct mpdm_file *f, int *s, int *eol, int le)
-/* utf16 reader, ANY ending */
+static int enc_8bit(const wchar_t *wcs, int n, unsigned char *ptr, wchar_t *cp)
+/* 8 bit encoder; chars over 127 are searched in cp, if any */
 {
-    wchar_t *ptr = NULL;
-    wchar_t wc;
-    int c1, c2;
+    int i = 0;
 
-    for (;;) {
-        wc = L'\0';
+    while (i < n) {
+        wchar_t wc = wcs[i];
 
-        BYTE_OR_BREAK(c1, f);
-        BYTE_OR_BREAK(c2, f);
+        if (wc >= 0 && wc < 0x80) {
+            /* copy a run of ASCII chars at once */
+            i += mpdm_ascii_to_mbs(wcs + i, n - i, (char *) ptr + i);
+        }
+        else {
+            int c = '?';
+
+            if (cp == NULL) {
+                if (wc >= 0 && wc <= 0xff)
+                    c = wc;
+            }
+            else {
+                int m;
 
+                for (m = 0; c == '?' && cp[m]; m++) {
+                    if (wc == cp[m])
+                        c = 127 + m;
+                }
+            }
+
+            ptr[i++] = c;
+        }
+    }
+
+    return n;
+}
+
+
+static int enc_iso8859_1(const wchar_t *wcs, int n, unsigned char *ptr)
+/* iso8859-1 encoder */
+{
+    return enc_8bit(wcs, n, ptr, NULL);
+}
+
+
+static int write_iso8859_1(struct mpdm_file *f, const wchar_t *str)
+/* iso8859-1 writer */
+{
+    return write_chunks(f, str, 1, enc_iso8859_1);
+}
+
+
+static int dec_utf16ae(const unsigned char *ptr, int n, wchar_t *wcs, int *u, int le)
+/* utf16 decoder, ANY ending */
+{
+    int i, o = 0;
+    wchar_t wc = L'\0';
+
+    /* decode whole units up to a newline */
+    for (i = 0; i + 2 <= n && wc != L'\n'; i += 2) {
         if (le)
-            wc = c1 | (c2 << 8);
+            wc = ptr[i] | (ptr[i + 1] << 8);
         else
-            wc = c2 | (c1 << 8);
+            wc = ptr[i + 1] | (ptr[i] << 8);
 
-        if (store_in_line(&ptr, s, eol, wc))
-            break;
+        wcs[o++] = wc;
     }
 
-    return ptr;
+    *u = i;
+
+    return o;
 }
 
 
-static int write_utf16ae(struct mpdm_file *f, const wchar_t *str, int le)
-/* utf16 writer, ANY ending */
+static int enc_utf16ae(const wchar_t *wcs, int n, unsigned char *ptr, int le)
+/* utf16 encoder, ANY ending */
 {
-    int cnt = 0;
-    wchar_t wc;
+    int i;
 
-    /* convert char by char */
-    for (; (wc = *str) != L'\0'; str++) {
+    for (i = 0; i < n; i++) {
+        wchar_t wc = wcs[i];
 
         if (le) {
-            put_char(wc & 0xff, f);
-            put_char((wc & 0xff00) >> 8, f);
+            *ptr++ = wc & 0xff;
+            *ptr++ = (wc & 0xff00) >> 8;
         }
         else {
-            put_char((wc & 0xff00) >> 8, f);
-            put_char(wc & 0xff, f);
+            *ptr++ = (wc & 0xff00) >> 8;
+            *ptr++ = wc & 0xff;
         }
     }
 
-    return cnt;
+    return n * 2;
+}
+
+
+static int dec_utf16le(struct mpdm_file *f, const unsigned char *ptr, int n, wchar_t *wcs, int *u)
+{
+    return dec_utf16ae(ptr, n, wcs, u, 1);
 }
 
 
 static wchar_t *read_utf16le(struct mpdm_file *f, int *s, int *eol)
 {
-    return read_utf16ae(f, s, eol, 1);
+    return read_line(f, s, eol, dec_utf16le);
+}
+
+
+static int enc_utf16le(const wchar_t *wcs, int n, unsigned char *ptr)
+{
+    return enc_utf16ae(wcs, n, ptr, 1);
 }
 
 
 static int write_utf16le(struct mpdm_file *f, const wchar_t *str)
 {
-    return write_utf16ae(f, str, 1);
+    return write_chunks(f, str, 2, enc_utf16le);
+}
+
+
+static int dec_utf16be(struct mpdm_file *f, const unsigned char *ptr, int n, wchar_t *wcs, int *u)
+{
+    return dec_utf16ae(ptr, n, wcs, u, 0);
 }
 
 
 static wchar_t *read_utf16be(struct mpdm_file *f, int *s, int *eol)
 {
-    return read_utf16ae(f, s, eol, 0);
+    return read_line(f, s, eol, dec_utf16be);
+}
+
+
+static int enc_utf16be(const wchar_t *wcs, int n, unsigned char *ptr)
+{
+    return enc_utf16ae(wcs, n, ptr, 0);
 }
 
 
 static int write_utf16be(struct mpdm_file *f, const wchar_t *str)
 {
-    return write_utf16ae(f, str, 0);
+    return write_chunks(f, str, 2, enc_utf16be);
 }
 
 
-static wchar_t *read_utf16(struct mpdm_file *f, int *s, int *eol)
+static void detect_utf16(struct mpdm_file *f)
+/* utf-16 BOM detection */
 {
     int c1, c2;
     wchar_t *enc = L"utf-16le";
@@ -609,10 +965,16 @@ static wchar_t *read_utf16(struct mpdm_file *f, int *s, int *eol)
     else
     if (c1 != 0xff || c2 != 0xfe) {
         /* no BOM; rewind and hope */
-        fseek(f->in, 0, SEEK_SET);
+        rewind_start(f, 0);
     }
 
     mpdm_set_wcs(mpdm_root(), MPDM_S(enc), L"DETECTED_ENCODING");
+}
+
+
+static wchar_t *read_utf16(struct mpdm_file *f, int *s, int *eol)
+{
+    detect_utf16(f);
 
     return f->f_read(f, s, eol);
 }
@@ -644,86 +1006,104 @@ static int write_utf16be_bom(struct mpdm_file *f, const wchar_t *str)
 }
 
 
-static wchar_t *read_utf32ae(struct mpdm_file *f, int *s, int *eol, int le)
-/* utf32 reader, ANY ending */
+static int dec_utf32ae(const unsigned char *ptr, int n, wchar_t *wcs, int *u, int le)
+/* utf32 decoder, ANY ending */
 {
-    wchar_t *ptr = NULL;
-    wchar_t wc;
-    int c1, c2, c3, c4;
-
-    for (;;) {
-        wc = L'\0';
-
-        BYTE_OR_BREAK(c1, f);
-        BYTE_OR_BREAK(c2, f);
-        BYTE_OR_BREAK(c3, f);
-        BYTE_OR_BREAK(c4, f);
+    int i, o = 0;
+    wchar_t wc = L'\0';
 
+    /* decode whole units up to a newline */
+    for (i = 0; i + 4 <= n && wc != L'\n'; i += 4) {
         if (le)
-            wc = c1 | (c2 << 8) | (c3 << 16) | (c4 << 24);
+            wc = ptr[i] | (ptr[i + 1] << 8) | (ptr[i + 2] << 16) | ((unsigned int) ptr[i + 3] << 24);
         else
-            wc = c4 | (c3 << 8) | (c2 << 16) | (c1 << 24);
+            wc = ptr[i + 3] | (ptr[i + 2] << 8) | (ptr[i + 1] << 16) | ((unsigned int) ptr[i] << 24);
 
-        if (store_in_line(&ptr, s, eol, wc))
-            break;
+        wcs[o++] = wc;
     }
 
-    return ptr;
+    *u = i;
+
+    return o;
 }
 
 
-static int write_utf32ae(struct mpdm_file *f, const wchar_t *str, int le)
-/* utf32 writer, ANY ending */
+static int enc_utf32ae(const wchar_t *wcs, int n, unsigned char *ptr, int le)
+/* utf32 encoder, ANY ending */
 {
-    int cnt = 0;
-    wchar_t wc;
+    int i;
 
-    /* convert char by char */
-    for (; (wc = *str) != L'\0'; str++) {
+    for (i = 0; i < n; i++) {
+        wchar_t wc = wcs[i];
 
         if (le) {
-            put_char((wc & 0x000000ff), f);
-            put_char((wc & 0x0000ff00) >> 8, f);
-            put_char((wc & 0x00ff0000) >> 16, f);
-            put_char((wc & 0xff000000) >> 24, f);
+            *ptr++ = (wc & 0x000000ff);
+            *ptr++ = (wc & 0x0000ff00) >> 8;
+            *ptr++ = (wc & 0x00ff0000) >> 16;
+            *ptr++ = (wc & 0xff000000) >> 24;
         }
         else {
-            put_char((wc & 0xff000000) >> 24, f);
-            put_char((wc & 0x00ff0000) >> 16, f);
-            put_char((wc & 0x0000ff00) >> 8, f);
-            put_char((wc & 0x000000ff), f);
+            *ptr++ = (wc & 0xff000000) >> 24;
+            *ptr++ = (wc & 0x00ff0000) >> 16;
+            *ptr++ = (wc & 0x0000ff00) >> 8;
+            *ptr++ = (wc & 0x000000ff);
         }
     }
 
-    return cnt;
+    return n * 4;
+}
+
+
+static int dec_utf32le(struct mpdm_file *f, const unsigned char *ptr, int n, wchar_t *wcs, int *u)
+{
+    return dec_utf32ae(ptr, n, wcs, u, 1);
 }
 
 
 static wchar_t *read_utf32le(struct mpdm_file *f, int *s, int *eol)
 {
-    return read_utf32ae(f, s, eol, 1);
+    return read_line(f, s, eol, dec_utf32le);
+}
+
+
+static int enc_utf32le(const wchar_t *wcs, int n, unsigned char *ptr)
+{
+    return enc_utf32ae(wcs, n, ptr, 1);
 }
 
 
 static int write_utf32le(struct mpdm_file *f, const wchar_t *str)
 {
-    return write_utf32ae(f, str, 1);
+    return write_chunks(f, str, 4, enc_utf32le);
+}
+
+
+static int dec_utf32be(struct mpdm_file *f, const unsigned char *ptr, int n, wchar_t *wcs, int *u)
+{
+    return dec_utf32ae(ptr, n, wcs, u, 0);
 }
 
 
 static wchar_t *read_utf32be(struct mpdm_file *f, int *s, int *eol)
 {
-    return read_utf32ae(f, s, eol, 0);
+    return read_line(f, s, eol, dec_utf32be);
+}
+
+
+static int enc_utf32be(const wchar_t *wcs, int n, unsigned char *ptr)
+{
+    return enc_utf32ae(wcs, n, ptr, 0);
 }
 
 
 static int write_utf32be(struct mpdm_file *f, const wchar_t *str)
 {
-    return write_utf32ae(f, str, 0);
+    return write_chunks(f, str, 4, enc_utf32be);
 }
 
 
-static wchar_t *read_utf32(struct mpdm_file *f, int *s, int *eol)
+static void detect_utf32(struct mpdm_file *f)
+/* utf-32 BOM detection */
 {
     int c1, c2, c3, c4;
     wchar_t *enc = L"utf-32le";
@@ -742,10 +1122,16 @@ static wchar_t *read_utf32(struct mpdm_file *f, int *s, int *eol)
     }
     if (c1 != 0xff || c2 != 0xfe || c3 != 0 || c4 != 0) {
         /* no BOM; assume le and hope */
-        fseek(f->in, 0, SEEK_SET);
+        rewind_start(f, 0);
     }
 
     mpdm_set_wcs(mpdm_root(), MPDM_S(enc), L"DETECTED_ENCODING");
+}
+
+
+static wchar_t *read_utf32(struct mpdm_file *f, int *s, int *eol)
+{
+    detect_utf32(f);
 
     return f->f_read(f, s, eol);
 }
@@ -835,95 +1221,79 @@ static wchar_t *windows_1252 = L"\x2302"
     "\x00F0\x00F1\x00F2\x00F3\x00F4\x00F5\x00F6\x00F7"
     "\x00F8\x00F9\x00FA\x00FB\x00FC\x00FD\x00FE\x00FF";
 
-static wchar_t *read_msdos(struct mpdm_file *f, int *s, int *eol, wchar_t *cp)
-/* generic MSDOS reader */
+static int dec_msdos_437(struct mpdm_file *f, const unsigned char *ptr, int n, wchar_t *wcs, int *u)
 {
-    wchar_t *ptr = NULL;
-    wchar_t wc;
-    int c;
+    return dec_8bit(ptr, n, wcs, u, msdos_437);
+}
 
-    while ((c = get_byte(f)) != EOF) {
 
-        if (c > 127)
-            wc = cp[c - 127];
-        else
-            wc = c;
+static wchar_t *read_msdos_437(struct mpdm_file *f, int *s, int *eol)
+{
+    return read_line(f, s, eol, dec_msdos_437);
+}
 
-        if (store_in_line(&ptr, s, eol, wc))
-            break;
-    }
 
-    return ptr;
+static int enc_msdos_437(const wchar_t *wcs, int n, unsigned char *ptr)
+{
+    return enc_8bit(wcs, n, ptr, msdos_437);
 }
 
 
-static int write_msdos(struct mpdm_file *f, const wchar_t *str, wchar_t *cp)
-/* generic MSDOS writer */
+static int write_msdos_437(struct mpdm_file *f, const wchar_t *str)
 {
-    int cnt = 0;
-    wchar_t wc;
-
-    /* convert char by char */
-    for (; (wc = *str) != L'\0'; str++) {
-        int c = wc;
+    return write_chunks(f, str, 1, enc_msdos_437);
+}
 
-        if (c > 0xff)
-            c = '?';
-        else
-        if (c >= 127) {
-            int n;
 
-            c = '?';
-            for (n = 0; c == '?' && cp[n]; n++) {
-                if (wc == cp[n])
-                    c = 127 + n;
-            }
-        }
+static int dec_msdos_850(struct mpdm_file *f, const unsigned char *ptr, int n, wchar_t *wcs, int *u)
+{
+    return dec_8bit(ptr, n, wcs, u, msdos_850);
+}
 
-        put_char(c, f);
-    }
 
-    return cnt;
+static wchar_t *read_msdos_850(struct mpdm_file *f, int *s, int *eol)
+{
+    return read_line(f, s, eol, dec_msdos_850);
 }
 
 
-static wchar_t *read_msdos_437(struct mpdm_file *f, int *s, int *eol)
+static int enc_msdos_850(const wchar_t *wcs, int n, unsigned char *ptr)
 {
-    return read_msdos(f, s, eol, msdos_437);
+    return enc_8bit(wcs, n, ptr, msdos_850);
 }
 
 
-static int write_msdos_437(struct mpdm_file *f, const wchar_t *str)
+static int write_msdos_850(struct mpdm_file *f, const wchar_t *str)
 {
-    return write_msdos(f, str, msdos_437);
+    return write_chunks(f, str, 1, enc_msdos_850);
 }
 
 
-static wchar_t *read_msdos_850(struct mpdm_file *f, int *s, int *eol)
+static int dec_windows_1252(struct mpdm_file *f, const unsigned char *ptr, int n, wchar_t *wcs, int *u)
 {
-    return read_msdos(f, s, eol, msdos_850);
+    return dec_8bit(ptr, n, wcs, u, windows_1252);
 }
 
 
-static int write_msdos_850(struct mpdm_file *f, const wchar_t *str)
+static wchar_t *read_windows_1252(struct mpdm_file *f, int *s, int *eol)
 {
-    return write_msdos(f, str, msdos_850);
+    return read_line(f, s, eol, dec_windows_1252);
 }
 
 
-static wchar_t *read_windows_1252(struct mpdm_file *f, int *s, int *eol)
+static int enc_windows_1252(const wchar_t *wcs, int n, unsigned char *ptr)
 {
-    return read_msdos(f, s, eol, windows_1252);
+    return enc_8bit(wcs, n, ptr, windows_1252);
 }
 
 
 static int write_windows_1252(struct mpdm_file *f, const wchar_t *str)
 {
-    return write_msdos(f, str, windows_1252);
+    return write_chunks(f, str, 1, enc_windows_1252);
 }
 
 
-static wchar_t *read_auto(struct mpdm_file *f, int *s, int *eol)
+static void detect_auto(struct mpdm_file *f)
 /* autodetects different encodings based on the BOM */
 {
     wchar_t *enc = L"";
@@ -948,7 +1318,7 @@ static wchar_t *read_auto(struct mpdm_file *f, int *s, int *eol)
                 }
                 else {
                     /* rewind to 3rd character */
-                    fseek(f->in, 2, SEEK_SET);
+                    rewind_start(f, 2);
 
                     enc = L"utf-16le";
                     f->f_read = read_utf16le;
@@ -1025,29 +1395,68 @@ static wchar_t *read_auto(struct mpdm_file *f, int *s, int *eol)
         }
 
         /* none of the above; restart */
-        fseek(f->in, 0, SEEK_SET);
+        rewind_start(f, 0);
     }
 
 got_encoding:
     mpdm_set_wcs(mpdm_root(), MPDM_S(enc), L"DETECTED_ENCODING");
+}
+
+
+static wchar_t *read_auto(struct mpdm_file *f, int *s, int *eol)
+/* reader with encoding autodetection */
+{
+    detect_auto(f);
 
     return f->f_read(f, s, eol);
 }
 
 
+static void detect_encoding(struct mpdm_file *f)
+/* resolves the encodings detected on the first read, storing
+   where the text starts (i.e. after the BOM, if any) */
+{
+    wchar_t *(*f_read) (struct mpdm_file *, int *, int *) = f->f_read;
+
+    if (f_read == read_auto)
+        detect_auto(f);
+    else
+    if (f_read == read_utf8_bom)
+        detect_utf8_bom(f);
+    else
+    if (f_read == read_utf16)
+        detect_utf16(f);
+    else
+    if (f_read == read_utf32)
+        detect_utf32(f);
+
+    if (f->f_read != f_read)
+        f->start = f->roff + f->rpos;
+}
+
+
 /** interface **/
 
 wchar_t *mpdm_read_mbs(FILE *f, int *s)
 /* reads a multibyte string from a stream into a dynamic string */
 {
     struct mpdm_file fs;
+    wchar_t *ptr;
 
     /* reset the structure */
     memset(&fs, '\0', sizeof(fs));
-    fs.in = f;
+    fs.sock = -1;
+    fs.in   = f;
+
+    /* don't read ahead from the caller's stream */
+    fs.chunked = -1;
 
     *s = 0;
-    return read_mbs(&fs, s, NULL);
+    ptr = read_mbs(&fs, s, NULL);
+
+    free(fs.rbuf);
+
+    return ptr;
 }
 
 
@@ -1058,12 +1467,38 @@ int mpdm_write_wcs(FILE *f, const wchar_t *str)
 
     /* reset the structure */
     memset(&fs, '\0', sizeof(fs));
-    fs.out = f;
+    fs.sock = -1;
+    fs.out  = f;
 
     return write_wcs(&fs, str);
 }
 
 
+static void map_file(struct mpdm_file *f)
+/* maps a regular file open for reading as its read buffer */
+{
+#if defined(CONFOPT_MMAP) && defined(CONFOPT_SYS_STAT_H) && defined(S_ISREG)
+    struct stat s;
+
+    if (fstat(fileno(f->in), &s) != -1 && S_ISREG(s.st_mode) &&
+        (size_t) s.st_size == s.st_size) {
+        void *p = NULL;
+
+        /* empty files have nothing to map */
+        if (s.st_size == 0 ||
+            (p = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fileno(f->in), 0)) != MAP_FAILED) {
+            f->rbuf    = p;
+            f->rsize   = s.st_size;
+            f->rpos    = 0;
+            f->roff    = 0;
+            f->mapped  = 1;
+            f->chunked = 1;
+        }
+    }
+#endif
+}
+
+
 /**
  * mpdm_open - Opens a file.
  * @filename: the file name
@@ -1081,6 +1516,11 @@ int mpdm_write_wcs(FILE *f, const wchar_t *str)
  * If the file is open for writing, the encoding to be used is read from
  * the ENCODING element of mpdm_root() and, if not set, from the
  * TEMP_ENCODING one. The latter will always be deleted afterwards.
+ *
+ * If @mode includes a 'm' and the file is open only for reading, the
+ * file is mapped into memory (if the system supports it), so that it's
+ * read without any copy and mpdm_fline() and mpdm_flines() can be used
+ * to access its lines. The file should not be truncated while open.
  * [File Management]
  */
 mpdm_t mpdm_open(mpdm_t filename, mpdm_t mode)
@@ -1088,6 +1528,8 @@ mpdm_t mpdm_open(mpdm_t filename, mpdm_t mode)
     FILE *f = NULL;
     mpdm_t fn;
     mpdm_t fm;
+    mpdm_t v = NULL;
+    int map = 0;
 
     /* extreme lazyness */
     if (mode == NULL)
@@ -1098,8 +1540,22 @@ mpdm_t mpdm_open(mpdm_t filename, mpdm_t mode)
 
     if (filename != NULL && mode != NULL) {
         /* convert to mbs,s */
-        fn = mpdm_ref(MPDM_2MBS(filename->data));
-        fm = mpdm_ref(MPDM_2MBS(mode->data));
+        fn = mpdm_ref(MPDM_2MBS(mpdm_string(filename)));
+        fm = mpdm_ref(MPDM_2MBS(mpdm_string(mode)));
+
+        /* the map flag is not for fopen() */
+        if (strchr((char *) fm->data, 'm') != NULL) {
+            char *p = (char *) fm->data;
+            int n, i;
+
+            for (n = i = 0; p[n]; n++) {
+                if (p[n] != 'm')
+                    p[i++] = p[n];
+            }
+
+            p[i] = '\0';
+            map  = p[0] == 'r' && strchr(p, '+') == NULL;
+        }
 
         if ((f = fopen((char *) fn->data, (char *) fm->data)) == NULL)
             store_syserr();
@@ -1125,7 +1581,14 @@ mpdm_t mpdm_open(mpdm_t filename, mpdm_t mode)
     mpdm_unref(mode);
     mpdm_unref(filename);
 
-    return f ? MPDM_F(f) : NULL;
+    if (f != NULL) {
+        v = MPDM_F(f);
+
+        if (map)
+            map_file((struct mpdm_file *) v->data);
+    }
+
+    return v;
 }
 
 
@@ -1142,30 +1605,54 @@ mpdm_t mpdm_read(const mpdm_t fd)
     mpdm_t v = NULL;
 
     if (mpdm_type(fd) == MPDM_TYPE_FILE) {
-        wchar_t *ptr;
+        wchar_t *ptr = NULL;
+        char *bptr = NULL;
         int s = 0;
         int eol = -1;
         struct mpdm_file *fs = (struct mpdm_file *) fd->data;
 
-        ptr = fs->f_read(fs, &s, &eol);
+        /* resolve the encoding before reading */
+        detect_encoding(fs);
+
+        /* utf-8 lines are not decoded */
+        if (fs->f_read == read_utf8)
+            bptr = read_utf8_raw(fs, &s, &eol);
+        else
+            ptr = fs->f_read(fs, &s, &eol);
 
-        if (ptr != NULL) {
+        if (ptr != NULL || bptr != NULL) {
             /* something read; does it have an eol? */
             if (eol != -1) {
                 /* store */
-                wcsncpy(fs->eol, &ptr[eol], MAX_EOL);
+                if (ptr != NULL)
+                    wcsncpy(fs->eol, &ptr[eol], MAX_EOL);
+                else {
+                    int n;
+
+                    for (n = 0; n < MAX_EOL && bptr[eol + n]; n++)
+                        fs->eol[n] = (unsigned char) bptr[eol + n];
+
+                    fs->eol[n] = L'\0';
+                }
 
                 /* if auto_chomp is set, delete the eol */
                 if (fs->auto_chomp) {
                     s -= wcslen(fs->eol);
-                    ptr[s] = L'\0';
+
+                    if (ptr != NULL)
+                        ptr[s] = L'\0';
+                    else
+                        bptr[s] = '\0';
                 }
             }
             else
                 fs->eol[0] = L'\0';
 
-            /* return the line */
-            v = MPDM_ENS(ptr, s);
+            /* return the line, stored as compact as possible */
+            if (ptr != NULL)
+                v = mpdm_new_compact(ptr, s, 0);
+            else
+                v = mpdm_new_utf8(bptr, s, 0);
         }
         else {
             /* nothing read; if last read had an eol,
@@ -1229,6 +1716,8 @@ int mpdm_putchar(const mpdm_t fd, const mpdm_t c)
 
         if (put_char(*ptr, fs) == -1)
             r = 0;
+
+        flush_buf(fs);
     }
 
     mpdm_unref(c);
@@ -1254,8 +1743,57 @@ int mpdm_write(const mpdm_t fd, const mpdm_t v)
 
     if (mpdm_type(fd) == MPDM_TYPE_FILE) {
         struct mpdm_file *fs = (struct mpdm_file *) fd->data;
+        const char *ptr;
+        int l;
+
+        ptr = mpdm_utf8(v, &l);
+
+        if (ptr != NULL && (fs->f_write == write_utf8 || fs->f_write == write_utf8_bom)) {
+            /* UTF-8 strings are written as is (after the BOM, if any) */
+            if (fs->f_write == write_utf8_bom)
+                fs->f_write(fs, L"");
+
+            ret = l == 0 || put_buf(ptr, l, fs) > 0 ? l : -1;
+        }
+        else
+        if (mpdm_type(v) == MPDM_TYPE_STRING && (v->flags & MPDM_F_LATIN1) &&
+            fs->f_write == write_iso8859_1) {
+            /* so are 1 byte strings into iso8859-1 files */
+            ret = mpdm_size(v) == 0 ||
+                put_buf((char *) v->data, mpdm_size(v), fs) > 0 ? mpdm_size(v) : -1;
+        }
+        else
+        if (ptr != NULL && !(v->flags & MPDM_F_LATIN1)) {
+            /* decode into a temporary buffer, as UTF-8
+               has no random access to do it by chunks */
+            wchar_t *wptr = malloc((mpdm_size(v) + 1) * sizeof(wchar_t));
+
+            wptr[mpdm_string_n(v, 0, wptr, mpdm_size(v))] = L'\0';
+            ret = fs->f_write(fs, wptr);
+            free(wptr);
+        }
+        else
+        if (mpdm_type(v) == MPDM_TYPE_STRING && (v->flags & MPDM_F_REPR)) {
+            /* write compact strings by chunks, without converting them */
+            wchar_t tmp[256];
+            int n, o = 0;
+
+            ret = 0;
+            while (ret != -1 && (n = mpdm_string_n(v, o, tmp, 255)) > 0) {
+                tmp[n] = L'\0';
+                o += n;
+
+                if ((n = fs->f_write(fs, tmp)) == -1)
+                    ret = -1;
+                else
+                    ret += n;
+            }
+        }
+        else
+            ret = fs->f_write(fs, mpdm_string(v));
 
-        ret = fs->f_write(fs, mpdm_string(v));
+        /* pipes and sockets are interactive */
+        flush_buf(fs);
     }
 
     mpdm_unref(v);
@@ -1267,8 +1805,35 @@ int mpdm_write(const mpdm_t fd, const mpdm_t v)
 int mpdm_fseek(const mpdm_t fd, long offset, int whence)
 {
     struct mpdm_file *fs = (struct mpdm_file *) fd->data;
+    int r = -1;
+
+    if (fs->mapped) {
+        /* just move inside the map */
+        if (whence == SEEK_CUR)
+            offset += fs->rpos;
+        else
+        if (whence == SEEK_END)
+            offset += fs->rsize;
+
+        if (offset >= 0 && offset <= fs->rsize) {
+            fs->rpos = offset;
+            fs->eof  = 0;
+            r = 0;
+        }
+    }
+    else {
+        /* the unread bytes in the buffer are dropped */
+        if (whence == SEEK_CUR)
+            offset -= fs->rsize - fs->rpos;
+
+        fs->rpos = fs->rsize = 0;
+        fs->eof  = 0;
+
+        if ((r = fseek(fs->in, offset, whence)) != -1)
+            fs->roff = ftell(fs->in);
+    }
 
-    return fseek(fs->in, offset, whence);
+    return r;
 }
 
 
@@ -1276,7 +1841,8 @@ long mpdm_ftell(const mpdm_t fd)
 {
     struct mpdm_file *fs = (struct mpdm_file *) fd->data;
 
-    return ftell(fs->in);
+    /* minus the bytes read ahead */
+    return fs->mapped ? fs->rpos : ftell(fs->in) - (fs->rsize - fs->rpos);
 }
 
 
@@ -1284,7 +1850,7 @@ int mpdm_feof(const mpdm_t fd)
 {
     struct mpdm_file *fs = (struct mpdm_file *) fd->data;
 
-    return feof(fs->in);
+    return fs->eof && fs->rpos == fs->rsize;
 }
 
 
@@ -1294,6 +1860,9 @@ FILE *mpdm_get_filehandle(const mpdm_t fd)
 
     if (mpdm_type(fd) == MPDM_TYPE_FILE) {
         struct mpdm_file *fs = (struct mpdm_file *) fd->data;
+
+        /* the stream must be where the reading stopped */
+        unread_buf(fs);
         f = fs->in;
     }
 
@@ -1301,16 +1870,258 @@ FILE *mpdm_get_filehandle(const mpdm_t fd)
 }
 
 
-/*
+/**
+ * mpdm_bread - Reads a block of bytes from a file.
+ * @fd: the file descriptor
+ * @size: the maximum number of bytes to read
+ *
+ * Reads up to @size bytes from @fd, without any decoding, and returns
+ * them as a bytes value (or NULL on EOF or if no memory could be
+ * allocated). From regular files, @size bytes are read unless the end
+ * of the file is reached; from pipes and sockets, it returns as soon
+ * as some bytes are available. Memory is allocated as the bytes
+ * arrive, so @size can be much bigger than the data.
+ * [File Management]
+ */
 mpdm_t mpdm_bread(mpdm_t fd, int size)
 {
+    mpdm_t r = NULL;
+
+    if (mpdm_type(fd) == MPDM_TYPE_FILE && size > 0) {
+        struct mpdm_file *fs = (struct mpdm_file *) fd->data;
+        int a = size < FILE_BUF_SIZE ? size : FILE_BUF_SIZE;
+        unsigned char *ptr = malloc(a);
+        int n = 0;
+
+        while (ptr != NULL && n < size && !(n && is_buffered(fs))) {
+            int k = buf_avail(fs);
+
+            if (n == a) {
+                /* full: grow as bytes arrive, up to size */
+                unsigned char *p;
+                int na = a < size - a ? a * 2 : size;
+
+                if ((p = realloc(ptr, na)) == NULL)
+                    break;
+
+                ptr = p;
+                a   = na;
+            }
+
+            if (k) {
+                /* take the already buffered bytes first */
+                if (k > a - n)
+                    k = a - n;
+
+                memcpy(ptr + n, fs->rbuf + fs->rpos, k);
+                fs->rpos += k;
+            }
+            else
+            if (a - n >= FILE_BUF_SIZE && !fs->mapped) {
+                /* big blocks are read directly */
+                flush_buf(fs);
+                fs->roff += fs->rpos;
+                fs->rpos = fs->rsize = 0;
+
+                if ((k = get_raw(ptr + n, a - n, fs)) == 0)
+                    break;
+
+                fs->roff += k;
+            }
+            else
+            if (fill_buf(fs) == 0)
+                break;
+
+            n += k;
+        }
+
+        if (n) {
+            unsigned char *p = realloc(ptr, n);
+
+            r = mpdm_new(MPDM_TYPE_BYTES, p ? p : ptr, n);
+        }
+        else
+            free(ptr);
+    }
+
+    return r;
 }
 
 
-int mpdm_bwrite(mpdm_tfd, mpdm_t v, int size)
+/**
+ * mpdm_bwrite - Writes a block of bytes into a file.
+ * @fd: the file descriptor
+ * @v: the value
+ * @size: the number of bytes to write (-1, all of them)
+ *
+ * Writes the first @size bytes of the bytes value @v into @fd,
+ * without any encoding. Returns the number of bytes written,
+ * or -1 on error.
+ * [File Management]
+ */
+int mpdm_bwrite(mpdm_t fd, mpdm_t v, int size)
 {
+    int ret = -1;
+
+    mpdm_ref(v);
+
+    if (mpdm_type(fd) == MPDM_TYPE_FILE && mpdm_type(v) == MPDM_TYPE_BYTES) {
+        struct mpdm_file *fs = (struct mpdm_file *) fd->data;
+
+        if (size < 0 || size > mpdm_size(v))
+            size = mpdm_size(v);
+
+        ret = size == 0 || put_buf((char *) v->data, size, fs) > 0 ? size : -1;
+
+        /* pipes and sockets are interactive */
+        flush_buf(fs);
+    }
+
+    mpdm_unref(v);
+
+    return ret;
+}
+
+
+static long next_line(struct mpdm_file *f, long off)
+/* returns the offset of the line after the one at off in a mapped file */
+{
+    if (f->f_read == read_utf8 || f->f_read == read_mbs ||
+        f->f_read == read_iso8859_1 || f->f_read == read_msdos_437 ||
+        f->f_read == read_msdos_850 || f->f_read == read_windows_1252) {
+        /* a newline byte is always a newline char */
+        const unsigned char *e = memchr(f->rbuf + off, '\n', f->rsize - off);
+
+        off = e != NULL ? e - f->rbuf + 1 : f->rsize;
+    }
+    else {
+        /* other encodings must be decoded */
+        long pos = f->rpos;
+        int s = 0;
+        int eol = -1;
+
+        f->rpos = off;
+        free(f->f_read(f, &s, &eol));
+
+        off = f->rpos;
+        f->rpos = pos;
+    }
+
+    return off;
+}
+
+
+static void index_lines(struct mpdm_file *f, int n)
+/* indexes the lines of a mapped file up to line n (-1, all);
+   if memory is exhausted, the index stops growing */
+{
+    if (f->lidx == NULL) {
+        long pos = f->rpos;
+
+        /* the first line starts after the BOM */
+        f->rpos = f->start;
+        detect_encoding(f);
+        f->rpos = pos > f->start ? pos : f->start;
+
+        f->lines = 0;
+        f->lend  = f->start;
+    }
+
+    while ((n == -1 || f->lines <= n) && f->lend < f->rsize) {
+        if (f->lines % LINE_INDEX_STEP == 0) {
+            int i = f->lines / LINE_INDEX_STEP;
+
+            if (i == f->lidx_n) {
+                int size = f->lidx_n ? f->lidx_n * 2 : 16;
+                long *p = realloc(f->lidx, size * sizeof(long));
+
+                if (p == NULL)
+                    break;
+
+                f->lidx   = p;
+                f->lidx_n = size;
+            }
+
+            f->lidx[i] = f->lend;
+        }
+
+        f->lend = next_line(f, f->lend);
+        f->lines++;
+    }
+}
+
+
+/**
+ * mpdm_fline - Reads a line by number from a mapped file.
+ * @fd: the file descriptor
+ * @n: the line number (starting from 0)
+ *
+ * Reads the line number @n from @fd, that must have been open with
+ * the 'm' flag (see mpdm_open()). The lines are found as they are
+ * needed, so the first ones are available immediately. Further
+ * reads continue from the line after this one. Returns NULL if
+ * @n is out of range or the file is not mapped.
+ * [File Management]
+ */
+mpdm_t mpdm_fline(mpdm_t fd, int n)
+{
+    mpdm_t r = NULL;
+
+    if (mpdm_type(fd) == MPDM_TYPE_FILE && n >= 0) {
+        struct mpdm_file *fs = (struct mpdm_file *) fd->data;
+
+        if (fs->mapped) {
+            index_lines(fs, n);
+
+            if (n < fs->lines) {
+                long off = fs->lidx[n / LINE_INDEX_STEP];
+                int i;
+
+                /* walk from the nearest indexed line */
+                for (i = n % LINE_INDEX_STEP; i > 0; i--)
+                    off = next_line(fs, off);
+
+                fs->rpos   = off;
+                fs->eof    = 0;
+                fs->eol[0] = L'\0';
+
+                r = mpdm_read(fd);
+            }
+        }
+    }
+
+    return r;
+}
+
+
+/**
+ * mpdm_flines - Counts the lines of a mapped file.
+ * @fd: the file descriptor
+ *
+ * Returns the number of lines in @fd, that must have been open
+ * with the 'm' flag (see mpdm_open()), or -1 if it's not mapped
+ * (or there is not enough memory to index its lines).
+ * A last line without a newline is also counted.
+ * [File Management]
+ */
+int mpdm_flines(mpdm_t fd)
+{
+    int r = -1;
+
+    if (mpdm_type(fd) == MPDM_TYPE_FILE) {
+        struct mpdm_file *fs = (struct mpdm_file *) fd->data;
+
+        if (fs->mapped) {
+            index_lines(fs, -1);
+
+            /* not up to the end if out of memory */
+            if (fs->lend == fs->rsize)
+                r = fs->lines;
+        }
+    }
+
+    return r;
 }
-*/
 
 
 static mpdm_t embedded_encodings(void)
@@ -1416,7 +2227,7 @@ int mpdm_encoding(mpdm_t charset)
 #ifdef CONFOPT_ICONV
     else {
         iconv_t ic;
-        mpdm_t cs = mpdm_ref(MPDM_2MBS(charset->data));
+        mpdm_t cs = mpdm_ref(MPDM_2MBS(mpdm_string(charset)));
 
         /* tries to create an iconv encoder and decoder for this charset */
 
@@ -1467,7 +2278,7 @@ int mpdm_unlink(const mpdm_t filename)
     mpdm_ref(filename);
 
     /* convert to mbs */
-    fn = mpdm_ref(MPDM_2MBS(filename->data));
+    fn = mpdm_ref(MPDM_2MBS(mpdm_string(filename)));
 
     if ((ret = unlink((char *) fn->data)) == -1)
         store_syserr();
@@ -1495,8 +2306,8 @@ int mpdm_rename(const mpdm_t o, const mpdm_t n)
     mpdm_ref(o);
     mpdm_ref(n);
 
-    om = mpdm_ref(MPDM_2MBS(o->data));
-    nm = mpdm_ref(MPDM_2MBS(n->data));
+    om = mpdm_ref(MPDM_2MBS(mpdm_string(o)));
+    nm = mpdm_ref(MPDM_2MBS(mpdm_string(n)));
 
     if ((ret = rename((char *)om->data, (char *)nm->data)) == -1)
         store_syserr();
@@ -1537,7 +2348,7 @@ mpdm_t mpdm_stat(const mpdm_t filename)
     struct stat s;
     mpdm_t fn;
 
-    fn = mpdm_ref(MPDM_2MBS(filename->data));
+    fn = mpdm_ref(MPDM_2MBS(mpdm_string(filename)));
 
     if (stat((char *) fn->data, &s) != -1) {
         r = MPDM_A(14);
@@ -1618,7 +2429,7 @@ int mpdm_chmod(const mpdm_t filename, mpdm_t perms)
     mpdm_ref(filename);
     mpdm_ref(perms);
 
-    mpdm_t fn = mpdm_ref(MPDM_2MBS(filename->data));
+    mpdm_t fn = mpdm_ref(MPDM_2MBS(mpdm_string(filename)));
 
     if ((r = chmod((char *) fn->data, mpdm_ival(perms))) == -1)
         store_syserr();
@@ -1643,7 +2454,7 @@ int mpdm_chdir(const mpdm_t dir)
     int r = -1;
 
     mpdm_ref(dir);
-    mpdm_t fn = mpdm_ref(MPDM_2MBS(dir->data));
+    mpdm_t fn = mpdm_ref(MPDM_2MBS(mpdm_string(dir)));
 
     if ((r = chdir((char *) fn->data)) == -1)
         store_syserr();
@@ -1691,7 +2502,7 @@ int mpdm_chown(const mpdm_t filename, mpdm_t uid, mpdm_t gid)
 
 #ifdef CONFOPT_CHOWN
 
-    mpdm_t fn = mpdm_ref(MPDM_2MBS(filename->data));
+    mpdm_t fn = mpdm_ref(MPDM_2MBS(mpdm_string(filename)));
 
     if ((r = chown((char *) fn->data, mpdm_ival(uid), mpdm_ival(gid))) == -1)
         store_syserr();
@@ -1807,6 +2618,8 @@ mpdm_t mpdm_glob(mpdm_t spec, mpdm_t base)
     if (glob(ptr, GLOB_MARK, NULL, &globbuf) == 0) {
         int n;
 
+        mpdm_reserve(f, globbuf.gl_pathc);
+
         for (n = 0; globbuf.gl_pathv[n] != NULL; n++) {
             char *p = globbuf.gl_pathv[n];
             mpdm_t t = MPDM_MBS(p);
@@ -2039,8 +2852,8 @@ mpdm_t mpdm_popen(const mpdm_t prg, const mpdm_t mode)
         v = MPDM_F(NULL);
 
         /* convert to mbs,s */
-        pr = mpdm_ref(MPDM_2MBS(prg->data));
-        md = mpdm_ref(MPDM_2MBS(mode->data));
+        pr = mpdm_ref(MPDM_2MBS(mpdm_string(prg)));
+        md = mpdm_ref(MPDM_2MBS(mpdm_string(mode)));
 
         /* get the mode */
         m = (char *) md->data;
@@ -2383,6 +3196,27 @@ static int file_close(mpdm_t v)
         fs->ic_dec = (iconv_t) - 1;
 #endif
 
+        flush_buf(fs);
+
+#ifdef CONFOPT_MMAP
+        if (fs->mapped) {
+            if (fs->rbuf != NULL)
+                munmap(fs->rbuf, fs->rsize);
+        }
+        else
+#endif
+            free(fs->rbuf);
+
+        free(fs->wbuf);
+        free(fs->lidx);
+        fs->lidx = NULL;
+        fs->lidx_n = fs->lines = fs->mapped = 0;
+        fs->rbuf = NULL;
+        fs->wbuf = NULL;
+        fs->rpos = fs->rsize = fs->wsize = 0;
+        fs->roff = 0;
+        fs->eof = fs->chunked = 0;
+
         if (fs->in != NULL)
             r = fclose(fs->in);
 
@@ -2518,7 +3352,7 @@ mpdm_t mpdm_new_f(FILE *f)
         }
         else {
 #ifdef CONFOPT_ICONV
-            mpdm_t cs = mpdm_ref(MPDM_2MBS(e->data));
+            mpdm_t cs = mpdm_ref(MPDM_2MBS(mpdm_string(e)));
 
             if ((fs->ic_enc = iconv_open((char *) cs->data, "WCHAR_T")) != (iconv_t) - 1 &&
                 (fs->ic_dec = iconv_open("WCHAR_T", (char *) cs->data)) != (iconv_t) - 1) {
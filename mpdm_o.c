@@ -16,60 +16,288 @@
 #include <stdlib.h>
 #include <string.h>
 #include <wchar.h>
+#include <stdint.h>
+#include <time.h>
 
 #include "mpdm.h"
 
-/** code **/
+/** data **/
+
+/* objects are open addressing hash tables with linear probing;
+   the value data points to a struct otable and its size is the
+   number of slots (always a power of 2) */
+
+struct oslot {
+    unsigned int hash;          /* key hash (non-zero if deleted) */
+    mpdm_t k;                   /* key (NULL if empty or deleted) */
+    mpdm_t v;                   /* value */
+};
+
+struct otable {
+    int count;                  /* number of keys */
+    int used;                   /* number of keys plus deleted slots */
+    struct oslot slot[1];       /* the slots */
+};
+
+#define OTABLE_MIN_SIZE 8
+
+/* size of the copies of non-string keys */
+#define KEY_TMP_SIZE    64
 
-/* default hash buckets (must be prime) */
-static int mpdm_hash_buckets = 31;
+/* the seed for the hashing function */
+static uint64_t hash_seed[2];
 
 /* prototype for the one-time wrapper hash function */
-static int switch_hash_func(const wchar_t *, int);
+static unsigned int switch_hash_func(const wchar_t *, int);
 
 /* pointer to the hashing function */
-static int (*mpdm_hash_func) (const wchar_t *, int) = switch_hash_func;
+static unsigned int (*mpdm_hash_func) (const wchar_t *, int) = switch_hash_func;
+
+#ifdef CONFOPT_TLS
+
+/* symbol table of interned strings */
+#define SYMBOL_MAX_SIZE     32      /* longer strings are not interned */
+#define SYMTAB_MAX_COUNT    65536   /* maximum number of symbols */
+
+static __thread mpdm_t *symtab = NULL;
+static __thread int symtab_size = 0;
+static __thread int symtab_count = 0;
+
+#endif /* CONFOPT_TLS */
+
+
+/** code **/
+
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND do { \
+    v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+    v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+} while (0)
 
-static int standard_hash_func(const wchar_t *string, int mod)
-/* computes a hashing function on string */
+static unsigned int standard_hash_func(const wchar_t *string, int size)
+/* computes a SipHash-1-3 of the characters of string */
 {
-    int c;
+    uint64_t v0 = hash_seed[0] ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = hash_seed[1] ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = hash_seed[0] ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = hash_seed[1] ^ 0x7465646279746573ULL;
+    uint64_t m;
+    int n;
+
+    /* characters are hashed as 32 bit units, two by round */
+    for (n = 0; n + 1 < size; n += 2) {
+        m = (uint64_t)(uint32_t) string[n] |
+            ((uint64_t)(uint32_t) string[n + 1] << 32);
+
+        v3 ^= m;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    m = ((uint64_t) size << 58);
+
+    if (n < size)
+        m |= (uint64_t)(uint32_t) string[n];
+
+    v3 ^= m;
+    SIPROUND;
+    v0 ^= m;
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
 
-    for (c = 0; *string != L'\0'; string++)
-        c ^= (int) *string;
+    m = v0 ^ v1 ^ v2 ^ v3;
 
-    return c % mod;
+    return (unsigned int) (m ^ (m >> 32));
 }
 
 
-static int null_hash_func(const wchar_t *string, int mod)
+static unsigned int null_hash_func(const wchar_t *string, int size)
+/* degenerate hashing function (for testing collisions) */
 {
-    return *string % mod;
+    return size ? *string : 0;
 }
 
-static int switch_hash_func(const wchar_t *string, int mod)
+
+static unsigned int switch_hash_func(const wchar_t *string, int size)
 /* one-time wrapper for hash method autodetection */
 {
     /* commute the real hashing function on
        having the MPDM_NULL_HASH environment variable set */
-    if (getenv("MPDM_NULL_HASH") != NULL)
-        mpdm_hash_func = null_hash_func;
-    else
+#ifndef CONFOPT_NULL_HASH
+    if (getenv("MPDM_NULL_HASH") == NULL) {
+        /* seed with something not easy to guess */
+        hash_seed[0] = ((uint64_t) time(NULL) << 32) ^ (uintptr_t) &size;
+        hash_seed[1] = ((uint64_t) clock() << 32) ^ (uintptr_t) string ^
+                       (uintptr_t) switch_hash_func;
+
         mpdm_hash_func = standard_hash_func;
+    }
+    else
+#endif
+        mpdm_hash_func = null_hash_func;
 
     /* and fall back to it */
-    return mpdm_hash_func(string, mod);
+    return mpdm_hash_func(string, size);
+}
+
+
+static unsigned int hash_wcsn(const wchar_t *string, int size)
+/* hashes a string; 0 and 1 are reserved for free slots */
+{
+    unsigned int h = mpdm_hash_func(string, size);
+
+    return h < 2 ? h + 2 : h;
 }
 
-#define HASH_BUCKET_S(h, k) mpdm_hash_func(k, mpdm_size(h))
-#define HASH_BUCKET(h, k)   mpdm_hash_func(mpdm_string(k), mpdm_size(h))
 
-/* interface */
+static unsigned int hash_wcs(const wchar_t *string)
+{
+    return hash_wcsn(string, wcslen(string));
+}
+
+
+static unsigned int key_hash(const mpdm_t i, const wchar_t *k)
+/* returns the hash of the k string of the i key */
+{
+    unsigned int h;
+
+    if (i && (i->flags & MPDM_F_HASHED))
+        h = i->hash;
+    else {
+        h = hash_wcs(k);
+
+        /* cache it in strings (shared ones can be looked up from
+           other threads at the same time, and the hash of sliced
+           ones counts their slices) */
+        if (mpdm_type(i) == MPDM_TYPE_STRING &&
+            !(i->flags & (MPDM_F_SHARED | MPDM_F_SLICED))) {
+            i->hash   = h;
+            i->flags |= MPDM_F_HASHED;
+        }
+    }
+
+    return h;
+}
+
+
+static wchar_t *key_wcs(const mpdm_t i, wchar_t *tmp)
+/* returns the string of a key, copying it to tmp if it's not a string */
+{
+    wchar_t *k;
+
+    if (mpdm_type(i) == MPDM_TYPE_STRING && (i->flags & MPDM_F_REPR) &&
+        mpdm_size(i) < KEY_TMP_SIZE) {
+        /* short compact or UTF-8 strings are decoded into tmp,
+           so that they are not converted just to be hashed */
+        tmp[mpdm_string_n(i, 0, tmp, KEY_TMP_SIZE - 1)] = L'\0';
+        k = tmp;
+    }
+    else {
+        k = mpdm_string(i);
+
+        /* string representations of other types live in a ring
+           of buffers that long probe sequences could reuse */
+        if (mpdm_type(i) != MPDM_TYPE_STRING) {
+            wcsncpy(tmp, k, KEY_TMP_SIZE - 1);
+            tmp[KEY_TMP_SIZE - 1] = L'\0';
+            k = tmp;
+        }
+    }
+
+    return k;
+}
+
+
+static struct oslot *find_slot(const mpdm_t o, const mpdm_t i, const wchar_t *k,
+                               unsigned int h, struct oslot **free_slot)
+/* finds the slot for the i key (with k string) in o, or NULL;
+   free_slot gets the first reusable */
+{
+    struct otable *t = (struct otable *) o->data;
+    struct oslot *r = NULL;
+    unsigned int mask = mpdm_size(o) - 1;
+    unsigned int n;
+
+    if (free_slot)
+        *free_slot = NULL;
+
+    for (n = h & mask; t->slot[n].k || t->slot[n].hash; n = (n + 1) & mask) {
+        struct oslot *s = &t->slot[n];
+
+        if (s->k == NULL) {
+            /* deleted: can be reused */
+            if (free_slot && *free_slot == NULL)
+                *free_slot = s;
+        }
+        else
+        if (s->k == i || (s->hash == h && wcscmp(mpdm_string(s->k), k) == 0)) {
+            r = s;
+            break;
+        }
+    }
+
+    if (r == NULL && free_slot && *free_slot == NULL)
+        *free_slot = &t->slot[n];
+
+    return r;
+}
+
+
+static void resize(mpdm_t o, int count)
+/* resizes o to hold count keys with a load factor <= 50% */
+{
+    struct otable *t = (struct otable *) o->data;
+    struct otable *nt;
+    int size = OTABLE_MIN_SIZE;
+    int n;
+
+    while (size < count * 2)
+        size *= 2;
+
+    nt = calloc(1, sizeof(struct otable) + (size - 1) * sizeof(struct oslot));
+
+    /* move all keys to the new table */
+    for (n = 0; n < mpdm_size(o); n++) {
+        struct oslot *s = &t->slot[n];
+
+        if (s->k != NULL) {
+            unsigned int i;
+
+            for (i = s->hash & (size - 1); nt->slot[i].k; i = (i + 1) & (size - 1));
+
+            nt->slot[i] = *s;
+            nt->count++;
+        }
+    }
+
+    nt->used = nt->count;
+
+    free(t);
+
+    o->data = nt;
+    o->size = size;
+}
 
 
 mpdm_t mpdm_object__destroy(mpdm_t o)
 {
-    return mpdm_array__destroy(o);
+    struct otable *t = (struct otable *) o->data;
+    int n;
+
+    for (n = 0; n < mpdm_size(o); n++) {
+        if (t->slot[n].k != NULL) {
+            mpdm_unref(t->slot[n].k);
+            mpdm_unref(t->slot[n].v);
+        }
+    }
+
+    return o;
 }
 
 
@@ -90,15 +318,7 @@ mpdm_t mpdm_new_o(void)
 int mpdm_count_o(const mpdm_t o)
 /* do not use it; use mpdm_count() */
 {
-    int n;
-    int ret = 0;
-
-    for (n = 0; n < mpdm_size(o); n++) {
-        mpdm_t b = mpdm_get_i(o, n);
-        ret += mpdm_size(b);
-    }
-
-    return ret / 2;
+    return mpdm_size(o) ? ((struct otable *) o->data)->count : 0;
 }
 
 
@@ -113,17 +333,12 @@ int mpdm_count_o(const mpdm_t o)
  */
 mpdm_t mpdm_get_wcs(const mpdm_t o, const wchar_t *i)
 {
-    mpdm_t b;
+    struct oslot *s;
     mpdm_t v = NULL;
-    int n = 0;
 
-    if (mpdm_size(o)) {
-        /* if hash is not empty... */
-        if ((b = mpdm_get_i(o, HASH_BUCKET_S(o, i))) != NULL)
-            n = mpdm_bseek_wcs(b, i, 2, NULL);
-
-        if (n >= 0)
-            v = mpdm_get_i(b, n + 1);
+    if (mpdm_count_o(o)) {
+        if ((s = find_slot(o, NULL, i, hash_wcs(i), NULL)) != NULL)
+            v = s->v;
     }
 
     return v;
@@ -142,10 +357,19 @@ mpdm_t mpdm_get_wcs(const mpdm_t o, const wchar_t *i)
 mpdm_t mpdm_get_o(const mpdm_t o, const mpdm_t i)
 /* do not use it; use mpdm_get() */
 {
-    mpdm_t r;
+    struct oslot *s;
+    mpdm_t r = NULL;
+    wchar_t tmp[KEY_TMP_SIZE];
 
     mpdm_ref(i);
-    r = mpdm_get_wcs(o, mpdm_string(i));
+
+    if (mpdm_count_o(o)) {
+        wchar_t *k = key_wcs(i, tmp);
+
+        if ((s = find_slot(o, i, k, key_hash(i, k), NULL)) != NULL)
+            r = s->v;
+    }
+
     mpdm_unref(i);
 
     return r;
@@ -162,17 +386,16 @@ mpdm_t mpdm_get_o(const mpdm_t o, const mpdm_t i)
  */
 int mpdm_exists(const mpdm_t o, const mpdm_t i)
 {
-    mpdm_t b;
     int ret = 0;
+    wchar_t tmp[KEY_TMP_SIZE];
 
     mpdm_ref(i);
 
-    if (mpdm_size(o)) {
-        if ((b = mpdm_get_i(o, HASH_BUCKET(o, i))) != NULL) {
-            /* if bucket exists, binary-seek it */
-            if (mpdm_bseek(b, i, 2, NULL) >= 0)
-                ret = 1;
-        }
+    if (mpdm_count_o(o)) {
+        wchar_t *k = key_wcs(i, tmp);
+
+        if (find_slot(o, i, k, key_hash(i, k), NULL) != NULL)
+            ret = 1;
     }
 
     mpdm_unref(i);
@@ -194,52 +417,56 @@ int mpdm_exists(const mpdm_t o, const mpdm_t i)
 mpdm_t mpdm_set_o(mpdm_t o, mpdm_t v, mpdm_t i)
 /* do not use it; use mpdm_set() */
 {
-    mpdm_t b, r;
-    int n;
+    struct oslot *s, *f;
+    unsigned int h;
+    wchar_t *k;
+    wchar_t tmp[KEY_TMP_SIZE];
+
+    /* a NULL index is stored as its string representation */
+    if (i == NULL)
+        i = MPDM_S(mpdm_string(i));
+
+    /* values inside shared objects are also shared */
+    if (o->flags & MPDM_F_SHARED) {
+        mpdm_share(i);
+        mpdm_share(v);
+    }
 
     mpdm_ref(i);
     mpdm_ref(v);
 
-    /* if hash is empty, create an optimal number of buckets */
-    if (mpdm_size(o) == 0)
-        mpdm_expand(o, 0, mpdm_hash_buckets);
-
-    n = HASH_BUCKET(o, i);
-
-    if ((b = mpdm_get_i(o, n)) != NULL) {
-        int pos;
+    /* keep the load (deleted slots included) under 75% */
+    if (mpdm_size(o) == 0 ||
+        (((struct otable *) o->data)->used + 1) * 4 > mpdm_size(o) * 3)
+        resize(o, mpdm_count_o(o) + 1);
 
-        /* bucket exists; try to find the key there */
-        n = mpdm_bseek(b, i, 2, &pos);
+    k = key_wcs(i, tmp);
+    h = key_hash(i, k);
 
-        if (n < 0) {
-            /* the pair does not exist: create it */
-            n = pos;
-            mpdm_expand(b, n, 2);
-
-            mpdm_set_i(b, i, n);
-        }
+    if ((s = find_slot(o, i, k, h, &f)) != NULL) {
+        /* key already exists: just replace the value */
+        mpdm_ref(v);
+        mpdm_unref(s->v);
+        s->v = v;
     }
     else {
-        /* the bucket does not exist; create it */
-        b = MPDM_A(2);
+        struct otable *t = (struct otable *) o->data;
 
-        /* put the bucket into the hash */
-        mpdm_set_i(o, b, n);
+        /* reusing an empty (not deleted) slot? */
+        if (f->hash == 0)
+            t->used++;
 
-        /* offset 0 */
-        n = 0;
+        f->hash = h;
+        f->k    = mpdm_ref(i);
+        f->v    = mpdm_ref(v);
 
-        /* insert the key */
-        mpdm_set_i(b, i, n);
+        t->count++;
     }
 
-    r = mpdm_set_i(b, v, n + 1);
-
     mpdm_unref(v);
     mpdm_unref(i);
 
-    return r;
+    return v;
 }
 
 
@@ -255,7 +482,176 @@ mpdm_t mpdm_set_o(mpdm_t o, mpdm_t v, mpdm_t i)
  */
 mpdm_t mpdm_set_wcs(mpdm_t o, mpdm_t v, const wchar_t *i)
 {
-    return mpdm_set_o(o, v, MPDM_S(i));
+    return mpdm_set_o(o, v, mpdm_intern_wcs(i, -1));
+}
+
+
+#ifdef CONFOPT_TLS
+
+static mpdm_t *symtab_slot(const wchar_t *str, int size, unsigned int h)
+/* returns the slot for a symbol (empty if it's not there) */
+{
+    unsigned int mask = symtab_size - 1;
+    unsigned int n;
+
+    for (n = h & mask; symtab[n] != NULL; n = (n + 1) & mask) {
+        mpdm_t v = symtab[n];
+
+        if (v->hash == h && v->size == size &&
+            wmemcmp((wchar_t *) v->data, str, size) == 0)
+            break;
+    }
+
+    return &symtab[n];
+}
+
+
+static mpdm_t *symtab_find(const wchar_t *str, int size, unsigned int h)
+/* finds the slot for a symbol, growing the table if needed;
+   returns NULL if there is no table */
+{
+    if (symtab_count * 2 >= symtab_size && symtab_count < SYMTAB_MAX_COUNT) {
+        mpdm_t *old = symtab;
+        int n = symtab_size;
+        int size = symtab_size ? symtab_size * 2 : 256;
+        mpdm_t *tab = calloc(size, sizeof(mpdm_t));
+
+        /* if out of memory, keep using the old one */
+        if (tab != NULL) {
+            symtab      = tab;
+            symtab_size = size;
+
+            while (n--) {
+                if (old[n] != NULL)
+                    *symtab_slot(mpdm_string(old[n]), old[n]->size, old[n]->hash) = old[n];
+            }
+
+            free(old);
+        }
+    }
+
+    return symtab ? symtab_slot(str, size, h) : NULL;
+}
+
+
+static mpdm_t symtab_add(mpdm_t *p, mpdm_t v, unsigned int h)
+/* stores v as a new symbol into the p slot, if there is room */
+{
+    if (symtab_count < SYMTAB_MAX_COUNT) {
+        v->hash   = h;
+        v->flags |= MPDM_F_HASHED;
+
+        *p = mpdm_ref(v);
+        symtab_count++;
+    }
+
+    return v;
+}
+
+
+void mpdm_symtab_free(void)
+/* unreferences all symbols of this thread and frees the table */
+{
+    int n;
+
+    for (n = 0; n < symtab_size; n++)
+        mpdm_unref(symtab[n]);
+
+    free(symtab);
+    symtab = NULL;
+    symtab_size = symtab_count = 0;
+}
+
+#endif /* CONFOPT_TLS */
+
+
+/**
+ * mpdm_intern_wcs - Returns the interned string value for a string.
+ * @str: the string
+ * @size: the size of the string (-1, till the end)
+ *
+ * Returns the interned string value for @str, creating it if it's
+ * not already there. Interned strings are unique per thread, so
+ * two keys created by this function with the same content are the
+ * same value and are stored with a precomputed hash, making object
+ * lookups with them faster. Interned strings are kept until the
+ * thread finishes (see mpdm_thread_exit()); long strings or strings created after a maximum number of them
+ * are returned as normal (not interned) strings.
+ * [Objects]
+ */
+mpdm_t mpdm_intern_wcs(const wchar_t *str, int size)
+{
+    mpdm_t v = NULL;
+
+    if (size == -1)
+        size = wcslen(str);
+
+#ifdef CONFOPT_TLS
+    if (size <= SYMBOL_MAX_SIZE) {
+        unsigned int h = hash_wcsn(str, size);
+        mpdm_t *p = symtab_find(str, size, h);
+
+        if (p != NULL && (v = *p) == NULL)
+            v = symtab_add(p, MPDM_NS(str, size), h);
+    }
+#endif
+
+    return v ? v : MPDM_NS(str, size);
+}
+
+
+/**
+ * mpdm_key - Returns a key for fast object lookups.
+ * @str: the string
+ *
+ * Returns a string value for @str with its hash already calculated,
+ * to be used (after referencing it) as the index in repeated calls
+ * to mpdm_get(), mpdm_set(), mpdm_exists() or mpdm_del() in hot
+ * loops. Short strings are also interned (see mpdm_intern_wcs()),
+ * so the keys can be found by pointer comparison.
+ * [Objects]
+ */
+mpdm_t mpdm_key(const wchar_t *str)
+{
+    mpdm_t v = mpdm_intern_wcs(str, -1);
+
+    key_hash(v, mpdm_string(v));
+
+    return v;
+}
+
+
+/**
+ * mpdm_intern - Interns a string value.
+ * @v: the string value
+ *
+ * Returns the interned string value with the same content as @v,
+ * that becomes the interned one if there is none. If another value
+ * is returned, @v is destroyed if it's unreferenced. Values that
+ * are not strings are returned as is. See mpdm_intern_wcs().
+ * [Objects]
+ */
+mpdm_t mpdm_intern(mpdm_t v)
+{
+#ifdef CONFOPT_TLS
+    /* (strings with slices use the hash to count them) */
+    if (mpdm_type(v) == MPDM_TYPE_STRING && mpdm_size(v) <= SYMBOL_MAX_SIZE &&
+        !(v->flags & MPDM_F_SLICED)) {
+        wchar_t *str = mpdm_string(v);
+        unsigned int h = hash_wcsn(str, mpdm_size(v));
+        mpdm_t *p = symtab_find(str, mpdm_size(v), h);
+
+        if (p != NULL && *p == NULL)
+            symtab_add(p, v, h);
+        else
+        if (p != NULL && *p != v) {
+            mpdm_void(v);
+            v = *p;
+        }
+    }
+#endif
+
+    return v;
 }
 
 
@@ -271,17 +667,35 @@ mpdm_t mpdm_set_wcs(mpdm_t o, mpdm_t v, const wchar_t *i)
 mpdm_t mpdm_del_o(mpdm_t o, const mpdm_t i)
 /* do not use it; use mpdm_del() */
 {
-    mpdm_t b;
-    int n;
+    struct oslot *s;
+    wchar_t tmp[KEY_TMP_SIZE];
 
     mpdm_ref(i);
 
-    if (mpdm_size(o)) {
-        if ((b = mpdm_get_i(o, HASH_BUCKET(o, i))) != NULL) {
-            /* bucket exists */
-            if ((n = mpdm_bseek(b, i, 2, NULL)) >= 0) {
-                /* collapse the bucket */
-                mpdm_collapse(b, n, 2);
+    if (mpdm_count_o(o)) {
+        wchar_t *k = key_wcs(i, tmp);
+
+        if ((s = find_slot(o, i, k, key_hash(i, k), NULL)) != NULL) {
+            struct otable *t = (struct otable *) o->data;
+            mpdm_t ok = s->k;
+            mpdm_t ov = s->v;
+
+            /* mark as deleted */
+            s->k    = NULL;
+            s->v    = NULL;
+            s->hash = 1;
+            t->count--;
+
+            mpdm_unref(ov);
+            mpdm_unref(ok);
+
+            /* free the table if it's empty; otherwise, deleted
+               slots are purged when growing, so the object
+               can be safely iterated while deleting */
+            if (t->count == 0) {
+                free(t);
+                o->data = NULL;
+                o->size = 0;
             }
         }
     }
@@ -300,30 +714,16 @@ int mpdm_iterator_o(mpdm_t set, int *context, mpdm_t *v, mpdm_t *i)
     mpdm_ref(set);
 
     if (mpdm_size(set)) {
-        int bi, ei;
-
-        /* get bucket and element index */
-        bi = (*context) % mpdm_size(set);
-        ei = (*context) / mpdm_size(set);
+        struct otable *t = (struct otable *) set->data;
 
-        while (ret == 0 && bi < mpdm_size(set)) {
-            mpdm_t b;
-
-            /* if bucket is empty or there are no more
-               elements in it, pick the next one */
-            if (!(b = mpdm_get_i(set, bi)) || ei >= mpdm_size(b)) {
-                ei = 0;
-                bi++;
-            }
-            else {
-                /* get pair */
-                if (v) *v = mpdm_get_i(b, ei + 1);
-                if (i) *i = mpdm_get_i(b, ei);
+        /* the context is the index of the next slot */
+        while (ret == 0 && *context < mpdm_size(set)) {
+            struct oslot *s = &t->slot[(*context)++];
 
-                ei += 2;
+            if (s->k != NULL) {
+                if (v) *v = s->v;
+                if (i) *i = s->k;
 
-                /* update context */
-                *context = (ei * mpdm_size(set)) + bi;
                 ret = 1;
             }
         }
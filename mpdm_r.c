@@ -84,7 +84,7 @@ mpdm_t mpdm_regcomp(mpdm_t r)
         /* not found; regex must be compiled */
 
         /* convert to mbs */
-        rmb = mpdm_ref(MPDM_2MBS(r->data));
+        rmb = mpdm_ref(MPDM_2MBS(mpdm_string(r)));
         regex = (char *) rmb->data;
 
         if ((flags = strrchr(regex, *regex)) != NULL) {
@@ -139,11 +139,14 @@ static mpdm_t regex1(mpdm_t cr, const mpdm_t v, int offset)
         /* add the offset */
         mpdm_regex_offset += offset;
 
-        /* create now the matching string */
-        w = MPDM_NMBS(ptr + rm.rm_so, rm.rm_eo - rm.rm_so);
+        /* the same for the size of the match */
+        free(mpdm_mbstowcs(ptr + rm.rm_so, &mpdm_regex_size, rm.rm_eo - rm.rm_so));
 
-        /* and store the size */
-        mpdm_regex_size = mpdm_size(w);
+        /* the matching string is a part of v */
+        if (mpdm_type(v) == MPDM_TYPE_STRING)
+            w = mpdm_new_slice(v, mpdm_regex_offset, mpdm_regex_size);
+        else
+            w = MPDM_NMBS(ptr + rm.rm_so, rm.rm_eo - rm.rm_so);
     }
 
     free(ptr);
@@ -19,6 +19,8 @@
 #include <locale.h>
 #include <wctype.h>
 #include <time.h>
+#include <stdint.h>
+#include <float.h>
 
 #ifdef CONFOPT_GETTEXT
 #include <libintl.h>
@@ -28,9 +30,148 @@
 #include <windows.h>
 #endif
 
+#ifdef CONFOPT_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef CONFOPT_AVX2
+#include <immintrin.h>
+#endif
+
 #include "mpdm.h"
 
 
+/** data **/
+
+/* strings up to this size in bytes (including the trailing
+   null) are stored in the same block as the value */
+#define INLINE_STRING_MAX (3 * (int) sizeof(struct mpdm_val))
+
+/* strings that are a part of another one (a slice) store this
+   structure inline instead of the characters */
+struct slice {
+    mpdm_t parent;      /* the original string (never a slice) */
+    int offset;         /* offset in characters */
+    int boffset;        /* offset in bytes (for UTF-8 parents) */
+};
+
+/* shorter slices are copied instead (as they take no more memory) */
+#define SLICE_MIN_SIZE  16
+
+/* slices this many times smaller than their parent get their own
+   copy of the characters when only slices are keeping it alive */
+#define SLICE_WASTE     16
+
+/* strings made by concatenation (a rope) store this structure
+   inline instead of the characters; they are balanced as AVL trees */
+struct rope {
+    mpdm_t left;        /* the first part */
+    mpdm_t right;       /* the second part */
+    int depth;          /* height of the tree (0 for other strings) */
+};
+
+#define ROPE_L(v) (((struct rope *) (v)->data)->left)
+#define ROPE_R(v) (((struct rope *) (v)->data)->right)
+
+/* concatenations up to this size are copied instead */
+#define ROPE_LEAF_SIZE  128
+
+/* strings up to this size are converted to numbers from a copy */
+#define NUM_TMP_SIZE    128
+
+/* powers of ten that are exact as doubles */
+static const double exact_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* a floating point number as f * 2^e, used to format reals */
+struct diy_fp {
+    uint64_t f;
+    int e;
+};
+
+/* normalized powers of ten from 10^-348 to 10^340, in steps of 8 */
+static const struct diy_fp cached_pow10[] = {
+    { 0xfa8fd5a0081c0288ULL, -1220 }, { 0xbaaee17fa23ebf76ULL, -1193 },
+    { 0x8b16fb203055ac76ULL, -1166 }, { 0xcf42894a5dce35eaULL, -1140 },
+    { 0x9a6bb0aa55653b2dULL, -1113 }, { 0xe61acf033d1a45dfULL, -1087 },
+    { 0xab70fe17c79ac6caULL, -1060 }, { 0xff77b1fcbebcdc4fULL, -1034 },
+    { 0xbe5691ef416bd60cULL, -1007 }, { 0x8dd01fad907ffc3cULL,  -980 },
+    { 0xd3515c2831559a83ULL,  -954 }, { 0x9d71ac8fada6c9b5ULL,  -927 },
+    { 0xea9c227723ee8bcbULL,  -901 }, { 0xaecc49914078536dULL,  -874 },
+    { 0x823c12795db6ce57ULL,  -847 }, { 0xc21094364dfb5637ULL,  -821 },
+    { 0x9096ea6f3848984fULL,  -794 }, { 0xd77485cb25823ac7ULL,  -768 },
+    { 0xa086cfcd97bf97f4ULL,  -741 }, { 0xef340a98172aace5ULL,  -715 },
+    { 0xb23867fb2a35b28eULL,  -688 }, { 0x84c8d4dfd2c63f3bULL,  -661 },
+    { 0xc5dd44271ad3cdbaULL,  -635 }, { 0x936b9fcebb25c996ULL,  -608 },
+    { 0xdbac6c247d62a584ULL,  -582 }, { 0xa3ab66580d5fdaf6ULL,  -555 },
+    { 0xf3e2f893dec3f126ULL,  -529 }, { 0xb5b5ada8aaff80b8ULL,  -502 },
+    { 0x87625f056c7c4a8bULL,  -475 }, { 0xc9bcff6034c13053ULL,  -449 },
+    { 0x964e858c91ba2655ULL,  -422 }, { 0xdff9772470297ebdULL,  -396 },
+    { 0xa6dfbd9fb8e5b88fULL,  -369 }, { 0xf8a95fcf88747d94ULL,  -343 },
+    { 0xb94470938fa89bcfULL,  -316 }, { 0x8a08f0f8bf0f156bULL,  -289 },
+    { 0xcdb02555653131b6ULL,  -263 }, { 0x993fe2c6d07b7facULL,  -236 },
+    { 0xe45c10c42a2b3b06ULL,  -210 }, { 0xaa242499697392d3ULL,  -183 },
+    { 0xfd87b5f28300ca0eULL,  -157 }, { 0xbce5086492111aebULL,  -130 },
+    { 0x8cbccc096f5088ccULL,  -103 }, { 0xd1b71758e219652cULL,   -77 },
+    { 0x9c40000000000000ULL,   -50 }, { 0xe8d4a51000000000ULL,   -24 },
+    { 0xad78ebc5ac620000ULL,     3 }, { 0x813f3978f8940984ULL,    30 },
+    { 0xc097ce7bc90715b3ULL,    56 }, { 0x8f7e32ce7bea5c70ULL,    83 },
+    { 0xd5d238a4abe98068ULL,   109 }, { 0x9f4f2726179a2245ULL,   136 },
+    { 0xed63a231d4c4fb27ULL,   162 }, { 0xb0de65388cc8ada8ULL,   189 },
+    { 0x83c7088e1aab65dbULL,   216 }, { 0xc45d1df942711d9aULL,   242 },
+    { 0x924d692ca61be758ULL,   269 }, { 0xda01ee641a708deaULL,   295 },
+    { 0xa26da3999aef774aULL,   322 }, { 0xf209787bb47d6b85ULL,   348 },
+    { 0xb454e4a179dd1877ULL,   375 }, { 0x865b86925b9bc5c2ULL,   402 },
+    { 0xc83553c5c8965d3dULL,   428 }, { 0x952ab45cfa97a0b3ULL,   455 },
+    { 0xde469fbd99a05fe3ULL,   481 }, { 0xa59bc234db398c25ULL,   508 },
+    { 0xf6c69a72a3989f5cULL,   534 }, { 0xb7dcbf5354e9beceULL,   561 },
+    { 0x88fcf317f22241e2ULL,   588 }, { 0xcc20ce9bd35c78a5ULL,   614 },
+    { 0x98165af37b2153dfULL,   641 }, { 0xe2a0b5dc971f303aULL,   667 },
+    { 0xa8d9d1535ce3b396ULL,   694 }, { 0xfb9b7cd9a4a7443cULL,   720 },
+    { 0xbb764c4ca7a44410ULL,   747 }, { 0x8bab8eefb6409c1aULL,   774 },
+    { 0xd01fef10a657842cULL,   800 }, { 0x9b10a4e5e9913129ULL,   827 },
+    { 0xe7109bfba19c0c9dULL,   853 }, { 0xac2820d9623bf429ULL,   880 },
+    { 0x80444b5e7aa7cf85ULL,   907 }, { 0xbf21e44003acdd2dULL,   933 },
+    { 0x8e679c2f5e44ff8fULL,   960 }, { 0xd433179d9c8cb841ULL,   986 },
+    { 0x9e19db92b4e31ba9ULL,  1013 }, { 0xeb96bf6ebadf77d9ULL,  1039 },
+    { 0xaf87023b9bf0ee6bULL,  1066 },
+};
+
+static const uint64_t pow10_64[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+    100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL,
+    10000000000000000000ULL
+};
+
+/* SIMD code is only used when wide chars are 32 bit */
+#if defined(CONFOPT_SSE2) && WCHAR_MAX > 0xffff
+#define SIMD_WCS 1
+#endif
+
+/* transcoders of runs of ASCII chars (selected on first use) */
+static int (*ascii_to_wcs)(const unsigned char *ptr, int size, wchar_t *wcs) = NULL;
+static int (*ascii_to_mbs)(const wchar_t *wcs, int size, unsigned char *ptr) = NULL;
+
+/* cache of small integer values */
+static mpdm_t small_ints[MPDM_SMALL_INTS];
+
+#ifdef CONFOPT_TLS
+
+/* ring of buffers for the string representation of values */
+#define STRINGIFY_RING  16
+#define STRINGIFY_SIZE  64
+
+static __thread wchar_t stringify_ring[STRINGIFY_RING][STRINGIFY_SIZE];
+static __thread int stringify_next = 0;
+
+#endif /* CONFOPT_TLS */
+
+
 /** code **/
 
 void *mpdm_poke_2(void *dst, int *dsize, int *offset, const void *org,
@@ -79,211 +220,1871 @@ wchar_t *mpdm_pokewsn(wchar_t *dst, int *size, const wchar_t *str, int slen)
         dst[*size] = L'\0';
     }
 
-    return dst;
+    return dst;
+}
+
+
+wchar_t *mpdm_pokews(wchar_t *dst, int *dsize, const wchar_t *str)
+/* adds a wide string to dst */
+{
+    return mpdm_pokewsn(dst, dsize, str, wcslen(str));
+}
+
+
+wchar_t *mpdm_pokev(wchar_t *dst, int *dsize, const mpdm_t v)
+/* adds the string in v to dst */
+{
+    if (v != NULL) {
+        mpdm_ref(v);
+        dst = mpdm_pokews(dst, dsize, mpdm_string(v));
+        mpdm_unref(v);
+    }
+
+    return dst;
+}
+
+
+/**
+ * mpdm_sb_init - Initializes a string builder.
+ * @sb: the string builder
+ *
+ * Initializes @sb as an empty string builder. A string builder
+ * makes a string by appending parts to it, growing its buffer
+ * geometrically instead of reallocating it on every addition.
+ * [Strings]
+ */
+void mpdm_sb_init(struct mpdm_sb *sb)
+{
+    sb->ptr   = NULL;
+    sb->size  = 0;
+    sb->alloc = 0;
+}
+
+
+/**
+ * mpdm_sb_reserve - Makes room in a string builder.
+ * @sb: the string builder
+ * @size: number of characters
+ *
+ * Makes room in @sb for @size more characters (and a trailing null),
+ * so that they can be added without reallocating its buffer.
+ * [Strings]
+ */
+void mpdm_sb_reserve(struct mpdm_sb *sb, int size)
+{
+    if (sb->size + size + 1 > sb->alloc) {
+        int n = sb->alloc ? sb->alloc : 32;
+
+        while (n < sb->size + size + 1)
+            n *= 2;
+
+        sb->ptr   = realloc(sb->ptr, n * sizeof(wchar_t));
+        sb->alloc = n;
+    }
+}
+
+
+/**
+ * mpdm_sb_add_wcsn - Adds a string to a string builder (with size).
+ * @sb: the string builder
+ * @str: the string
+ * @size: number of characters
+ *
+ * Adds @size characters of @str to @sb.
+ * [Strings]
+ */
+void mpdm_sb_add_wcsn(struct mpdm_sb *sb, const wchar_t *str, int size)
+{
+    if (str != NULL && size > 0) {
+        mpdm_sb_reserve(sb, size);
+
+        wmemcpy(sb->ptr + sb->size, str, size);
+        sb->size += size;
+    }
+}
+
+
+/**
+ * mpdm_sb_add_wcs - Adds a string to a string builder.
+ * @sb: the string builder
+ * @str: the string
+ *
+ * Adds @str to @sb.
+ * [Strings]
+ */
+void mpdm_sb_add_wcs(struct mpdm_sb *sb, const wchar_t *str)
+{
+    if (str != NULL)
+        mpdm_sb_add_wcsn(sb, str, wcslen(str));
+}
+
+
+/**
+ * mpdm_sb_add_wc - Adds a character to a string builder.
+ * @sb: the string builder
+ * @wc: the character
+ *
+ * Adds the @wc character to @sb.
+ * [Strings]
+ */
+void mpdm_sb_add_wc(struct mpdm_sb *sb, wchar_t wc)
+{
+    if (sb->size + 2 > sb->alloc)
+        mpdm_sb_reserve(sb, 1);
+
+    sb->ptr[sb->size++] = wc;
+}
+
+
+static int real_wcs(double r, wchar_t *buf);
+
+/**
+ * mpdm_sb_add_v - Adds a value to a string builder.
+ * @sb: the string builder
+ * @v: the value
+ *
+ * Adds the string representation of @v to @sb. Strings are
+ * copied without converting them to wide chars.
+ * [Strings]
+ */
+void mpdm_sb_add_v(struct mpdm_sb *sb, const mpdm_t v)
+{
+    if (v != NULL) {
+        mpdm_ref(v);
+
+        if (mpdm_type(v) == MPDM_TYPE_STRING) {
+            mpdm_sb_reserve(sb, mpdm_size(v));
+            sb->size += mpdm_string_n(v, 0, sb->ptr + sb->size, mpdm_size(v));
+        }
+        else
+        if (mpdm_type(v) == MPDM_TYPE_REAL) {
+            /* written in place */
+            mpdm_sb_reserve(sb, 32);
+            sb->size += real_wcs(v->rval, sb->ptr + sb->size);
+        }
+        else
+            mpdm_sb_add_wcs(sb, mpdm_string(v));
+
+        mpdm_unref(v);
+    }
+}
+
+
+/**
+ * mpdm_sb_detach - Returns the string of a string builder.
+ * @sb: the string builder
+ * @size: a pointer to store the size
+ *
+ * Returns the null terminated string built in @sb (that must be
+ * freed by the caller) and stores its size into @size. If nothing
+ * was added, returns NULL. @sb is left empty.
+ * [Strings]
+ */
+wchar_t *mpdm_sb_detach(struct mpdm_sb *sb, int *size)
+{
+    wchar_t *ptr = sb->ptr;
+
+    if (ptr != NULL) {
+        /* the buffer is trimmed to its final size */
+        if (sb->size + 1 < sb->alloc)
+            ptr = realloc(ptr, (sb->size + 1) * sizeof(wchar_t));
+
+        ptr[sb->size] = L'\0';
+    }
+
+    *size = sb->size;
+    mpdm_sb_init(sb);
+
+    return ptr;
+}
+
+
+/**
+ * mpdm_sb_finish - Creates a string value from a string builder.
+ * @sb: the string builder
+ *
+ * Returns a new string value with the string built in @sb,
+ * that is not copied. @sb is left empty.
+ * [Strings]
+ * [Value Creation]
+ */
+mpdm_t mpdm_sb_finish(struct mpdm_sb *sb)
+{
+    wchar_t *ptr;
+    int size;
+
+    ptr = mpdm_sb_detach(sb, &size);
+
+    return ptr ? MPDM_ENS(ptr, size) : MPDM_S(L"");
+}
+
+
+static int utf8_len(wchar_t wc)
+/* returns the length of the UTF-8 encoding of wc */
+{
+    return wc < 0x80 ? 1 : wc < 0x800 ? 2 : wc < 0x10000 ? 3 : 4;
+}
+
+
+static int utf8_char(const unsigned char *ptr, int size, wchar_t *wc)
+/* decodes the UTF-8 char in ptr; returns its length, or 0 if invalid */
+{
+    int c = ptr[0];
+    int l, n;
+
+    if (c < 0x80) {
+        *wc = c;
+        return 1;
+    }
+    else
+    if (c >= 0xc2 && c < 0xe0) {
+        *wc = c & 0x1f;
+        l = 2;
+    }
+    else
+    if (c >= 0xe0 && c < 0xf0) {
+        *wc = c & 0x0f;
+        l = 3;
+    }
+#ifndef CONFOPT_WIN32
+    else
+    if (c >= 0xf0 && c < 0xf5) {
+        *wc = c & 0x07;
+        l = 4;
+    }
+#endif
+    else
+        return 0;
+
+    if (l > size)
+        return 0;
+
+    /* overlong forms, surrogates and chars over U+10FFFF */
+    if ((c == 0xe0 && ptr[1] < 0xa0) || (c == 0xed && ptr[1] >= 0xa0) ||
+        (c == 0xf0 && ptr[1] < 0x90) || (c == 0xf4 && ptr[1] >= 0x90))
+        return 0;
+
+    for (n = 1; n < l; n++) {
+        if ((ptr[n] & 0xc0) != 0x80)
+            return 0;
+
+        *wc = (*wc << 6) | (ptr[n] & 0x3f);
+    }
+
+    return l;
+}
+
+
+static unsigned char *utf8_put(unsigned char *ptr, wchar_t wc)
+/* encodes wc as UTF-8 into ptr; returns the position after it */
+{
+    switch (utf8_len(wc)) {
+    case 1:
+        *ptr++ = wc;
+        break;
+
+    case 2:
+        *ptr++ = 0xc0 | (wc >> 6);
+        *ptr++ = 0x80 | (wc & 0x3f);
+        break;
+
+    case 3:
+        *ptr++ = 0xe0 | (wc >> 12);
+        *ptr++ = 0x80 | ((wc >> 6) & 0x3f);
+        *ptr++ = 0x80 | (wc & 0x3f);
+        break;
+
+    default:
+        *ptr++ = 0xf0 | ((wc >> 18) & 0x07);
+        *ptr++ = 0x80 | ((wc >> 12) & 0x3f);
+        *ptr++ = 0x80 | ((wc >> 6) & 0x3f);
+        *ptr++ = 0x80 | (wc & 0x3f);
+        break;
+    }
+
+    return ptr;
+}
+
+
+/**
+ * mpdm_bb_init - Initializes a UTF-8 builder.
+ * @bb: the UTF-8 builder
+ *
+ * Initializes @bb as an empty UTF-8 builder. It's like a string
+ * builder, but makes a string of bytes encoded in UTF-8.
+ * [Strings]
+ */
+void mpdm_bb_init(struct mpdm_bb *bb)
+{
+    bb->ptr   = NULL;
+    bb->size  = 0;
+    bb->alloc = 0;
+}
+
+
+/**
+ * mpdm_bb_reserve - Makes room in a UTF-8 builder.
+ * @bb: the UTF-8 builder
+ * @size: number of bytes
+ *
+ * Makes room in @bb for @size more bytes (and a trailing null),
+ * so that they can be added without reallocating its buffer.
+ * [Strings]
+ */
+void mpdm_bb_reserve(struct mpdm_bb *bb, int size)
+{
+    if (bb->size + size + 1 > bb->alloc) {
+        int n = bb->alloc ? bb->alloc : 64;
+
+        while (n < bb->size + size + 1)
+            n *= 2;
+
+        bb->ptr   = realloc(bb->ptr, n);
+        bb->alloc = n;
+    }
+}
+
+
+/**
+ * mpdm_bb_add_wcsn - Adds a string to a UTF-8 builder (with size).
+ * @bb: the UTF-8 builder
+ * @str: the string
+ * @size: number of characters
+ *
+ * Adds @size characters of @str to @bb, encoded as UTF-8.
+ * [Strings]
+ */
+void mpdm_bb_add_wcsn(struct mpdm_bb *bb, const wchar_t *str, int size)
+{
+    if (str != NULL && size > 0) {
+        unsigned char *ptr;
+        int n, l = 0;
+
+        for (n = 0; n < size; n++)
+            l += utf8_len(str[n]);
+
+        mpdm_bb_reserve(bb, l);
+        ptr = (unsigned char *) bb->ptr + bb->size;
+
+        for (n = 0; n < size; n++)
+            ptr = utf8_put(ptr, str[n]);
+
+        bb->size += l;
+    }
+}
+
+
+/**
+ * mpdm_bb_add_v - Adds a value to a UTF-8 builder.
+ * @bb: the UTF-8 builder
+ * @v: the value
+ *
+ * Adds the string representation of @v to @bb, encoded as UTF-8.
+ * Strings already stored in UTF-8 are copied as is.
+ * [Strings]
+ */
+void mpdm_bb_add_v(struct mpdm_bb *bb, const mpdm_t v)
+{
+    if (v != NULL) {
+        const char *ptr;
+        int l;
+
+        mpdm_ref(v);
+
+        if ((ptr = mpdm_utf8(v, &l)) != NULL) {
+            /* already UTF-8: copy as is */
+            mpdm_bb_reserve(bb, l);
+            memcpy(bb->ptr + bb->size, ptr, l);
+            bb->size += l;
+        }
+        else
+        if (mpdm_type(v) == MPDM_TYPE_STRING && (v->flags & MPDM_F_REPR)) {
+            /* compact: convert by chunks */
+            wchar_t tmp[256];
+            int n, o = 0;
+
+            while ((n = mpdm_string_n(v, o, tmp, 256)) > 0) {
+                mpdm_bb_add_wcsn(bb, tmp, n);
+                o += n;
+            }
+        }
+        else {
+            wchar_t *wptr = mpdm_string(v);
+
+            mpdm_bb_add_wcsn(bb, wptr, wcslen(wptr));
+        }
+
+        mpdm_unref(v);
+    }
+}
+
+
+/**
+ * mpdm_bb_detach - Returns the bytes of a UTF-8 builder.
+ * @bb: the UTF-8 builder
+ * @size: a pointer to store the size
+ *
+ * Returns the null terminated bytes built in @bb (that must be
+ * freed by the caller) and stores its size into @size. If nothing
+ * was added, returns NULL. @bb is left empty.
+ * [Strings]
+ */
+char *mpdm_bb_detach(struct mpdm_bb *bb, int *size)
+{
+    char *ptr = bb->ptr;
+
+    if (ptr != NULL) {
+        /* the buffer is trimmed to its final size */
+        if (bb->size + 1 < bb->alloc)
+            ptr = realloc(ptr, bb->size + 1);
+
+        ptr[bb->size] = '\0';
+    }
+
+    *size = bb->size;
+    mpdm_bb_init(bb);
+
+    return ptr;
+}
+
+
+static int ascii_to_wcs_c(const unsigned char *ptr, int size, wchar_t *wcs)
+/* copies the leading ASCII chars of ptr to wcs; returns how many */
+{
+    int n;
+
+    for (n = 0; n < size && ptr[n] < 0x80; n++)
+        wcs[n] = ptr[n];
+
+    return n;
+}
+
+
+static int ascii_to_mbs_c(const wchar_t *wcs, int size, unsigned char *ptr)
+/* copies the leading ASCII chars of wcs to ptr; returns how many */
+{
+    int n;
+
+    for (n = 0; n < size && wcs[n] >= 0 && wcs[n] < 0x80; n++)
+        ptr[n] = wcs[n];
+
+    return n;
+}
+
+
+#ifdef SIMD_WCS
+
+static int ascii_to_wcs_sse2(const unsigned char *ptr, int size, wchar_t *wcs)
+{
+    const __m128i z = _mm_setzero_si128();
+    int n = 0;
+
+    /* widen by blocks of 16 chars while all of them are ASCII */
+    while (n + 16 <= size) {
+        __m128i b = _mm_loadu_si128((const __m128i *) (ptr + n));
+        __m128i l, h;
+
+        if (_mm_movemask_epi8(b))
+            break;
+
+        l = _mm_unpacklo_epi8(b, z);
+        h = _mm_unpackhi_epi8(b, z);
+
+        _mm_storeu_si128((__m128i *) (wcs + n),      _mm_unpacklo_epi16(l, z));
+        _mm_storeu_si128((__m128i *) (wcs + n + 4),  _mm_unpackhi_epi16(l, z));
+        _mm_storeu_si128((__m128i *) (wcs + n + 8),  _mm_unpacklo_epi16(h, z));
+        _mm_storeu_si128((__m128i *) (wcs + n + 12), _mm_unpackhi_epi16(h, z));
+
+        n += 16;
+    }
+
+    return n + ascii_to_wcs_c(ptr + n, size - n, wcs + n);
+}
+
+
+static int ascii_to_mbs_sse2(const wchar_t *wcs, int size, unsigned char *ptr)
+{
+    const __m128i m = _mm_set1_epi32(~0x7f);
+    const __m128i z = _mm_setzero_si128();
+    int n = 0;
+
+    /* narrow by blocks of 16 chars while all of them are ASCII */
+    while (n + 16 <= size) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (wcs + n));
+        __m128i b = _mm_loadu_si128((const __m128i *) (wcs + n + 4));
+        __m128i c = _mm_loadu_si128((const __m128i *) (wcs + n + 8));
+        __m128i d = _mm_loadu_si128((const __m128i *) (wcs + n + 12));
+        __m128i o = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(o, m), z)) != 0xffff)
+            break;
+
+        _mm_storeu_si128((__m128i *) (ptr + n),
+            _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
+
+        n += 16;
+    }
+
+    return n + ascii_to_mbs_c(wcs + n, size - n, ptr + n);
+}
+
+#endif /* SIMD_WCS */
+
+#if defined(SIMD_WCS) && defined(CONFOPT_AVX2)
+
+__attribute__((target("avx2")))
+static int ascii_to_wcs_avx2(const unsigned char *ptr, int size, wchar_t *wcs)
+{
+    int n = 0;
+
+    /* widen by blocks of 32 chars while all of them are ASCII */
+    while (n + 32 <= size) {
+        __m256i b = _mm256_loadu_si256((const __m256i *) (ptr + n));
+        int i;
+
+        if (_mm256_movemask_epi8(b))
+            break;
+
+        for (i = 0; i < 32; i += 8)
+            _mm256_storeu_si256((__m256i *) (wcs + n + i),
+                _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (ptr + n + i))));
+
+        n += 32;
+    }
+
+    /* avoid the AVX to SSE transition penalty in the tail */
+    _mm256_zeroupper();
+
+    return n + ascii_to_wcs_sse2(ptr + n, size - n, wcs + n);
+}
+
+
+__attribute__((target("avx2")))
+static int ascii_to_mbs_avx2(const wchar_t *wcs, int size, unsigned char *ptr)
+{
+    const __m256i m = _mm256_set1_epi32(~0x7f);
+    const __m256i p = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    int n = 0;
+
+    /* narrow by blocks of 32 chars while all of them are ASCII */
+    while (n + 32 <= size) {
+        __m256i a = _mm256_loadu_si256((const __m256i *) (wcs + n));
+        __m256i b = _mm256_loadu_si256((const __m256i *) (wcs + n + 8));
+        __m256i c = _mm256_loadu_si256((const __m256i *) (wcs + n + 16));
+        __m256i d = _mm256_loadu_si256((const __m256i *) (wcs + n + 24));
+        __m256i o = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+
+        if (!_mm256_testz_si256(o, m))
+            break;
+
+        /* the packs work by 128 bit lanes; put them back in order */
+        o = _mm256_packus_epi16(_mm256_packs_epi32(a, b), _mm256_packs_epi32(c, d));
+        _mm256_storeu_si256((__m256i *) (ptr + n), _mm256_permutevar8x32_epi32(o, p));
+
+        n += 32;
+    }
+
+    /* avoid the AVX to SSE transition penalty in the tail */
+    _mm256_zeroupper();
+
+    return n + ascii_to_mbs_sse2(wcs + n, size - n, ptr + n);
+}
+
+#endif /* SIMD_WCS && CONFOPT_AVX2 */
+
+
+static void select_transcoders(void)
+/* selects the fastest ASCII transcoders for this CPU */
+{
+    ascii_to_wcs = ascii_to_wcs_c;
+    ascii_to_mbs = ascii_to_mbs_c;
+
+#ifdef SIMD_WCS
+    ascii_to_wcs = ascii_to_wcs_sse2;
+    ascii_to_mbs = ascii_to_mbs_sse2;
+
+#ifdef CONFOPT_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        ascii_to_wcs = ascii_to_wcs_avx2;
+        ascii_to_mbs = ascii_to_mbs_avx2;
+    }
+#endif
+#endif
+}
+
+
+static int utf8_locale(void)
+/* returns true if the locale encoding is UTF-8 */
+{
+    int r = 0;
+
+#ifndef CONFOPT_WIN32
+    /* (not on win32, as its wide chars cannot hold all code points) */
+    wchar_t wc;
+    mbstate_t ps;
+
+    memset(&ps, '\0', sizeof(ps));
+    r = mbrtowc(&wc, "\xe2\x82\xac", 3, &ps) == 3 && wc == 0x20ac;
+#endif
+
+    return r;
+}
+
+
+static int utf8_to_wcs(const char *str, int size, wchar_t *wcs)
+/* decodes size bytes of UTF-8 into wcs (that must have room for size
+   chars), replacing each invalid byte with the Unicode replacement
+   char; returns the number of chars */
+{
+    const unsigned char *ptr = (const unsigned char *) str;
+    int n = 0, o = 0;
+
+    if (ascii_to_wcs == NULL)
+        select_transcoders();
+
+    while (n < size) {
+        if (ptr[n] < 0x80) {
+            int i = ascii_to_wcs(ptr + n, size - n, wcs + o);
+
+            n += i;
+            o += i;
+        }
+        else {
+            int i = utf8_char(ptr + n, size - n, wcs + o);
+
+            if (i == 0) {
+                wcs[o] = L'\xfffd';
+                i = 1;
+            }
+
+            n += i;
+            o++;
+        }
+    }
+
+    return o;
+}
+
+
+static int wcs_to_utf8(const wchar_t *wcs, int size, char *str)
+/* encodes size wide chars as UTF-8 into str (that must have room for
+   4 bytes per char), replacing invalid ones with question marks;
+   returns the number of bytes */
+{
+    unsigned char *ptr = (unsigned char *) str;
+    int n = 0;
+
+    if (ascii_to_mbs == NULL)
+        select_transcoders();
+
+    while (n < size) {
+        wchar_t wc = wcs[n];
+
+        if (wc >= 0 && wc < 0x80) {
+            int i = ascii_to_mbs(wcs + n, size - n, ptr);
+
+            n   += i;
+            ptr += i;
+        }
+        else {
+            if (wc < 0 || (wc >= 0xd800 && wc < 0xe000) || wc > 0x10ffff)
+                wc = L'?';
+
+            ptr = utf8_put(ptr, wc);
+            n++;
+        }
+    }
+
+    return ptr - (unsigned char *) str;
+}
+
+
+int mpdm_ascii_to_wcs(const char *str, int size, wchar_t *wcs)
+/* copies the leading ASCII chars of str to wcs; returns how many */
+{
+    if (ascii_to_wcs == NULL)
+        select_transcoders();
+
+    return ascii_to_wcs((const unsigned char *) str, size, wcs);
+}
+
+
+int mpdm_ascii_to_mbs(const wchar_t *wcs, int size, char *str)
+/* copies the leading ASCII chars of wcs to str; returns how many */
+{
+    if (ascii_to_mbs == NULL)
+        select_transcoders();
+
+    return ascii_to_mbs(wcs, size, (unsigned char *) str);
+}
+
+
+int mpdm_utf8_to_wcs(const char *str, int size, wchar_t *wcs)
+/* decodes size bytes of UTF-8 into wcs; returns the number of chars */
+{
+    return utf8_to_wcs(str, size, wcs);
+}
+
+
+int mpdm_wcs_to_utf8(const wchar_t *wcs, int size, char *str)
+/* encodes size wide chars as UTF-8 into str (room for 4 bytes
+   per char); returns the number of bytes */
+{
+    return wcs_to_utf8(wcs, size, str);
+}
+
+
+wchar_t *mpdm_mbstowcs(const char *str, int *s, int l)
+/* converts an mbs to a wcs, but filling invalid chars
+   with question marks instead of just failing */
+{
+    wchar_t *ptr = NULL;
+    char tmp[64];               /* really MB_CUR_MAX + 1 */
+    wchar_t wc;
+    int n, i, c;
+    int t = 0;
+    char *cstr;
+
+    /* allow NULL values for s */
+    if (s == NULL)
+        s = &t;
+
+    if (utf8_locale()) {
+        /* UTF-8 is decoded here */
+        const char *e = l >= 0 ? memchr(str, '\0', l) : NULL;
+
+        n   = l < 0 ? (int) strlen(str) : e != NULL ? e - str : l;
+        ptr = malloc((n + 1) * sizeof(wchar_t));
+        *s  = utf8_to_wcs(str, n, ptr);
+
+        /* give back the room of multibyte chars if significant */
+        if (*s < n - n / 4)
+            ptr = realloc(ptr, (*s + 1) * sizeof(wchar_t));
+
+        ptr[*s] = L'\0';
+    }
+    else {
+        /* if there is a limit, duplicate and break the string */
+        if (l >= 0) {
+            cstr = strdup(str);
+            cstr[l] = '\0';
+        }
+        else
+            cstr = (char *) str;
+
+        /* try first a direct conversion with mbstowcs */
+        if ((*s = mbstowcs(NULL, cstr, 0)) != -1) {
+            /* direct conversion is possible; do it */
+            ptr = calloc((*s + 1), sizeof(wchar_t));
+            mbstowcs(ptr, cstr, *s);
+        }
+        else {
+            /* zero everything */
+            *s = n = i = 0;
+
+            for (;;) {
+                /* no more characters to process? */
+                if ((c = cstr[n + i]) == '\0' && i == 0)
+                    break;
+
+                tmp[i++] = c;
+                tmp[i] = '\0';
+
+                /* try to convert */
+                if (mbstowcs(&wc, tmp, 1) == (int) - 1) {
+                    /* can still be an incomplete multibyte char? */
+                    if (c != '\0' && i <= (int) MB_CUR_MAX)
+                        continue;
+                    else {
+                        /* too many failing bytes; skip 1 byte
+                           and use the Unicode replacement char */
+                        wc = L'\xfffd';
+                        i = 1;
+                    }
+                }
+
+                /* skip used bytes and back again */
+                n += i;
+                i = 0;
+
+                /* store new char */
+                if ((ptr = mpdm_pokewsn(ptr, s, &wc, 1)) == NULL)
+                    break;
+            }
+        }
+
+        /* free the duplicate */
+        if (cstr != str)
+            free(cstr);
+    }
+
+    return ptr;
+}
+
+
+char *mpdm_wcstombs(const wchar_t *str, int *s)
+/* converts a wcs to an mbs, but filling invalid chars
+   with question marks instead of just failing */
+{
+    char *ptr = NULL;
+    char tmp[64];               /* really MB_CUR_MAX + 1 */
+    int l;
+    int t = 0;
+
+    /* allow NULL values for s */
+    if (s == NULL)
+        s = &t;
+
+    if (utf8_locale()) {
+        /* UTF-8 is encoded here */
+        l   = wcslen(str);
+        ptr = malloc(l * 4 + 1);
+        *s  = wcs_to_utf8(str, l, ptr);
+        ptr = realloc(ptr, *s + 1);
+
+        ptr[*s] = '\0';
+    }
+    else {
+        /* try first a direct conversion with wcstombs */
+        if ((*s = wcstombs(NULL, str, 0)) != -1) {
+            /* direct conversion is possible; do it */
+            ptr = calloc(*s + 1, 1);
+            wcstombs(ptr, str, *s);
+        }
+        else {
+            /* invalid encoding? convert characters one by one */
+            *s = 0;
+
+            while (*str) {
+                if ((l = wctomb(tmp, *str)) <= 0) {
+                    /* if char couldn't be converted,
+                       write a question mark instead */
+                    l = wctomb(tmp, L'?');
+                }
+
+                tmp[l] = '\0';
+                if ((ptr = mpdm_poke(ptr, s, tmp, l, 1)) == NULL)
+                    break;
+
+                str++;
+            }
+
+            /* null terminate and count one less */
+            if (ptr != NULL) {
+                ptr = mpdm_poke(ptr, s, "", 1, 1);
+                (*s)--;
+            }
+        }
+    }
+
+    return ptr;
+}
+
+
+mpdm_t mpdm_new_wcs(const wchar_t *str, int size, int cpy)
+/* creates a new string value from a wcs */
+{
+    wchar_t *ptr = NULL;
+    mpdm_t v;
+
+    /* a size of -1 means 'calculate it' */
+    if (size == -1 && str != NULL)
+        size = wcslen(str);
+
+    if (size >= 0 && (cpy || str != NULL) &&
+        (size + 1) * (int) sizeof(wchar_t) <= INLINE_STRING_MAX) {
+        /* short strings are stored inline */
+        v = mpdm_new_inline(MPDM_TYPE_STRING, (size + 1) * sizeof(wchar_t), size);
+
+        if (str != NULL) {
+            wcsncpy((wchar_t *) v->data, str, size);
+
+            /* external strings are owned, so not needed anymore */
+            if (!cpy)
+                free((wchar_t *) str);
+        }
+    }
+    else {
+        /* create a copy? */
+        if (size >= 0 && cpy) {
+            ptr = calloc(size + 1, sizeof(wchar_t));
+
+            /* if there is a source, copy it */
+            if (str != NULL)
+                wcsncpy(ptr, str, size);
+        }
+
+        v = mpdm_new(MPDM_TYPE_STRING, ptr ? ptr : str, size);
+    }
+
+    return v;
+}
+
+
+static int narrowest(const wchar_t *str, int size, int *flags)
+/* returns the narrowest char width to store str (and the flags for it) */
+{
+    unsigned int m = 0;
+    int n;
+
+    /* find the widest character */
+    for (n = 0; n < size; n++) {
+        if ((unsigned int) str[n] > m)
+            m = (unsigned int) str[n];
+    }
+
+    /* 7 bit strings are also valid UTF-8 */
+    *flags = m < 0x80 ? MPDM_F_ASCII : m < 0x100 ? MPDM_F_LATIN1 :
+             m < 0x10000 ? MPDM_F_UCS2 : 0;
+
+    return m < 0x100 ? 1 : m < 0x10000 ? 2 : (int) sizeof(wchar_t);
+}
+
+
+static void narrow_copy(void *dst, const wchar_t *str, int size, int w)
+/* copies str into dst as w byte characters */
+{
+    int n;
+
+    if (w == 1) {
+        unsigned char *ptr = (unsigned char *) dst;
+
+        for (n = 0; n < size; n++)
+            ptr[n] = (unsigned char) str[n];
+    }
+    else
+    if (w == 2) {
+        uint16_t *ptr = (uint16_t *) dst;
+
+        for (n = 0; n < size; n++)
+            ptr[n] = (uint16_t) str[n];
+    }
+    else
+        wmemcpy((wchar_t *) dst, str, size);
+}
+
+
+/**
+ * mpdm_new_compact - Creates a new string value stored compactly.
+ * @str: the string
+ * @size: the size of the string (-1, till the end)
+ * @cpy: 0 if @str is a malloc()ed block to be owned by the value
+ *
+ * Creates a new string value like mpdm_new_wcs(), but storing
+ * each character in 1, 2 or 4 bytes, depending on the widest one.
+ * The string is transparently converted to a wide character one
+ * the first time it's accessed through mpdm_string(), so this is
+ * only useful for big amounts of text that are seldom used (like
+ * the lines of a file). Values are cloned or written into files
+ * without this conversion.
+ * [Value Creation]
+ */
+mpdm_t mpdm_new_compact(const wchar_t *str, int size, int cpy)
+{
+    int w, f;
+    mpdm_t v;
+
+    if (size == -1)
+        size = wcslen(str);
+
+    w = narrowest(str, size, &f);
+
+    if (w >= (int) sizeof(wchar_t))
+        v = mpdm_new_wcs(str, size, cpy);
+    else {
+        if ((size + 1) * w <= INLINE_STRING_MAX)
+            v = mpdm_new_inline(MPDM_TYPE_STRING, (size + 1) * w, size);
+        else
+            v = mpdm_new(MPDM_TYPE_STRING, calloc(size + 1, w), size);
+
+        narrow_copy((void *) v->data, str, size, w);
+        v->flags |= f;
+
+        if (!cpy)
+            free((wchar_t *) str);
+    }
+
+    return v;
+}
+
+
+static int utf8_bytes(const char *str, int size)
+/* returns the number of bytes of the first size chars of valid UTF-8 */
+{
+    const unsigned char *ptr = (const unsigned char *) str;
+    wchar_t wc;
+    int n = 0;
+
+    while (size--)
+        n += utf8_char(ptr + n, 4, &wc);
+
+    return n;
+}
+
+
+static int utf8_string_n(const char *str, int offset, wchar_t *buf, int size)
+/* decodes size chars of valid UTF-8 from offset (in chars) */
+{
+    const unsigned char *ptr = (const unsigned char *) str;
+    int n;
+
+    /* no random access: skip up to the offset */
+    ptr += utf8_bytes(str, offset);
+
+    for (n = 0; n < size; n++)
+        ptr += utf8_char(ptr, 4, &buf[n]);
+
+    return size;
+}
+
+
+/**
+ * mpdm_new_utf8 - Creates a new string value from UTF-8 text.
+ * @str: the UTF-8 string
+ * @size: the size of the string in bytes (-1, till the end)
+ * @cpy: 0 if @str is a malloc()ed, null terminated block to be owned
+ *
+ * Creates a new string value that keeps @str in UTF-8 instead of
+ * decoding it, so it can be compared, splitted, joined, hashed or
+ * written to UTF-8 files without conversion. It's converted to a
+ * wide character string the first time it's accessed through
+ * mpdm_string(). Invalid sequences are replaced by the Unicode
+ * replacement char (and the string is then decoded).
+ * [Value Creation]
+ * [Character Set Conversion]
+ */
+mpdm_t mpdm_new_utf8(const char *str, int size, int cpy)
+{
+    const unsigned char *ptr = (const unsigned char *) str;
+    int n, l, c, a = 1;
+    wchar_t wc;
+    mpdm_t v;
+
+    if (size == -1)
+        size = strlen(str);
+
+    /* count the characters, validating them */
+    for (n = c = 0; n < size && (l = utf8_char(ptr + n, size - n, &wc)); n += l, c++) {
+        if (l > 1)
+            a = 0;
+    }
+
+    if (n < size) {
+        /* invalid sequences: decode it all */
+        wchar_t *wptr = malloc((size + 1) * sizeof(wchar_t));
+
+        for (n = c = 0; n < size; n += l) {
+            if ((l = utf8_char(ptr + n, size - n, &wc)) == 0) {
+                wc = L'\xfffd';
+                l  = 1;
+            }
+
+            wptr[c++] = wc;
+        }
+
+        v = mpdm_new_compact(wptr, c, 0);
+
+        if (!cpy)
+            free((char *) str);
+    }
+    else {
+        if (size + 1 <= INLINE_STRING_MAX) {
+            v = mpdm_new_inline(MPDM_TYPE_STRING, size + 1, c);
+            memcpy((char *) v->data, str, size);
+
+            if (!cpy)
+                free((char *) str);
+        }
+        else
+        if (cpy) {
+            char *p = malloc(size + 1);
+
+            memcpy(p, str, size);
+            p[size] = '\0';
+
+            v = mpdm_new(MPDM_TYPE_STRING, p, c);
+        }
+        else
+            v = mpdm_new(MPDM_TYPE_STRING, str, c);
+
+        v->flags |= a ? MPDM_F_ASCII : MPDM_F_UTF8;
+    }
+
+    return v;
+}
+
+
+mpdm_t mpdm_new_slice_2(const mpdm_t v, int offset, int size, int boffset)
+/* boffset is the offset in bytes if v is UTF-8, or -1 if unknown */
+{
+    mpdm_t p = v;
+    mpdm_t r;
+
+    /* slices of slices are slices of the original string */
+    if (p->flags & MPDM_F_SLICE) {
+        struct slice *s = (struct slice *) p->data;
+
+        p       = s->parent;
+        offset += s->offset;
+
+        if (boffset != -1)
+            boffset += s->boffset;
+    }
+
+    if ((p->flags & MPDM_F_UTF8) && boffset == -1)
+        boffset = utf8_bytes((char *) p->data, offset);
+
+    if (size < SLICE_MIN_SIZE || (p->flags & (MPDM_F_SHARED | MPDM_F_HASHED))) {
+        /* short slices (or of parents that cannot track them) are copies */
+        if (p->flags & MPDM_F_UTF8) {
+            const char *ptr = (char *) p->data + boffset;
+
+            r = mpdm_new_utf8(ptr, utf8_bytes(ptr, size), 1);
+        }
+        else
+        if (p->flags & MPDM_F_REPR) {
+            wchar_t *ptr = malloc((size + 1) * sizeof(wchar_t));
+
+            mpdm_string_n(p, offset, ptr, size);
+            r = mpdm_new_compact(ptr, size, 0);
+        }
+        else
+            r = MPDM_NS((wchar_t *) p->data + offset, size);
+    }
+    else {
+        struct slice *s;
+
+        r = mpdm_new_inline(MPDM_TYPE_STRING, sizeof(struct slice), size);
+        r->flags |= MPDM_F_SLICE;
+
+        s = (struct slice *) r->data;
+        s->parent  = mpdm_ref(p);
+        s->offset  = offset;
+        s->boffset = boffset;
+
+        /* the parent counts its slices in the (unused) hash */
+        if (!(p->flags & MPDM_F_SLICED)) {
+            p->flags |= MPDM_F_SLICED;
+            p->hash   = 0;
+        }
+
+        p->hash++;
+    }
+
+    return r;
+}
+
+
+/**
+ * mpdm_new_slice - Creates a new string value from a part of another.
+ * @v: the string value
+ * @offset: offset of the first character
+ * @size: number of characters
+ *
+ * Creates a new string value with @size characters of @v from
+ * @offset. If the part is long enough, it's not copied but
+ * references @v, that is kept alive (so this is useful to split
+ * big strings without doubling the memory usage). Parts that
+ * are much smaller than @v are copied when they are accessed if
+ * only other parts are keeping @v alive.
+ * [Value Creation]
+ * [Strings]
+ */
+mpdm_t mpdm_new_slice(const mpdm_t v, int offset, int size)
+{
+    return mpdm_new_slice_2(v, offset, size, -1);
+}
+
+
+static void slice_release(mpdm_t v)
+/* detaches a slice from its parent */
+{
+    mpdm_t p = ((struct slice *) v->data)->parent;
+
+    if (--p->hash == 0)
+        p->flags &= ~MPDM_F_SLICED;
+
+    mpdm_unref(p);
+}
+
+
+static int slice_n(const mpdm_t v, int offset, wchar_t *buf, int size)
+/* copies characters from a slice */
+{
+    struct slice *s = (struct slice *) v->data;
+    mpdm_t p = s->parent;
+
+    if ((p->flags & MPDM_F_ASCII) == MPDM_F_UTF8)
+        return utf8_string_n((char *) p->data + s->boffset, offset, buf, size);
+
+    return mpdm_string_n(p, s->offset + offset, buf, size);
+}
+
+
+static void unslice(mpdm_t v)
+/* gives a slice its own (compact) copy of the characters */
+{
+    wchar_t *ptr = malloc((v->size + 1) * sizeof(wchar_t));
+    int w, f;
+
+    slice_n(v, 0, ptr, v->size);
+    ptr[v->size] = L'\0';
+
+    if ((w = narrowest(ptr, v->size, &f)) < (int) sizeof(wchar_t)) {
+        void *cptr = calloc(v->size + 1, w);
+
+        narrow_copy(cptr, ptr, v->size, w);
+        free(ptr);
+        ptr = cptr;
+    }
+
+    slice_release(v);
+
+    v->data   = ptr;
+    v->flags &= ~(MPDM_F_INLINE | MPDM_F_REPR);
+    v->flags |= f;
+}
+
+
+static int rope_depth(const mpdm_t v)
+{
+    return (v->flags & MPDM_F_ROPE) ? ((struct rope *) v->data)->depth : 0;
+}
+
+
+static mpdm_t rope_node(mpdm_t l, mpdm_t r)
+/* creates a rope node from two strings */
+{
+    mpdm_t v;
+    struct rope *n;
+    int dl = rope_depth(l);
+    int dr = rope_depth(r);
+
+    v = mpdm_new_inline(MPDM_TYPE_STRING, sizeof(struct rope),
+                        mpdm_size(l) + mpdm_size(r));
+    v->flags |= MPDM_F_ROPE;
+
+    n = (struct rope *) v->data;
+    n->left  = mpdm_ref(l);
+    n->right = mpdm_ref(r);
+    n->depth = 1 + (dl > dr ? dl : dr);
+
+    return v;
+}
+
+
+static void rope_release(mpdm_t v)
+/* detaches a rope node from its parts */
+{
+    struct rope *n = (struct rope *) v->data;
+
+    mpdm_unref(n->left);
+    mpdm_unref(n->right);
+}
+
+
+static mpdm_t rope_rotl(mpdm_t v)
+/* rotates a (just created) rope node to the left */
+{
+    mpdm_t x = ROPE_R(v);
+    mpdm_t r;
+
+    r = rope_node(rope_node(ROPE_L(v), ROPE_L(x)), ROPE_R(x));
+    mpdm_void(v);
+
+    return r;
+}
+
+
+static mpdm_t rope_rotr(mpdm_t v)
+/* rotates a (just created) rope node to the right */
+{
+    mpdm_t x = ROPE_L(v);
+    mpdm_t r;
+
+    r = rope_node(ROPE_L(x), rope_node(ROPE_R(x), ROPE_R(v)));
+    mpdm_void(v);
+
+    return r;
+}
+
+
+static mpdm_t rope_join_r(mpdm_t l, mpdm_t r)
+/* joins r to the right of a deeper rope l */
+{
+    mpdm_t ll = ROPE_L(l);
+    mpdm_t c  = ROPE_R(l);
+    mpdm_t t;
+
+    if (rope_depth(c) <= rope_depth(r) + 1) {
+        t = rope_node(c, r);
+
+        if (rope_depth(t) <= rope_depth(ll) + 1)
+            t = rope_node(ll, t);
+        else
+            t = rope_rotl(rope_node(ll, rope_rotr(t)));
+    }
+    else {
+        t = rope_join_r(c, r);
+
+        if (rope_depth(t) <= rope_depth(ll) + 1)
+            t = rope_node(ll, t);
+        else
+            t = rope_rotl(rope_node(ll, t));
+    }
+
+    return t;
+}
+
+
+static mpdm_t rope_join_l(mpdm_t l, mpdm_t r)
+/* joins l to the left of a deeper rope r */
+{
+    mpdm_t c  = ROPE_L(r);
+    mpdm_t rr = ROPE_R(r);
+    mpdm_t t;
+
+    if (rope_depth(c) <= rope_depth(l) + 1) {
+        t = rope_node(l, c);
+
+        if (rope_depth(t) <= rope_depth(rr) + 1)
+            t = rope_node(t, rr);
+        else
+            t = rope_rotr(rope_node(rope_rotl(t), rr));
+    }
+    else {
+        t = rope_join_l(l, c);
+
+        if (rope_depth(t) <= rope_depth(rr) + 1)
+            t = rope_node(t, rr);
+        else
+            t = rope_rotr(rope_node(t, rr));
+    }
+
+    return t;
+}
+
+
+static mpdm_t rope_join(mpdm_t l, mpdm_t r)
+/* joins two strings into a balanced rope */
+{
+    mpdm_t v;
+
+    if (rope_depth(l) > rope_depth(r) + 1)
+        v = rope_join_r(l, r);
+    else
+    if (rope_depth(r) > rope_depth(l) + 1)
+        v = rope_join_l(l, r);
+    else
+        v = rope_node(l, r);
+
+    return v;
+}
+
+
+static mpdm_t flat_cat(const mpdm_t l, const mpdm_t r)
+/* concatenates two strings into a new wide character one */
+{
+    int sl = mpdm_size(l);
+    int sr = mpdm_size(r);
+    wchar_t *ptr = malloc((sl + sr + 1) * sizeof(wchar_t));
+
+    mpdm_string_n(l, 0, ptr, sl);
+    mpdm_string_n(r, 0, ptr + sl, sr);
+    ptr[sl + sr] = L'\0';
+
+    return MPDM_ENS(ptr, sl + sr);
+}
+
+
+static mpdm_t rope_cat(mpdm_t l, mpdm_t r)
+/* concatenates two strings into a rope */
+{
+    mpdm_t v;
+
+    /* short strings added to the ends are merged
+       with the leaf there instead of making a new one */
+    if ((l->flags & MPDM_F_ROPE) && !(r->flags & MPDM_F_ROPE) &&
+        !(ROPE_R(l)->flags & MPDM_F_ROPE) &&
+        mpdm_size(ROPE_R(l)) + mpdm_size(r) <= ROPE_LEAF_SIZE)
+        v = rope_join(ROPE_L(l), flat_cat(ROPE_R(l), r));
+    else
+    if ((r->flags & MPDM_F_ROPE) && !(l->flags & MPDM_F_ROPE) &&
+        !(ROPE_L(r)->flags & MPDM_F_ROPE) &&
+        mpdm_size(l) + mpdm_size(ROPE_L(r)) <= ROPE_LEAF_SIZE)
+        v = rope_join(flat_cat(l, ROPE_L(r)), ROPE_R(r));
+    else
+        v = rope_join(l, r);
+
+    return v;
+}
+
+
+static int rope_n(const mpdm_t v, int offset, wchar_t *buf, int size)
+/* copies characters from a rope */
+{
+    mpdm_t l = ROPE_L(v);
+    int n = 0;
+
+    if (offset < mpdm_size(l))
+        n = mpdm_string_n(l, offset, buf, size);
+
+    if (n < size)
+        n += mpdm_string_n(ROPE_R(v), offset + n - mpdm_size(l), buf + n, size - n);
+
+    return n;
+}
+
+
+mpdm_t mpdm_string__destroy(mpdm_t v)
+{
+    if (v->flags & MPDM_F_SLICE)
+        slice_release(v);
+    else
+    if (v->flags & MPDM_F_ROPE)
+        rope_release(v);
+
+    return v;
+}
+
+
+mpdm_t mpdm_new_mbstowcs(const char *str, int l)
+/* creates a new string value from an mbs */
+{
+    wchar_t *ptr;
+    int size;
+
+    ptr = mpdm_mbstowcs(str, &size, l);
+
+    return MPDM_ENS(ptr, size);
+}
+
+
+mpdm_t mpdm_new_wcstombs(const wchar_t *str)
+/* creates a new mbs value from a wbs */
+{
+    char *ptr;
+    int size;
+
+    ptr = mpdm_wcstombs(str, &size);
+
+    return mpdm_new(MPDM_TYPE_MBS, ptr, size);
+}
+
+
+mpdm_t mpdm_number__destroy(mpdm_t v)
+{
+    /* numbers are stored in the value itself */
+    v->data = NULL;
+
+    return v;
+}
+
+
+mpdm_t mpdm_new_i(int ival)
+/* creates a new integer value */
+{
+    mpdm_t v;
+
+    if (ival >= 0 && ival < MPDM_SMALL_INTS && small_ints[ival] != NULL)
+        v = small_ints[ival];
+    else {
+        v = mpdm_new(MPDM_TYPE_INTEGER, NULL, sizeof(ival));
+        v->ival = ival;
+
+        /* small integers are created once and kept forever */
+        if (ival >= 0 && ival < MPDM_SMALL_INTS)
+            small_ints[ival] = mpdm_ref(v);
+    }
+
+    return v;
+}
+
+
+void mpdm_small_ints_free(void)
+/* unreferences the small integers */
+{
+    int n;
+
+    for (n = 0; n < MPDM_SMALL_INTS; n++) {
+        mpdm_unref(small_ints[n]);
+        small_ints[n] = NULL;
+    }
+}
+
+
+mpdm_t mpdm_new_r(double rval)
+/* creates a new real value */
+{
+    mpdm_t v = mpdm_new(MPDM_TYPE_REAL, NULL, sizeof(rval));
+
+    v->rval = rval;
+
+    return v;
+}
+
+
+static wchar_t *flatten(mpdm_t v)
+/* converts the data of a string value to a wide character string */
+{
+    wchar_t *ptr;
+
+    ptr = malloc((v->size + 1) * sizeof(wchar_t));
+    mpdm_string_n(v, 0, ptr, v->size);
+    ptr[v->size] = L'\0';
+
+    if (v->flags & MPDM_F_SLICE)
+        slice_release(v);
+    else
+    if (v->flags & MPDM_F_ROPE)
+        rope_release(v);
+
+    /* inline storage is just left unused */
+    if (!(v->flags & MPDM_F_INLINE))
+        free((void *) v->data);
+
+    v->data   = ptr;
+    v->flags &= ~(MPDM_F_INLINE | MPDM_F_REPR);
+
+    return ptr;
+}
+
+
+/* interface */
+
+/**
+ * mpdm_string_n - Copies characters from a string value.
+ * @v: the string value
+ * @offset: offset of the first character
+ * @buf: the destination buffer
+ * @size: maximum number of characters
+ *
+ * Copies up to @size characters of the @v string value from
+ * @offset into @buf, whatever its internal storage is and without
+ * converting it. No null character is added. Returns the number
+ * of copied characters.
+ * [Strings]
+ */
+int mpdm_string_n(const mpdm_t v, int offset, wchar_t *buf, int size)
+{
+    int n;
+
+    if (offset < 0 || offset > mpdm_size(v))
+        offset = mpdm_size(v);
+
+    if (size > mpdm_size(v) - offset)
+        size = mpdm_size(v) - offset;
+
+    if (v->flags & MPDM_F_SLICE) {
+        struct slice *s = (struct slice *) v->data;
+
+        slice_n(v, offset, buf, size);
+
+        /* only slices are keeping a much bigger parent alive? */
+        if (s->parent->ref == (int) s->parent->hash &&
+            v->size * SLICE_WASTE < s->parent->size)
+            unslice(v);
+    }
+    else
+    if (v->flags & MPDM_F_ROPE)
+        rope_n(v, offset, buf, size);
+    else
+    if (v->flags & MPDM_F_LATIN1) {
+        const unsigned char *ptr = (const unsigned char *) v->data + offset;
+
+        for (n = 0; n < size; n++)
+            buf[n] = ptr[n];
+    }
+    else
+    if (v->flags & MPDM_F_UCS2) {
+        const uint16_t *ptr = (const uint16_t *) v->data + offset;
+
+        for (n = 0; n < size; n++)
+            buf[n] = ptr[n];
+    }
+    else
+    if (v->flags & MPDM_F_UTF8)
+        utf8_string_n((char *) v->data, offset, buf, size);
+    else
+    if (size > 0)
+        wmemcpy(buf, (const wchar_t *) v->data + offset, size);
+
+    return size > 0 ? size : 0;
+}
+
+
+/**
+ * mpdm_utf8 - Returns the UTF-8 bytes of a string value.
+ * @v: the string value
+ * @size: a pointer to store the size in bytes
+ *
+ * If the @v string value is stored in UTF-8 (or 7 bit ASCII, or
+ * is a part of such a string), returns a pointer to its bytes
+ * (that are not necessarily null terminated) and stores its
+ * size in bytes into @size. Returns NULL otherwise.
+ * [Strings]
+ * [Character Set Conversion]
+ */
+const char *mpdm_utf8(const mpdm_t v, int *size)
+{
+    const char *ptr = NULL;
+
+    if (mpdm_type(v) == MPDM_TYPE_STRING) {
+        if (v->flags & MPDM_F_UTF8) {
+            ptr   = (char *) v->data;
+            *size = (v->flags & MPDM_F_LATIN1) ? v->size : (int) strlen(ptr);
+        }
+        else
+        if (v->flags & MPDM_F_SLICE) {
+            struct slice *s = (struct slice *) v->data;
+            mpdm_t p = s->parent;
+
+            if (p->flags & MPDM_F_UTF8) {
+                ptr   = (char *) p->data + s->boffset;
+                *size = (p->flags & MPDM_F_LATIN1) ? v->size : utf8_bytes(ptr, v->size);
+            }
+        }
+    }
+
+    return ptr;
 }
 
 
-wchar_t *mpdm_pokews(wchar_t *dst, int *dsize, const wchar_t *str)
-/* adds a wide string to dst */
+static struct diy_fp diy_fp_mul(struct diy_fp x, struct diy_fp y)
+/* multiplies two diy_fps, keeping the upper 64 bits (rounded) */
 {
-    return mpdm_pokewsn(dst, dsize, str, wcslen(str));
+    const uint64_t m32 = 0xffffffffULL;
+    uint64_t a = x.f >> 32, b = x.f & m32;
+    uint64_t c = y.f >> 32, d = y.f & m32;
+    uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    uint64_t t = (bd >> 32) + (ad & m32) + (bc & m32) + (1ULL << 31);
+    struct diy_fp r;
+
+    r.f = ac + (ad >> 32) + (bc >> 32) + (t >> 32);
+    r.e = x.e + y.e + 64;
+
+    return r;
 }
 
 
-wchar_t *mpdm_pokev(wchar_t *dst, int *dsize, const mpdm_t v)
-/* adds the string in v to dst */
+static struct diy_fp diy_fp_norm(struct diy_fp x)
+/* shifts x until its most significant bit is set */
 {
-    if (v != NULL) {
-        mpdm_ref(v);
-        dst = mpdm_pokews(dst, dsize, mpdm_string(v));
-        mpdm_unref(v);
+    while (!(x.f & 0x8000000000000000ULL)) {
+        x.f <<= 1;
+        x.e--;
     }
 
-    return dst;
+    return x;
 }
 
 
-wchar_t *mpdm_mbstowcs(const char *str, int *s, int l)
-/* converts an mbs to a wcs, but filling invalid chars
-   with question marks instead of just failing */
+static void grisu_round(wchar_t *buf, int len, uint64_t delta,
+                        uint64_t rest, uint64_t ten_kappa, uint64_t wp_w)
+/* moves the last digit closer to the exact value, if possible */
 {
-    wchar_t *ptr = NULL;
-    char tmp[64];               /* really MB_CUR_MAX + 1 */
-    wchar_t wc;
-    int n, i, c;
-    int t = 0;
-    char *cstr;
+    while (rest < wp_w && delta - rest >= ten_kappa &&
+           (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+        buf[len - 1]--;
+        rest += ten_kappa;
+    }
+}
 
-    /* allow NULL values for s */
-    if (s == NULL)
-        s = &t;
 
-    /* if there is a limit, duplicate and break the string */
-    if (l >= 0) {
-        cstr = strdup(str);
-        cstr[l] = '\0';
+static int grisu2(double r, wchar_t *buf, int *k)
+/* writes the shortest digits of the positive number r that read back
+   as r (Grisu2, by Florian Loitsch) into buf, returning how many they
+   are; r is digits * 10^k */
+{
+    union { double d; uint64_t u; } bits;
+    struct diy_fp v, w, mi, pl, c, one, wp_w;
+    uint64_t delta, p2;
+    uint32_t p1;
+    int i, kappa, len = 0;
+
+    bits.d = r;
+    v.f = bits.u & 0x000fffffffffffffULL;
+    v.e = (int) ((bits.u >> 52) & 0x7ff);
+
+    if (v.e) {
+        v.f += 0x0010000000000000ULL;
+        v.e -= 1075;
     }
     else
-        cstr = (char *) str;
+        v.e = -1074;
+
+    /* boundaries: halfway to the previous and next doubles */
+    pl.f = (v.f << 1) + 1;
+    pl.e = v.e - 1;
+    pl = diy_fp_norm(pl);
 
-    /* try first a direct conversion with mbstowcs */
-    if ((*s = mbstowcs(NULL, cstr, 0)) != -1) {
-        /* direct conversion is possible; do it */
-        ptr = calloc((*s + 1), sizeof(wchar_t));
-        mbstowcs(ptr, cstr, *s);
+    if (v.f == 0x0010000000000000ULL) {
+        mi.f = (v.f << 2) - 1;
+        mi.e = v.e - 2;
     }
     else {
-        /* zero everything */
-        *s = n = i = 0;
-
-        for (;;) {
-            /* no more characters to process? */
-            if ((c = cstr[n + i]) == '\0' && i == 0)
-                break;
+        mi.f = (v.f << 1) - 1;
+        mi.e = v.e - 1;
+    }
 
-            tmp[i++] = c;
-            tmp[i] = '\0';
+    mi.f <<= mi.e - pl.e;
+    mi.e = pl.e;
 
-            /* try to convert */
-            if (mbstowcs(&wc, tmp, 1) == (int) - 1) {
-                /* can still be an incomplete multibyte char? */
-                if (c != '\0' && i <= (int) MB_CUR_MAX)
-                    continue;
-                else {
-                    /* too many failing bytes; skip 1 byte
-                       and use the Unicode replacement char */
-                    wc = L'\xfffd';
-                    i = 1;
-                }
-            }
+    /* find the power of ten that brings pl into a binary exponent
+       between -60 and -32, so that its integer part fits in 32 bits */
+    {
+        double dk = (-61 - pl.e) * 0.30102999566398114 + 347;
 
-            /* skip used bytes and back again */
-            n += i;
-            i = 0;
+        i = (int) dk;
+        if (dk - i > 0.0)
+            i++;
 
-            /* store new char */
-            if ((ptr = mpdm_pokewsn(ptr, s, &wc, 1)) == NULL)
-                break;
-        }
+        i = (i >> 3) + 1;
+        *k = 348 - i * 8;
+        c = cached_pow10[i];
     }
 
-    /* free the duplicate */
-    if (cstr != str)
-        free(cstr);
-
-    return ptr;
-}
+    w  = diy_fp_mul(diy_fp_norm(v), c);
+    pl = diy_fp_mul(pl, c);
+    mi = diy_fp_mul(mi, c);
+    mi.f++;
+    pl.f--;
 
+    /* generate the digits of pl until they are inside the boundaries */
+    delta  = pl.f - mi.f;
+    one.f  = 1ULL << -pl.e;
+    one.e  = pl.e;
+    wp_w.f = pl.f - w.f;
+    p1     = (uint32_t) (pl.f >> -one.e);
+    p2     = pl.f & (one.f - 1);
 
-char *mpdm_wcstombs(const wchar_t *str, int *s)
-/* converts a wcs to an mbs, but filling invalid chars
-   with question marks instead of just failing */
-{
-    char *ptr = NULL;
-    char tmp[64];               /* really MB_CUR_MAX + 1 */
-    int l;
-    int t = 0;
+    for (kappa = 10; kappa > 0 && p1 < pow10_64[kappa - 1]; kappa--);
 
-    /* allow NULL values for s */
-    if (s == NULL)
-        s = &t;
+    while (kappa > 0) {
+        uint32_t d = p1 / (uint32_t) pow10_64[kappa - 1];
 
-    /* try first a direct conversion with wcstombs */
-    if ((*s = wcstombs(NULL, str, 0)) != -1) {
-        /* direct conversion is possible; do it */
-        ptr = calloc(*s + 1, 1);
-        wcstombs(ptr, str, *s);
-    }
-    else {
-        /* invalid encoding? convert characters one by one */
-        *s = 0;
-
-        while (*str) {
-            if ((l = wctomb(tmp, *str)) <= 0) {
-                /* if char couldn't be converted,
-                   write a question mark instead */
-                l = wctomb(tmp, L'?');
-            }
+        p1 %= (uint32_t) pow10_64[kappa - 1];
 
-            tmp[l] = '\0';
-            if ((ptr = mpdm_poke(ptr, s, tmp, l, 1)) == NULL)
-                break;
+        if (d || len)
+            buf[len++] = L'0' + d;
 
-            str++;
-        }
+        kappa--;
 
-        /* null terminate and count one less */
-        if (ptr != NULL) {
-            ptr = mpdm_poke(ptr, s, "", 1, 1);
-            (*s)--;
+        if ((((uint64_t) p1) << -one.e) + p2 <= delta) {
+            *k += kappa;
+            grisu_round(buf, len, delta, (((uint64_t) p1) << -one.e) + p2,
+                        pow10_64[kappa] << -one.e, wp_w.f);
+            return len;
         }
     }
 
-    return ptr;
-}
-
+    for (;;) {
+        uint32_t d;
 
-mpdm_t mpdm_new_wcs(const wchar_t *str, int size, int cpy)
-/* creates a new string value from a wcs */
-{
-    wchar_t *ptr = NULL;
+        p2    *= 10;
+        delta *= 10;
+        d     = (uint32_t) (p2 >> -one.e);
 
-    /* a size of -1 means 'calculate it' */
-    if (size == -1 && str != NULL)
-        size = wcslen(str);
+        if (d || len)
+            buf[len++] = L'0' + d;
 
-    /* create a copy? */
-    if (size >= 0 && cpy) {
-        ptr = calloc(size + 1, sizeof(wchar_t));
+        p2 &= one.f - 1;
+        kappa--;
 
-        /* if there is a source, copy it */
-        if (str != NULL)
-            wcsncpy(ptr, str, size);
+        if (p2 < delta) {
+            *k += kappa;
+            grisu_round(buf, len, delta, p2, one.f,
+                        -kappa < 20 ? wp_w.f * pow10_64[-kappa] : 0);
+            return len;
+        }
     }
-
-    return mpdm_new(MPDM_TYPE_STRING, ptr ? ptr : str, size);
 }
 
 
-mpdm_t mpdm_new_mbstowcs(const char *str, int l)
-/* creates a new string value from an mbs */
+static int real_wcs(double r, wchar_t *buf)
+/* writes r into buf as the shortest string that reads back as r,
+   in decimal notation if not too big or small; returns its size
+   (up to 25 chars, not counting the null) */
 {
-    wchar_t *ptr;
-    int size;
+    wchar_t *p = buf;
 
-    ptr = mpdm_mbstowcs(str, &size, l);
+    if (r != r)
+        wcscpy(p, L"nan");
+    else {
+        if (r < 0.0 || (r == 0.0 && 1.0 / r < 0.0)) {
+            *p++ = L'-';
+            r = -r;
+        }
 
-    return mpdm_new(MPDM_TYPE_STRING, ptr, size);
-}
+        if (r == 0.0)
+            wcscpy(p, L"0");
+        else
+        if (r > DBL_MAX)
+            wcscpy(p, L"inf");
+        else {
+            int k, n, kk, i;
 
+            n  = grisu2(r, p, &k);
+            kk = n + k;     /* 10^(kk - 1) <= r < 10^kk */
 
-mpdm_t mpdm_new_wcstombs(const wchar_t *str)
-/* creates a new mbs value from a wbs */
-{
-    char *ptr;
-    int size;
+            if (k >= 0 && kk <= 21) {
+                /* integer: 1234e2 -> 123400 */
+                for (i = n; i < kk; i++)
+                    p[i] = L'0';
 
-    ptr = mpdm_wcstombs(str, &size);
+                p += kk;
+            }
+            else
+            if (kk > 0 && kk <= 21) {
+                /* 1234e-2 -> 12.34 */
+                wmemmove(p + kk + 1, p + kk, n - kk);
+                p[kk] = L'.';
+                p += n + 1;
+            }
+            else
+            if (kk > -6 && kk <= 0) {
+                /* 1234e-6 -> 0.001234 */
+                wmemmove(p + 2 - kk, p, n);
+                p[0] = L'0';
+                p[1] = L'.';
 
-    return mpdm_new(MPDM_TYPE_MBS, ptr, size);
-}
+                for (i = 2; i < 2 - kk; i++)
+                    p[i] = L'0';
+
+                p += n + 2 - kk;
+            }
+            else {
+                /* 1234e30 -> 1.234e+33 */
+                if (n > 1) {
+                    wmemmove(p + 2, p + 1, n - 1);
+                    p[1] = L'.';
+                    p += n + 1;
+                }
+                else
+                    p++;
 
+                kk--;
+                *p++ = L'e';
+                *p++ = kk < 0 ? L'-' : L'+';
 
-mpdm_t mpdm_new_i(int ival)
-/* creates a new string value from an integer */
-{
-    return MPDM_C(MPDM_TYPE_INTEGER, &ival, sizeof(ival));
-}
+                if (kk < 0)
+                    kk = -kk;
 
+                if (kk >= 100)
+                    *p++ = L'0' + kk / 100;
+                if (kk >= 10)
+                    *p++ = L'0' + kk / 10 % 10;
 
-mpdm_t mpdm_new_r(double rval)
-/* creates a new string value from a real number */
-{
-    return MPDM_C(MPDM_TYPE_REAL, &rval, sizeof(rval));
-}
+                *p++ = L'0' + kk % 10;
+            }
+
+            *p = L'\0';
+        }
+    }
 
+    return wcslen(buf);
+}
 
-/* interface */
 
 /**
  * mpdm_string - Returns a printable representation of a value.
@@ -292,7 +2093,8 @@ mpdm_t mpdm_new_r(double rval)
  * Returns a printable representation of a value. For strings, it's
  * the value data itself; for any other type, a conversion to string
  * is returned instead. This value should be used immediately, as it
- * can be a pointer to a static buffer.
+ * can be a pointer to a per-thread buffer that is reused after a
+ * few more calls.
  *
  * The reference count value in @v is not touched.
  * [Strings]
@@ -300,9 +2102,12 @@ mpdm_t mpdm_new_r(double rval)
 wchar_t *mpdm_string(const mpdm_t v)
 {
     char tmp[64];
-    wchar_t wstr[64] = L"";
+    wchar_t wstr[64];
     wchar_t *ret = NULL;
 
+    /* not initialized as a whole, as it's called very often */
+    wstr[0] = L'\0';
+
     mpdm_ref(v);
 
     switch (mpdm_type(v)) {
@@ -311,7 +2116,11 @@ wchar_t *mpdm_string(const mpdm_t v)
         break;
 
     case MPDM_TYPE_STRING:
-        ret = (wchar_t *) v->data;
+        if (v->flags & MPDM_F_REPR)
+            ret = flatten(v);
+        else
+            ret = (wchar_t *) v->data;
+
         break;
 
     case MPDM_TYPE_INTEGER:
@@ -320,29 +2129,7 @@ wchar_t *mpdm_string(const mpdm_t v)
         break;
 
     case MPDM_TYPE_REAL:
-        {
-            char *prev_locale = setlocale(LC_NUMERIC, "C");
-
-            sprintf(tmp, "%lf", mpdm_rval(v));
-
-            setlocale(LC_NUMERIC, prev_locale);
-
-            /* manually strip useless zeroes */
-            if (strchr(tmp, '.') != NULL) {
-                char *ptr;
-            
-                for (ptr = tmp + strlen(tmp) - 1; *ptr == '0'; ptr--);
-            
-                /* if it's over the ., strip it also */
-                if (*ptr != '.')
-                    ptr++;
-            
-                *ptr = '\0';
-            }
-
-            mbstowcs(wstr, tmp, sizeof(wstr));
-        }
-
+        real_wcs(mpdm_rval(v), wstr);
         break;
 
     default:
@@ -356,6 +2143,14 @@ wchar_t *mpdm_string(const mpdm_t v)
 
     if (ret == NULL) {
         if (wstr[0]) {
+#ifdef CONFOPT_TLS
+            /* use the next buffer in the ring */
+            ret = stringify_ring[stringify_next];
+            stringify_next = (stringify_next + 1) % STRINGIFY_RING;
+
+            wcsncpy(ret, wstr, STRINGIFY_SIZE - 1);
+            ret[STRINGIFY_SIZE - 1] = L'\0';
+#else /* CONFOPT_TLS */
             mpdm_t c, w;
 
             if ((c = mpdm_get_wcs(mpdm_root(), L"__STRINGIFY__")) == NULL)
@@ -367,6 +2162,7 @@ wchar_t *mpdm_string(const mpdm_t v)
             }
 
             ret = (wchar_t *) w->data;
+#endif /* CONFOPT_TLS */
         }
         else
             ret = L"[UNKNOWN]";
@@ -397,6 +2193,61 @@ int mpdm_cmp_wcs(const mpdm_t v1, const wchar_t *v2)
 }
 
 
+static int code_point_collation(void)
+/* returns true if the locale collates strings by code point */
+{
+    const char *l = setlocale(LC_COLLATE, NULL);
+
+    return l == NULL || strcmp(l, "C") == 0 || strcmp(l, "POSIX") == 0 ||
+        strncmp(l, "C.", 2) == 0;
+}
+
+
+/**
+ * mpdm_cmp_s - Compares two string values.
+ * @v1: the first value
+ * @v2: the second value
+ *
+ * Compares two string values like mpdm_cmp_wcs(). If both are
+ * stored in UTF-8 or in 1 byte characters, their bytes are compared
+ * directly without converting them (unless they are different and
+ * the current locale does not collate by code point).
+ * [Strings]
+ */
+int mpdm_cmp_s(const mpdm_t v1, const mpdm_t v2)
+/* do not use this; use mpdm_cmp() */
+{
+    int r = 0;
+    int c = 0;
+    const char *p1, *p2;
+    int s1, s2;
+
+    mpdm_ref(v1);
+    mpdm_ref(v2);
+
+    if ((p1 = mpdm_utf8(v1, &s1)) != NULL && (p2 = mpdm_utf8(v2, &s2)) != NULL) {
+        /* UTF-8 byte order is the code point one */
+        if ((r = memcmp(p1, p2, s1 < s2 ? s1 : s2)) == 0)
+            r = s1 - s2;
+
+        c = 1;
+    }
+    else
+    if (v1->flags & v2->flags & MPDM_F_LATIN1) {
+        r = strcmp((char *) v1->data, (char *) v2->data);
+        c = 1;
+    }
+
+    if (!c || (r != 0 && !code_point_collation()))
+        r = wcscoll(mpdm_string(v1), mpdm_string(v2));
+
+    mpdm_unref(v2);
+    mpdm_unref(v1);
+
+    return r;
+}
+
+
 /**
  * mpdm_splice_s - Creates a new string value from another.
  * @v: the original value
@@ -440,9 +2291,16 @@ mpdm_t mpdm_splice_s(const mpdm_t v, const mpdm_t i,
 
         if (d) {
             /* deleted string */
-            *d = MPDM_NS(str + offset, del);
+            *d = mpdm_type(v) == MPDM_TYPE_STRING ?
+                mpdm_new_slice(v, offset, del) : MPDM_NS(str + offset, del);
         }
 
+        if (n && mpdm_type(v) == MPDM_TYPE_STRING && mpdm_size(i) == 0 &&
+            (offset == 0 || offset + del == mpdm_size(v))) {
+            /* just deleting from one of the ends */
+            *n = mpdm_new_slice(v, offset ? 0 : del, mpdm_size(v) - del);
+        }
+        else
         if (n) {
             wchar_t *ptr = NULL;
             int s = 0;
@@ -481,6 +2339,10 @@ mpdm_t mpdm_strcat_wcsn(const mpdm_t s1, const wchar_t *s2, int size)
 {
     mpdm_t r = NULL;
 
+    if (mpdm_type(s1) == MPDM_TYPE_STRING && s2 != NULL &&
+        mpdm_size(s1) + size > ROPE_LEAF_SIZE)
+        r = mpdm_strcat(s1, MPDM_NS(s2, size));
+    else
     if (s1 != NULL || s2 != NULL) {
         wchar_t *ptr = NULL;
         int s = 0;
@@ -515,55 +2377,112 @@ mpdm_t mpdm_strcat_wcs(const mpdm_t s1, const wchar_t *s2)
  * @s2: the second string
  *
  * Returns a new string formed by the concatenation of @s1 and @s2.
+ * Long strings are not copied, but referenced from the new one
+ * (that is converted to a contiguous string the first time
+ * mpdm_string() is called on it), so building a big string
+ * by repeated concatenation takes linear time.
  * [Strings]
  */
 mpdm_t mpdm_strcat(const mpdm_t s1, const mpdm_t s2)
 {
     mpdm_t r;
 
+    mpdm_ref(s1);
     mpdm_ref(s2);
-    r = mpdm_strcat_wcs(s1, s2 ? mpdm_string(s2) : NULL);
+
+    if (mpdm_type(s1) == MPDM_TYPE_STRING && mpdm_type(s2) == MPDM_TYPE_STRING &&
+        mpdm_size(s1) + mpdm_size(s2) > ROPE_LEAF_SIZE)
+        r = rope_cat(s1, s2);
+    else
+        r = mpdm_strcat_wcs(s1, s2 ? mpdm_string(s2) : NULL);
+
     mpdm_unref(s2);
+    mpdm_unref(s1);
 
     return r;
 }
 
 
-int mpdm_ival_mbs(char *str)
-/* converts str to integer */
+static int num_space(wchar_t c)
+/* returns true if c is a space in the C locale */
 {
-    int i = 0;
-    char *fmt = "%i";
+    return c == L' ' || (c >= L'\t' && c <= L'\r');
+}
+
+
+static int num_digit(wchar_t c)
+/* returns the value of c as a digit (up to base 36), or 99 */
+{
+    int d = 99;
 
-    /* workaround for mingw32: as it doesn't
-       correctly parse octal and hexadecimal
-       numbers, they are tried as special cases */
-    if (str[0] == '0') {
-        if (str[1] == 'b' || str[1] == 'B') {
-            /* binary number */
-            fmt = NULL;
-            char *ptr = &str[2];
+    if (c >= L'0' && c <= L'9')
+        d = c - L'0';
+    else
+    if (c >= L'a' && c <= L'z')
+        d = c - L'a' + 10;
+    else
+    if (c >= L'A' && c <= L'Z')
+        d = c - L'A' + 10;
+
+    return d;
+}
 
-            while (*ptr == '0' || *ptr == '1') {
-                i <<= 1;
 
-                if (*ptr == '1')
-                    i |= 1;
+int mpdm_ival_wcs(const wchar_t *str)
+/* converts str to integer (decimal, or hexadecimal, octal or
+   binary if prefixed by 0x, 0 or 0b) */
+{
+    unsigned int i = 0;
+    int base = 10;
+    int neg = 0;
+    int d;
+
+    if (str[0] == L'0' && (str[1] == L'b' || str[1] == L'B')) {
+        /* binary number */
+        for (str += 2; *str == L'0' || *str == L'1'; str++)
+            i = (i << 1) | (*str - L'0');
+    }
+    else {
+        while (num_space(*str))
+            str++;
+
+        if (*str == L'-' || *str == L'+')
+            neg = *str++ == L'-';
 
-                ptr++;
+        if (str[0] == L'0') {
+            if ((str[1] == L'x' || str[1] == L'X') && num_digit(str[2]) < 16) {
+                base = 16;
+                str += 2;
             }
+            else
+                base = 8;
         }
-        else
-        if (str[1] == 'x' || str[1] == 'X')
-            fmt = "%x";
-        else
-            fmt = "%o";
+
+        /* out of range values just wrap around */
+        for (; (d = num_digit(*str)) < base; str++)
+            i = i * base + d;
+
+        if (neg)
+            i = -i;
     }
 
-    if (fmt != NULL)
-        sscanf(str, fmt, &i);
+    return (int) i;
+}
 
-    return i;
+
+int mpdm_ival_mbs(char *str)
+/* converts str to integer */
+{
+    wchar_t tmp[NUM_TMP_SIZE];
+    int n;
+
+    /* numbers are ASCII */
+    for (n = 0; n < NUM_TMP_SIZE - 1 && str[n] != '\0'; n++)
+        tmp[n] = (unsigned char) str[n];
+
+    tmp[n] = L'\0';
+
+    return mpdm_ival_wcs(tmp);
 }
 
 
@@ -586,7 +2505,7 @@ int mpdm_ival(mpdm_t v)
         break;
 
     case MPDM_TYPE_INTEGER:
-        i = *((int *)v->data);
+        i = v->ival;
         break;
 
     case MPDM_TYPE_REAL:
@@ -594,11 +2513,15 @@ int mpdm_ival(mpdm_t v)
         break;
 
     case MPDM_TYPE_STRING:
-        {
-            char *mbs = mpdm_wcstombs(mpdm_string(v), NULL);
-            i = mpdm_ival_mbs(mbs);
-            free(mbs);
+        if (mpdm_size(v) < NUM_TMP_SIZE) {
+            /* short strings are not converted to wide chars */
+            wchar_t tmp[NUM_TMP_SIZE];
+
+            tmp[mpdm_string_n(v, 0, tmp, NUM_TMP_SIZE - 1)] = L'\0';
+            i = mpdm_ival_wcs(tmp);
         }
+        else
+            i = mpdm_ival_wcs(mpdm_string(v));
 
         break;
 
@@ -617,25 +2540,141 @@ int mpdm_ival(mpdm_t v)
 }
 
 
-double mpdm_rval_mbs(char *str)
+static double rval_libc(const wchar_t *str)
+/* converts str to a real number with strtod(), replacing
+   the decimal point with the one of the current locale */
 {
-    double r = 0.0;
-    char *prev_locale;
+    char tmp[512];
+    const char *dp = localeconv()->decimal_point;
+    int n = 0;
+
+    for (; *str > 0 && *str < 0x80 && n < (int) sizeof(tmp) - 8; str++) {
+        if (*str == L'.') {
+            int i;
+
+            for (i = 0; dp[i] && i < 4; i++)
+                tmp[n++] = dp[i];
+        }
+        else
+        if (*str == (unsigned char) dp[0])
+            break;
+        else
+            tmp[n++] = *str;
+    }
+
+    tmp[n] = '\0';
+
+    return strtod(tmp, NULL);
+}
+
+
+double mpdm_rval_wcs(const wchar_t *str)
+/* converts str to a real number, whatever the locale is */
+{
+    const wchar_t *p = str;
+    uint64_t m = 0;     /* significant digits */
+    int d = 0;          /* number of them */
+    int e = 0;          /* decimal exponent */
+    int c = 0;          /* number of read digits */
+    int x = 0;          /* non-zero digits were dropped */
+    int neg = 0;
+    double r;
+
+    while (num_space(*p))
+        p++;
+
+    if (*p == L'-' || *p == L'+')
+        neg = *p++ == L'-';
+
+    /* hexadecimal numbers are left to the library */
+    if (p[0] == L'0' && (p[1] == L'x' || p[1] == L'X'))
+        p += wcslen(p);
+
+    /* up to 19 digits fit in m; the rest are dropped */
+    for (; *p >= L'0' && *p <= L'9'; p++, c++) {
+        if (d < 19) {
+            m = m * 10 + (*p - L'0');
+            d += m != 0;
+        }
+        else {
+            x |= *p != L'0';
+            e++;
+        }
+    }
+
+    if (*p == L'.') {
+        for (p++; *p >= L'0' && *p <= L'9'; p++, c++) {
+            if (d < 19) {
+                m = m * 10 + (*p - L'0');
+                d += m != 0;
+                e--;
+            }
+            else
+                x |= *p != L'0';
+        }
+    }
+
+    if (c && (*p == L'e' || *p == L'E')) {
+        const wchar_t *q = p + 1;
+        int ee = 0;
+        int en = 0;
 
-    /* set locale to C for non locale-dependent
-       floating point conversion */
-    prev_locale = setlocale(LC_NUMERIC, "C");
+        if (*q == L'-' || *q == L'+')
+            en = *q++ == L'-';
 
-    /* read */
-    sscanf(str, "%lf", &r);
+        if (*q >= L'0' && *q <= L'9') {
+            for (; *q >= L'0' && *q <= L'9'; q++) {
+                if (ee < 100000)
+                    ee = ee * 10 + (*q - L'0');
+            }
+
+            e += en ? -ee : ee;
+        }
+    }
+
+#if FLT_EVAL_METHOD == 0
+    /* big exponents can still be exact if m has room for them */
+    while (e > 22 && e <= 22 + 15 && m <= (1ULL << 53) / 10) {
+        m *= 10;
+        e--;
+    }
+
+    /* Clinger's fast path: when the significant digits and the
+       power of ten are both exact doubles, one operation (and so,
+       one rounding) gives the correctly rounded result */
+    if (c && !x && m <= (1ULL << 53) && e >= -22 && e <= 22) {
+        if (e >= 0)
+            r = (double) m * exact_pow10[e];
+        else
+            r = (double) m / exact_pow10[-e];
 
-    /* set previous locale */
-    setlocale(LC_NUMERIC, prev_locale);
+        if (neg)
+            r = -r;
+    }
+    else
+#endif
+        /* hard cases (and hexadecimal, infinities and nans) */
+        r = rval_libc(str);
 
     return r;
 }
 
 
+double mpdm_rval_mbs(char *str)
+{
+    wchar_t tmp[NUM_TMP_SIZE];
+    int n;
+
+    /* numbers are ASCII */
+    for (n = 0; n < NUM_TMP_SIZE - 1 && str[n] != '\0'; n++)
+        tmp[n] = (unsigned char) str[n];
+
+    tmp[n] = L'\0';
+
+    return mpdm_rval_wcs(tmp);
+}
+
+
 /**
  * mpdm_rval - Returns a value's data as a real number (double).
  * @v: the value
@@ -655,7 +2694,7 @@ double mpdm_rval(mpdm_t v)
         break;
 
     case MPDM_TYPE_REAL:
-        r = *((double *)v->data);
+        r = v->rval;
         break;
 
     case MPDM_TYPE_INTEGER:
@@ -663,12 +2702,15 @@ double mpdm_rval(mpdm_t v)
         break;
 
     case MPDM_TYPE_STRING:
-        {
-            /* otherwise, calculate it */
-            char *mbs = mpdm_wcstombs(mpdm_string(v), NULL);
-            r = mpdm_rval_mbs(mbs);
-            free(mbs);
+        if (mpdm_size(v) < NUM_TMP_SIZE) {
+            /* short strings are not converted to wide chars */
+            wchar_t tmp[NUM_TMP_SIZE];
+
+            tmp[mpdm_string_n(v, 0, tmp, NUM_TMP_SIZE - 1)] = L'\0';
+            r = mpdm_rval_wcs(tmp);
         }
+        else
+            r = mpdm_rval_wcs(mpdm_string(v));
 
         break;
 
@@ -721,7 +2763,7 @@ mpdm_t mpdm_gettext(const mpdm_t str)
             mpdm_t t;
 
             /* convert to mbs */
-            t = mpdm_ref(MPDM_2MBS(str->data));
+            t = mpdm_ref(MPDM_2MBS(mpdm_string(str)));
 
             /* ask gettext for it */
             s = gettext((char *) t->data);
@@ -776,8 +2818,8 @@ int mpdm_gettext_domain(const mpdm_t dom, const mpdm_t data)
     mpdm_t dt;
 
     /* convert both to mbs,s */
-    dm = mpdm_ref(MPDM_2MBS(dom->data));
-    dt = mpdm_ref(MPDM_2MBS(data->data));
+    dm = mpdm_ref(MPDM_2MBS(mpdm_string(dom)));
+    dt = mpdm_ref(MPDM_2MBS(mpdm_string(data)));
 
     /* bind and set domain */
     bindtextdomain((char *) dm->data, (char *) dt->data);
@@ -857,38 +2899,36 @@ static wchar_t *s_mbstowcs(char *mbs, wchar_t *wcs)
 }
 
 
-static wchar_t *json_s(wchar_t *o, int *l, mpdm_t v)
+static void json_s(struct mpdm_sb *o, mpdm_t v)
 {
     wchar_t *p = mpdm_string(v);
 
     while (*p) {
         if (*p == L'\n')
-            o = mpdm_pokews(o, l, L"\\n");
+            mpdm_sb_add_wcs(o, L"\\n");
         else
         if (*p == L'\\')
-            o = mpdm_pokews(o, l, L"\\\\");
+            mpdm_sb_add_wcs(o, L"\\\\");
         else
         if (*p == L'"')
-            o = mpdm_pokews(o, l, L"\\\"");
+            mpdm_sb_add_wcs(o, L"\\\"");
         else
         if (*p < 32) {
             char tmp[7];
             wchar_t wtmp[7];
 
             sprintf(tmp, "\\u%04x", (unsigned int) *p);
-            o = mpdm_pokews(o, l, s_mbstowcs(tmp, wtmp));
+            mpdm_sb_add_wcs(o, s_mbstowcs(tmp, wtmp));
         }
         else
-            o = mpdm_pokewsn(o, l, p, 1);
+            mpdm_sb_add_wc(o, *p);
 
         p++;
     }
-
-    return o;
 }
 
 
-static wchar_t *json_f(wchar_t *o, int *z, mpdm_t v, int l)
+static void json_f(struct mpdm_sb *o, mpdm_t v, int l)
 /* fills a %j JSON format */
 {
     mpdm_t w, i;
@@ -896,88 +2936,87 @@ static wchar_t *json_f(wchar_t *o, int *z, mpdm_t v, int l)
 
     /* special test: upper level can only be array or object */
     if (!l && mpdm_type(v) != MPDM_TYPE_ARRAY && mpdm_type(v) != MPDM_TYPE_OBJECT)
-        goto end;
+        return;
 
     switch (mpdm_type(v)) {
     case MPDM_TYPE_NULL:
-        o = mpdm_pokews(o, z, L"null");
+        mpdm_sb_add_wcs(o, L"null");
         break;
 
     case MPDM_TYPE_OBJECT:
-        o = mpdm_pokews(o, z, L"{");
+        mpdm_sb_add_wcs(o, L"{");
 
         while (mpdm_iterator(v, &n, &w, &i)) {
             if (c)
-                o = mpdm_pokews(o, z, L",");
+                mpdm_sb_add_wcs(o, L",");
 
-            o = mpdm_pokews(o, z, L"\"");
-            o = json_s(o, z, i);
-            o = mpdm_pokews(o, z, L"\":");
+            mpdm_sb_add_wcs(o, L"\"");
+            json_s(o, i);
+            mpdm_sb_add_wcs(o, L"\":");
 
-            o = json_f(o, z, w, l + 1);
+            json_f(o, w, l + 1);
 
             c++;
         }
 
-        o = mpdm_pokews(o, z, L"}");
+        mpdm_sb_add_wcs(o, L"}");
 
         break;
 
     case MPDM_TYPE_ARRAY:
-        o = mpdm_pokews(o, z, L"[");
+        mpdm_sb_add_wcs(o, L"[");
 
         while (mpdm_iterator(v, &n, &w, NULL)) {
             if (c)
-                o = mpdm_pokews(o, z, L",");
+                mpdm_sb_add_wcs(o, L",");
 
-            o = json_f(o, z, w, l + 1);
+            json_f(o, w, l + 1);
 
             c++;
         }
 
-        o = mpdm_pokews(o, z, L"]");
+        mpdm_sb_add_wcs(o, L"]");
 
         break;
 
     case MPDM_TYPE_INTEGER:
     case MPDM_TYPE_REAL:
-        o = mpdm_pokev(o, z, v);
+        mpdm_sb_add_v(o, v);
         break;
 
     case MPDM_TYPE_STRING:
-        o = mpdm_pokews(o, z, L"\"");
-        o = json_s(o, z, v);
-        o = mpdm_pokews(o, z, L"\"");
+        mpdm_sb_add_wcs(o, L"\"");
+        json_s(o, v);
+        mpdm_sb_add_wcs(o, L"\"");
 
         break;
 
     default:
-        o = mpdm_pokews(o, z, L"\"");
-        o = mpdm_pokev(o, z, v);
-        o = mpdm_pokews(o, z, L"\"");
+        mpdm_sb_add_wcs(o, L"\"");
+        mpdm_sb_add_v(o, v);
+        mpdm_sb_add_wcs(o, L"\"");
         break;
     }
-
-end:
-    return o;
 }
 
 
 mpdm_t mpdm_fmt(const mpdm_t fmt, const mpdm_t arg)
 {
-    const wchar_t *i = fmt->data;
-    wchar_t c, *o = NULL;
-    int l = 0;
+    const wchar_t *i = mpdm_string(fmt);
+    wchar_t c;
+    struct mpdm_sb o;
     int n = 0;
 
     mpdm_ref(fmt);
     mpdm_ref(arg);
 
+    mpdm_sb_init(&o);
+
     /* find first mark */
     while ((c = i[n]) != L'\0' && c != L'%')
         n++;
 
-    o = mpdm_pokewsn(o, &l, i, n);
+    mpdm_sb_add_wcsn(&o, i, n);
     i = &i[n];
 
     /* format directive */
@@ -1029,10 +3068,17 @@ mpdm_t mpdm_fmt(const mpdm_t fmt, const mpdm_t arg)
         case 's':
 
             /* string value */
-            ptr = mpdm_wcstombs(mpdm_string(arg), NULL);
-            snprintf(tmp, sizeof(tmp) - 1, t_fmt, ptr);
-            free(ptr);
-            wptr = mpdm_mbstowcs(tmp, &m, -1);
+            if (m == 2 && arg != NULL) {
+                /* no width nor precision: add as is */
+                mpdm_sb_add_v(&o, arg);
+            }
+            else {
+                ptr = mpdm_wcstombs(mpdm_string(arg), NULL);
+                snprintf(tmp, sizeof(tmp) - 1, t_fmt, ptr);
+                free(ptr);
+                wptr = mpdm_mbstowcs(tmp, &m, -1);
+            }
+
             break;
 
         case 'b':
@@ -1074,12 +3120,12 @@ mpdm_t mpdm_fmt(const mpdm_t fmt, const mpdm_t arg)
             break;
 
         case 'j':
-            o = json_f(o, &l, arg, 0);
+            json_f(&o, arg, 0);
             break;
 
         case 'J':
             /* 'lax' JSON: can be literal */
-            o = json_f(o, &l, arg, 1);
+            json_f(&o, arg, 1);
             break;
 
         case 't':
@@ -1112,13 +3158,13 @@ mpdm_t mpdm_fmt(const mpdm_t fmt, const mpdm_t arg)
         case '%':
 
             /* percent sign */
-            o = mpdm_pokewsn(o, &l, &c, 1);
+            mpdm_sb_add_wc(&o, c);
             break;
         }
 
         /* transfer */
         if (wptr != NULL) {
-            o = mpdm_pokewsn(o, &l, wptr, m);
+            mpdm_sb_add_wcsn(&o, wptr, m);
             free(wptr);
         }
     }
@@ -1128,12 +3174,12 @@ mpdm_t mpdm_fmt(const mpdm_t fmt, const mpdm_t arg)
     while (i[n] != L'\0')
         n++;
 
-    o = mpdm_pokewsn(o, &l, i, n);
+    mpdm_sb_add_wcsn(&o, i, n);
 
     mpdm_unref(arg);
     mpdm_unref(fmt);
 
-    return o ? MPDM_ENS(o, l) : MPDM_S(L"");
+    return mpdm_sb_finish(&o);
 }
 
 
@@ -1285,24 +3331,31 @@ static mpdm_t json_lexer(wchar_t **sp, int *t)
     }
     else
     if (c == L'-' || (c >= L'0' && c <= L'9') || c == L'.') {
-        *t = JS_INTEGER;
+        wchar_t *n = s - 1;
 
-        ptr = mpdm_pokewsn(ptr, &size, &c, 1);
+        *t = JS_INTEGER;
 
         while (((c = *s) >= L'0' && c <= L'9') || c == L'.') {
             if (c == L'.')
                 *t = JS_REAL;
 
-            ptr = mpdm_pokewsn(ptr, &size, &c, 1);
             s++;
         }
 
-        v = MPDM_ENS(ptr, size);
+        /* exponent */
+        if ((c == L'e' || c == L'E') &&
+            ((s[1] >= L'0' && s[1] <= L'9') ||
+             ((s[1] == L'-' || s[1] == L'+') && s[2] >= L'0' && s[2] <= L'9'))) {
+            *t = JS_REAL;
+
+            for (s += 2; *s >= L'0' && *s <= L'9'; s++);
+        }
 
+        /* the number is converted from where it is */
         if (*t == JS_REAL)
-            v = MPDM_R(mpdm_rval(v));
+            v = MPDM_R(mpdm_rval_wcs(n));
         else
-            v = MPDM_I(mpdm_ival(v));
+            v = MPDM_I(mpdm_ival_wcs(n));
     }
     else
     if (c == 't' && wcsncmp(s, L"rue", 3) == 0) {
@@ -1399,7 +3452,7 @@ static mpdm_t json_parse_object(wchar_t **s, int *t)
         w = json_pair(s, &tt, k);
 
         if (tt == JS_VALUE) {
-            mpdm_set(h, w, k);
+            mpdm_set(h, w, mpdm_intern(k));
 
             while (*t == JS_INCOMPLETE) {
                 k = json_lexer(s, &tt);
@@ -1412,7 +3465,7 @@ static mpdm_t json_parse_object(wchar_t **s, int *t)
                     w = json_pair(s, &tt, k);
 
                     if (tt == JS_VALUE)
-                        mpdm_set(h, w, k);
+                        mpdm_set(h, w, mpdm_intern(k));
                     else
                         *t = JS_ERROR;
                 }
@@ -1876,15 +3929,15 @@ mpdm_t mpdm_escape(mpdm_t v, wchar_t low, wchar_t high, mpdm_t f)
  * value.
  */
 {
-    wchar_t *iptr, *optr;
-    int z = 0;
+    wchar_t *iptr;
+    struct mpdm_sb o;
     int n = 0;
 
     mpdm_ref(v);
     mpdm_ref(f);
 
     iptr = mpdm_string(v);
-    optr = NULL;
+    mpdm_sb_init(&o);
 
     while (iptr[n]) {
         int m;
@@ -1893,7 +3946,7 @@ mpdm_t mpdm_escape(mpdm_t v, wchar_t low, wchar_t high, mpdm_t f)
         for (m = n; iptr[m] && iptr[m] >= low && iptr[m] <= high; m++);
 
         /* copy them */
-        optr = mpdm_pokewsn(optr, &z, &iptr[n], m - n);
+        mpdm_sb_add_wcsn(&o, &iptr[n], m - n);
 
         /* now apply format to all characters outside the range */
         while (iptr[m] && (iptr[m] < low || iptr[m] > high)) {
@@ -1903,7 +3956,7 @@ mpdm_t mpdm_escape(mpdm_t v, wchar_t low, wchar_t high, mpdm_t f)
             switch (mpdm_type(f)) {
             case MPDM_TYPE_STRING:
                 w = mpdm_fmt(f, MPDM_I((int) wc));
-                optr = mpdm_pokev(optr, &z, w);
+                mpdm_sb_add_v(&o, w);
                 break;
 
             default:
@@ -1919,5 +3972,5 @@ mpdm_t mpdm_escape(mpdm_t v, wchar_t low, wchar_t high, mpdm_t f)
     mpdm_unref(f);
     mpdm_unref(v);
 
-    return optr ? MPDM_NS(optr, z) : MPDM_S(L"");
+    return mpdm_sb_finish(&o);
 }
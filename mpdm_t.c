@@ -349,6 +349,8 @@ static void thread_caller(mpdm_t a)
 
     /* was referenced in mpdm_exec_thread() */
     mpdm_unref(a);
+
+    mpdm_thread_exit();
 }
 
 
@@ -399,6 +401,9 @@ mpdm_t mpdm_exec_thread(mpdm_t c, mpdm_t args, mpdm_t ctxt)
     mpdm_set_i(a, args, 1);
     mpdm_set_i(a, ctxt, 2);
 
+    /* everything sent to the thread is shared with it */
+    mpdm_share(a);
+
 #ifdef CONFOPT_WIN32
     HANDLE t;
 
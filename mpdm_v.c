@@ -30,7 +30,7 @@ struct {
     mpdm_func1_t *destroy;
 } mpdm_type_info[] = {
     { L"null",      mpdm_dummy__destroy },
-    { L"string",    mpdm_dummy__destroy },
+    { L"string",    mpdm_string__destroy },
     { L"array",     mpdm_array__destroy },
     { L"object",    mpdm_object__destroy },
     { L"file",      mpdm_file__destroy },
@@ -41,35 +41,325 @@ struct {
     { L"thread",    mpdm_thread__destroy },
     { L"function",  mpdm_function__destroy },
     { L"program",   mpdm_program__destroy },
-    { L"integer",   mpdm_dummy__destroy },
-    { L"real",      mpdm_dummy__destroy }
+    { L"integer",   mpdm_number__destroy },
+    { L"real",      mpdm_number__destroy },
+    { L"bytes",     mpdm_dummy__destroy }
 };
 
 /* pointer to the destroy function */
 mpdm_func1_t *mpdm_destroy = NULL;
 
+/* value headers are carved from chunks in size classes that are
+   multiples of the header size, and recycled through per-thread
+   free lists; debug builds use plain malloc() to help valgrind */
+#if defined(CONFOPT_TLS) && defined(CONFOPT_ATOMICS) && !defined(CONFOPT_DEBUG)
+#define MPDM_SLAB 1
+#endif
+
+#ifdef MPDM_SLAB
+
+#define SLAB_UNIT       sizeof(struct mpdm_val)
+#define SLAB_CLASSES    4
+#define SLAB_CHUNK      16384
+
+/* free lists, by size class (0 is unused), and chunks of this thread */
+static __thread void *slab_free[SLAB_CLASSES + 1];
+static __thread void *slab_chunks = NULL;
+
+/* free lists and chunks handed back by finished threads */
+static void *slab_free_global[SLAB_CLASSES + 1];
+static void *slab_chunks_global = NULL;
+static char slab_lock = 0;
+
+#endif /* MPDM_SLAB */
+
+/* the destroy work list and the cycle collector
+   keep per-thread stacks, so they need thread-local storage */
+#ifdef CONFOPT_TLS
+#define MPDM_WORK_LIST 1
+#define MPDM_GC 1
+
+/* a growable stack of values */
+struct val_stack {
+    mpdm_t *v;
+    int n;
+    int size;
+};
+
+#endif /* CONFOPT_TLS */
+
+#ifdef MPDM_WORK_LIST
+
+/* values pending destruction */
+static __thread struct val_stack destroy_list;
+static __thread int destroying = 0;
+
+/* number of values destroyed at once (0, unlimited) */
+static int destroy_budget = 0;
+
+#endif /* MPDM_WORK_LIST */
+
+#ifdef MPDM_GC
+
+/* number of candidates that trigger a collection (0, disabled) */
+static int gc_threshold = 0;
+
+/* candidate roots, work stacks and statistics */
+static __thread struct val_stack gc_roots;
+static __thread struct val_stack gc_work;
+static __thread struct val_stack gc_white;
+static __thread struct val_stack gc_black;
+static __thread int gc_running = 0;
+static __thread int gc_collections = 0;
+static __thread int gc_collected = 0;
+static __thread double gc_time = 0.0;
+
+#define GC_COLOR(v)     ((v)->flags & MPDM_F_COLOR)
+#define GC_PAINT(v, c)  ((v)->flags = ((v)->flags & ~MPDM_F_COLOR) | (c))
+
+#endif /* MPDM_GC */
+
 
 /** code **/
 
+#ifdef CONFOPT_TLS
+
+static void val_push(struct val_stack *s, mpdm_t v)
+/* pushes a value into a stack */
+{
+    if (s->n == s->size) {
+        s->size = s->size ? s->size * 2 : 64;
+        s->v = realloc(s->v, s->size * sizeof(mpdm_t));
+    }
+
+    s->v[s->n++] = v;
+}
+
+
+static void val_stack_free(struct val_stack *s)
+/* frees the memory of a stack */
+{
+    free(s->v);
+    s->v = NULL;
+    s->n = s->size = 0;
+}
+
+#endif /* CONFOPT_TLS */
+
+#ifdef MPDM_WORK_LIST
+static void destroy_pending(int budget);
+#endif
+
+#ifdef MPDM_SLAB
+
+static void slab_acquire(void)
+/* locks the global slab lists */
+{
+    while (__atomic_test_and_set(&slab_lock, __ATOMIC_ACQUIRE));
+}
+
+
+static void slab_release(void)
+/* unlocks the global slab lists */
+{
+    __atomic_clear(&slab_lock, __ATOMIC_RELEASE);
+}
+
+
+static void *slab_refill(int c)
+/* refills the free list of class c, returning a block */
+{
+    int bsize = c * SLAB_UNIT;
+    int n = (SLAB_CHUNK - SLAB_UNIT) / bsize;
+    char *chunk, *ptr;
+
+    /* take the blocks handed back by finished threads first */
+    slab_acquire();
+    ptr = slab_free_global[c];
+    slab_free_global[c] = NULL;
+    slab_release();
+
+    if (ptr != NULL)
+        slab_free[c] = *((void **)ptr);
+    else
+    if ((chunk = malloc(SLAB_CHUNK)) != NULL) {
+        /* a new chunk, whose first unit links it to the rest */
+        *((void **)chunk) = slab_chunks;
+        slab_chunks = chunk;
+        chunk += SLAB_UNIT;
+
+        /* link all blocks but the first one, that is returned */
+        for (ptr = chunk + bsize; n > 2; n--, ptr += bsize)
+            *((void **)ptr) = ptr + bsize;
+
+        *((void **)ptr) = slab_free[c];
+        slab_free[c] = chunk + bsize;
+
+        ptr = chunk;
+    }
+
+    return ptr;
+}
+
+
+static void slab_handback(void)
+/* moves the free blocks and chunks of this thread to the global lists */
+{
+    int c;
+
+    slab_acquire();
+
+    for (c = 1; c <= SLAB_CLASSES; c++) {
+        void *p = slab_free[c];
+
+        if (p != NULL) {
+            /* prepend the full list */
+            while (*((void **)p) != NULL)
+                p = *((void **)p);
+
+            *((void **)p) = slab_free_global[c];
+            slab_free_global[c] = slab_free[c];
+            slab_free[c] = NULL;
+        }
+    }
+
+    while (slab_chunks != NULL) {
+        void *p = slab_chunks;
+
+        slab_chunks = *((void **)p);
+        *((void **)p) = slab_chunks_global;
+        slab_chunks_global = p;
+    }
+
+    slab_release();
+}
+
+#endif /* MPDM_SLAB */
+
+
+static mpdm_t val_alloc(int size)
+/* allocates a zeroed value of size bytes */
+{
+    mpdm_t v;
+#ifdef MPDM_SLAB
+    int c;
+#endif
+
+#ifdef MPDM_WORK_LIST
+    /* spread the destruction of big trees along allocations */
+    if (destroy_list.n && !destroying)
+        destroy_pending(destroy_budget);
+#endif
+
+#ifdef MPDM_SLAB
+    c = (size + SLAB_UNIT - 1) / SLAB_UNIT;
+
+    if (c <= SLAB_CLASSES) {
+        if ((v = slab_free[c]) != NULL)
+            slab_free[c] = *((void **)v);
+        else
+            v = slab_refill(c);
+
+        memset(v, '\0', c * SLAB_UNIT);
+        v->flags = c;
+    }
+    else
+#endif /* MPDM_SLAB */
+
+        v = (mpdm_t) calloc(size, 1);
+
+    return v;
+}
+
+
+static void val_free(mpdm_t v)
+/* frees a value allocated by val_alloc() */
+{
+#ifdef MPDM_SLAB
+    int c = v->flags & MPDM_F_CLASS;
+
+    if (c) {
+        *((void **)v) = slab_free[c];
+        slab_free[c] = v;
+    }
+    else
+#endif /* MPDM_SLAB */
+
+    {
+#ifdef CONFOPT_DEBUG
+        /* garble the memory block */
+        memset(v, 0xaa, sizeof(*v));
+#endif
+
+        free(v);
+    }
+}
+
+
 mpdm_t mpdm_dummy__destroy(mpdm_t v)
 {
     return v;
 }
 
 
-mpdm_t mpdm_real_destroy(mpdm_t v)
-/* destroys a value */
+static void destroy_1(mpdm_t v)
+/* destroys one value */
 {
     /* destroy type */
     v = mpdm_type_info[mpdm_type(v)].destroy(v);
 
-    /* free data */
-    free((void *)v->data);
+    /* free data, unless it's stored after the value itself */
+    if (!(v->flags & MPDM_F_INLINE))
+        free((void *)v->data);
+
+    /* values in the cycle collector buffer keep
+       their header until the next collection */
+    if (v->flags & MPDM_F_BUFFERED)
+        v->flags |= MPDM_F_DEAD;
+    else
+        val_free(v);
+}
+
+
+#ifdef MPDM_WORK_LIST
+
+static void destroy_pending(int budget)
+/* destroys up to budget pending values (0, all) */
+{
+    destroying = 1;
+
+    while (destroy_list.n) {
+        destroy_1(destroy_list.v[--destroy_list.n]);
+
+        if (budget && --budget == 0)
+            break;
+    }
+
+    destroying = 0;
+}
+
+#endif /* MPDM_WORK_LIST */
 
-    /* garble the memory block */
-    memset(v, 0xaa, sizeof(*v));
 
-    free(v);
+mpdm_t mpdm_real_destroy(mpdm_t v)
+/* destroys a value */
+{
+#ifdef MPDM_WORK_LIST
+    /* values unreferenced while destroying others are
+       queued in the work list instead of recursing */
+    if (destroying)
+        val_push(&destroy_list, v);
+    else {
+        destroying = 1;
+        destroy_1(v);
+        destroying = 0;
+
+        if (destroy_list.n)
+            destroy_pending(destroy_budget);
+    }
+#else
+    destroy_1(v);
+#endif
 
     return NULL;
 }
@@ -94,7 +384,7 @@ mpdm_t mpdm_new(mpdm_type_t type, const void *data, int size)
 {
     mpdm_t v;
 
-    v = (mpdm_t) calloc(sizeof(*v), 1);
+    v = val_alloc(sizeof(*v));
 
     v->type     = type;
     v->ref      = 0;
@@ -105,6 +395,34 @@ mpdm_t mpdm_new(mpdm_type_t type, const void *data, int size)
 }
 
 
+/**
+ * mpdm_new_inline - Creates a new value with inline storage.
+ * @type: data type
+ * @bytes: number of bytes of storage
+ * @size: size of data
+ *
+ * Creates a new value of @type with @bytes of zeroed storage
+ * allocated in the same block as the value itself (where its data
+ * pointer will point to). @size is stored as the value size. Inline
+ * storage is freed with the value and must not be reallocated.
+ * [Value Creation]
+ */
+mpdm_t mpdm_new_inline(mpdm_type_t type, int bytes, int size)
+{
+    mpdm_t v;
+
+    v = val_alloc(sizeof(*v) + bytes);
+
+    v->type     = type;
+    v->ref      = 0;
+    v->data     = v + 1;
+    v->size     = size;
+    v->flags    |= MPDM_F_INLINE;
+
+    return v;
+}
+
+
 mpdm_type_t mpdm_type(mpdm_t v)
 {
     return v ? v->type : MPDM_TYPE_NULL;
@@ -117,6 +435,65 @@ wchar_t *mpdm_type_wcs(mpdm_t v)
 }
 
 
+#ifdef MPDM_GC
+
+int mpdm_iterator_o(mpdm_t set, int *context, mpdm_t *v, mpdm_t *i);
+
+
+static int gc_traced(mpdm_t v)
+/* returns true if a value is traced by the cycle collector */
+{
+    /* shared values are never traced, as their reference
+       counts can be changed by other threads, and they
+       cannot contain non-shared values */
+    return v != NULL && !(v->flags & (MPDM_F_SHARED | MPDM_F_DEAD)) &&
+        (v->type == MPDM_TYPE_ARRAY || v->type == MPDM_TYPE_OBJECT ||
+         v->type == MPDM_TYPE_PROGRAM);
+}
+
+
+static void gc_children(mpdm_t v, struct val_stack *s)
+/* pushes the traced children of a container, one per reference */
+{
+    int n = 0;
+
+    if (v->type == MPDM_TYPE_OBJECT) {
+        mpdm_t e, i;
+
+        while (mpdm_iterator_o(v, &n, &e, &i)) {
+            if (gc_traced(i))
+                val_push(s, i);
+            if (gc_traced(e))
+                val_push(s, e);
+        }
+    }
+    else {
+        mpdm_t *d = (mpdm_t *) v->data;
+
+        for (n = 0; n < v->size; n++) {
+            if (gc_traced(d[n]))
+                val_push(s, d[n]);
+        }
+    }
+}
+
+
+static void gc_candidate(mpdm_t v)
+/* buffers a container whose reference count was decremented */
+{
+    if (!gc_running && gc_traced(v)) {
+        GC_PAINT(v, MPDM_F_PURPLE);
+
+        if (!(v->flags & MPDM_F_BUFFERED)) {
+            v->flags |= MPDM_F_BUFFERED;
+            val_push(&gc_roots, v);
+        }
+    }
+}
+
+#endif /* MPDM_GC */
+
+
 /**
  * mpdm_ref - Increments the reference count of a value.
  * @v: the value
@@ -126,8 +503,14 @@ wchar_t *mpdm_type_wcs(mpdm_t v)
  */
 mpdm_t mpdm_ref(mpdm_t v)
 {
-    if (v != NULL)
-        v->ref++;
+    if (v != NULL) {
+#ifdef CONFOPT_ATOMICS
+        if (v->flags & MPDM_F_SHARED)
+            __atomic_add_fetch(&v->ref, 1, __ATOMIC_RELAXED);
+        else
+#endif
+            v->ref++;
+    }
 
     return v;
 }
@@ -143,8 +526,22 @@ mpdm_t mpdm_ref(mpdm_t v)
  */
 mpdm_t mpdm_unref(mpdm_t v)
 {
-    if (v != NULL && --v->ref <= 0)
-        v = mpdm_destroy(v);
+    if (v != NULL) {
+#ifdef CONFOPT_ATOMICS
+        if (v->flags & MPDM_F_SHARED) {
+            if (__atomic_sub_fetch(&v->ref, 1, __ATOMIC_ACQ_REL) <= 0)
+                v = mpdm_destroy(v);
+        }
+        else
+#endif
+        if (--v->ref <= 0)
+            v = mpdm_destroy(v);
+#ifdef MPDM_GC
+        else
+        if (gc_threshold)
+            gc_candidate(v);
+#endif
+    }
 
     return v;
 }
@@ -160,13 +557,397 @@ mpdm_t mpdm_unref(mpdm_t v)
  */
 mpdm_t mpdm_unrefnd(mpdm_t v)
 {
-    if (v != NULL)
-        v->ref--;
+    if (v != NULL) {
+#ifdef CONFOPT_ATOMICS
+        if (v->flags & MPDM_F_SHARED)
+            __atomic_sub_fetch(&v->ref, 1, __ATOMIC_ACQ_REL);
+        else
+#endif
+            v->ref--;
+    }
+
+    return v;
+}
+
+
+static mpdm_t *share_push(mpdm_t *stack, int *sp, int *ss, mpdm_t v)
+/* pushes a not yet shared value into the stack */
+{
+    if (v != NULL && !(v->flags & MPDM_F_SHARED)) {
+        if (*sp == *ss) {
+            *ss = *ss ? *ss * 2 : 64;
+            stack = realloc(stack, *ss * sizeof(mpdm_t));
+        }
+
+        stack[(*sp)++] = v;
+    }
+
+    return stack;
+}
+
+
+/**
+ * mpdm_share - Marks a value as shared between threads.
+ * @v: the value
+ *
+ * Marks the @v value, and all values it contains, as shared
+ * between threads. The reference counts of shared values are
+ * updated atomically, so they can be safely referenced and
+ * unreferenced from different threads; values stored into a
+ * shared array or object are also marked as shared. Values sent to
+ * mpdm_exec_thread() and the root object are automatically shared.
+ *
+ * Only reference counting is made thread-safe; changing the
+ * content of a shared array or object from different threads
+ * still needs a mutex.
+ * [Threading]
+ */
+mpdm_t mpdm_share(mpdm_t v)
+{
+    mpdm_t *stack = NULL;
+    int sp = 0, ss = 0;
+    mpdm_t w = v;
+
+    /* walk the tree without recursion, stopping on
+       values that are already shared (and so are their children) */
+    while (w != NULL) {
+        if (!(w->flags & MPDM_F_SHARED)) {
+            int n = 0;
+            mpdm_t e, i;
+
+            /* strings are converted to wide characters now,
+               as it cannot be done later from many threads */
+            if (mpdm_type(w) == MPDM_TYPE_STRING)
+                mpdm_string(w);
+
+            w->flags |= MPDM_F_SHARED;
+
+            if (mpdm_type(w) == MPDM_TYPE_OBJECT) {
+                while (mpdm_iterator(w, &n, &e, &i)) {
+                    stack = share_push(stack, &sp, &ss, e);
+                    stack = share_push(stack, &sp, &ss, i);
+                }
+            }
+            else
+            if (mpdm_type(w) == MPDM_TYPE_ARRAY || mpdm_type(w) == MPDM_TYPE_PROGRAM) {
+                while (mpdm_iterator(w, &n, &e, NULL))
+                    stack = share_push(stack, &sp, &ss, e);
+            }
+        }
+
+        w = sp ? stack[--sp] : NULL;
+    }
+
+    free(stack);
 
     return v;
 }
 
 
+#ifdef MPDM_GC
+
+static void gc_mark_gray(mpdm_t v)
+/* subtracts the internal references of the graph from v */
+{
+    if (GC_COLOR(v) != MPDM_F_GRAY) {
+        GC_PAINT(v, MPDM_F_GRAY);
+        gc_children(v, &gc_work);
+    }
+
+    while (gc_work.n) {
+        mpdm_t w = gc_work.v[--gc_work.n];
+
+        w->ref--;
+
+        if (GC_COLOR(w) != MPDM_F_GRAY) {
+            GC_PAINT(w, MPDM_F_GRAY);
+            gc_children(w, &gc_work);
+        }
+    }
+}
+
+
+static void gc_scan_black(mpdm_t v)
+/* restores the internal references of an externally referenced graph */
+{
+    GC_PAINT(v, 0);
+    gc_children(v, &gc_black);
+
+    while (gc_black.n) {
+        mpdm_t w = gc_black.v[--gc_black.n];
+
+        w->ref++;
+
+        if (GC_COLOR(w) != 0) {
+            GC_PAINT(w, 0);
+            gc_children(w, &gc_black);
+        }
+    }
+}
+
+
+static void gc_scan(mpdm_t v)
+/* paints white the gray values that are only referenced internally */
+{
+    val_push(&gc_work, v);
+
+    while (gc_work.n) {
+        mpdm_t w = gc_work.v[--gc_work.n];
+
+        if (GC_COLOR(w) == MPDM_F_GRAY) {
+            if (w->ref > 0)
+                gc_scan_black(w);
+            else {
+                GC_PAINT(w, MPDM_F_WHITE);
+                gc_children(w, &gc_work);
+            }
+        }
+    }
+}
+
+
+static void gc_collect_white(mpdm_t v)
+/* moves the white values to the garbage list */
+{
+    val_push(&gc_work, v);
+
+    while (gc_work.n) {
+        mpdm_t w = gc_work.v[--gc_work.n];
+
+        if (GC_COLOR(w) == MPDM_F_WHITE && !(w->flags & MPDM_F_BUFFERED)) {
+            GC_PAINT(w, 0);
+            val_push(&gc_white, w);
+            gc_children(w, &gc_work);
+        }
+    }
+}
+
+
+static void gc_release(mpdm_t v)
+/* unreferences the non-traced children of a garbage container */
+{
+    int n = 0;
+    mpdm_t e, i;
+
+    /* references to traced values were already subtracted
+       by the collector; the rest are normally unreferenced */
+    if (v->type == MPDM_TYPE_OBJECT) {
+        while (mpdm_iterator_o(v, &n, &e, &i)) {
+            if (!gc_traced(i))
+                mpdm_unref(i);
+            if (!gc_traced(e))
+                mpdm_unref(e);
+        }
+    }
+    else {
+        while (n < v->size) {
+            e = ((mpdm_t *) v->data)[n++];
+
+            if (!gc_traced(e))
+                mpdm_unref(e);
+        }
+    }
+}
+
+#endif /* MPDM_GC */
+
+
+/**
+ * mpdm_destroy_budget - Sets the maximum number of values destroyed at once.
+ * @budget: number of values
+ *
+ * Values are destroyed using a work list instead of recursion, so
+ * trees of any depth can be destroyed. This function sets the
+ * maximum number of values destroyed when a tree is unreferenced;
+ * the rest are left pending and destroyed in batches of @budget
+ * values on each following value creation, to bound the pauses
+ * caused by big trees. A @budget of 0 (the default) destroys the
+ * full tree at once. Returns the previous budget.
+ *
+ * Note that the destruction of files and other resources can be
+ * delayed if a budget is set.
+ * [Value Management]
+ */
+int mpdm_destroy_budget(int budget)
+{
+    int r = 0;
+
+#ifdef MPDM_WORK_LIST
+    r = destroy_budget;
+    destroy_budget = budget;
+#endif
+
+    return r;
+}
+
+
+/**
+ * mpdm_gc - Collects reference cycles.
+ *
+ * Runs the cycle collector over the arrays and objects buffered
+ * as candidates in the current thread, destroying the groups of
+ * values that are only referenced among themselves (like an array
+ * that contains itself). Returns the number of destroyed values.
+ *
+ * Values that are only referenced from C variables (like the
+ * ones just created) count as unreferenced, so all values that
+ * are part of a cycle must be referenced when this function is
+ * called. See also mpdm_gc_check(). Shared values are never
+ * collected.
+ * [Value Management]
+ */
+int mpdm_gc(void)
+{
+    int n = 0;
+
+#ifdef MPDM_GC
+    int i, j;
+    double t;
+
+    if (gc_running)
+        return 0;
+
+    gc_running = 1;
+    t = mpdm_time();
+
+    /* trial-delete the internal references from the candidates */
+    for (i = j = 0; i < gc_roots.n; i++) {
+        mpdm_t v = gc_roots.v[i];
+
+        if (v->flags & MPDM_F_DEAD) {
+            /* destroyed while buffered */
+            val_free(v);
+        }
+        else
+        if (GC_COLOR(v) == MPDM_F_PURPLE && gc_traced(v) && v->ref > 0) {
+            gc_mark_gray(v);
+            gc_roots.v[j++] = v;
+        }
+        else
+            v->flags &= ~MPDM_F_BUFFERED;
+    }
+
+    /* the ones still referenced from outside are restored */
+    for (i = 0; i < j; i++)
+        gc_scan(gc_roots.v[i]);
+
+    /* and the rest is garbage */
+    for (i = 0; i < j; i++) {
+        gc_roots.v[i]->flags &= ~MPDM_F_BUFFERED;
+        gc_collect_white(gc_roots.v[i]);
+    }
+
+    gc_roots.n = 0;
+
+    for (i = 0; i < gc_white.n; i++)
+        gc_release(gc_white.v[i]);
+
+    /* once no one looks at them, they are destroyed as empty */
+    for (i = 0; i < gc_white.n; i++) {
+        mpdm_t v = gc_white.v[i];
+
+        v->size = 0;
+        v->ref  = 0;
+        mpdm_destroy(v);
+    }
+
+    n = gc_white.n;
+    gc_white.n = 0;
+
+    gc_collections++;
+    gc_collected += n;
+    gc_time += mpdm_time() - t;
+
+    gc_running = 0;
+
+#endif /* MPDM_GC */
+
+    return n;
+}
+
+
+/**
+ * mpdm_gc_threshold - Sets the cycle collector threshold.
+ * @threshold: number of candidates
+ *
+ * Sets the number of candidate arrays and objects that trigger
+ * a cycle collection. Arrays and objects become candidates when
+ * their reference count is decremented without reaching zero.
+ * A @threshold of 0 (the default) disables the collector.
+ * Returns the previous threshold.
+ *
+ * Collections are never run automatically while building values,
+ * as cycles made of new, still unreferenced values would be taken
+ * as garbage; they are run by mpdm_gc_check() once the threshold
+ * is reached. The collector is not available on systems without
+ * thread-local storage.
+ * [Value Management]
+ */
+int mpdm_gc_threshold(int threshold)
+{
+    int r = 0;
+
+#ifdef MPDM_GC
+    r = gc_threshold;
+    gc_threshold = threshold;
+#endif
+
+    return r;
+}
+
+
+/**
+ * mpdm_gc_check - Collects reference cycles if the threshold is reached.
+ *
+ * Runs mpdm_gc() if the number of candidates reached the threshold
+ * set by mpdm_gc_threshold(). It must be called from points where
+ * all values in use are referenced (e.g. between the statements of
+ * an interpreter, or in the main loop of a program). Returns the
+ * number of destroyed values.
+ * [Value Management]
+ */
+int mpdm_gc_check(void)
+{
+    int r = 0;
+
+#ifdef MPDM_GC
+    if (gc_threshold && gc_roots.n >= gc_threshold && !destroying)
+        r = mpdm_gc();
+#endif
+
+    return r;
+}
+
+
+/**
+ * mpdm_gc_stats - Returns the cycle collector statistics.
+ *
+ * Returns an object with the statistics of the cycle collector
+ * for the current thread: the number of collections (collections),
+ * the number of destroyed values (collected), the number of
+ * currently buffered candidates (candidates), the threshold
+ * (threshold) and the time spent collecting, in seconds (time).
+ * It also includes the number of values pending destruction
+ * (pending), see mpdm_destroy_budget().
+ * [Value Management]
+ */
+mpdm_t mpdm_gc_stats(void)
+{
+    mpdm_t r = MPDM_O();
+
+#ifdef MPDM_GC
+    mpdm_set_wcs(r, MPDM_I(gc_collections), L"collections");
+    mpdm_set_wcs(r, MPDM_I(gc_collected),   L"collected");
+    mpdm_set_wcs(r, MPDM_I(gc_roots.n),     L"candidates");
+    mpdm_set_wcs(r, MPDM_I(gc_threshold),   L"threshold");
+    mpdm_set_wcs(r, MPDM_R(gc_time),        L"time");
+    mpdm_set_wcs(r, MPDM_I(destroy_list.n), L"pending");
+#endif
+
+    return r;
+}
+
+
 /**
  * mpdm_size - Returns the size of an element.
  * @v: the element
@@ -190,7 +971,8 @@ int mpdm_size(const mpdm_t v)
  */
 mpdm_t mpdm_root(void)
 {
-    return mpdm_global_root = mpdm_global_root ? mpdm_global_root : mpdm_ref(MPDM_O());
+    /* it's global, so it's shared between threads */
+    return mpdm_global_root = mpdm_global_root ? mpdm_global_root : mpdm_share(mpdm_ref(MPDM_O()));
 }
 
 
@@ -251,6 +1033,29 @@ mpdm_t mpdm_new_copy(mpdm_type_t type, void *ptr, int size)
 }
 
 
+/**
+ * mpdm_new_b - Creates a new bytes value.
+ * @ptr: the bytes
+ * @size: the number of bytes
+ *
+ * Creates a new value holding a copy of the @size bytes in @ptr
+ * (or zeroed, if @ptr is NULL), stored in the same memory block
+ * as the value. Bytes values are not decoded nor converted to
+ * wide chars; they are read from and written to files with
+ * mpdm_bread() and mpdm_bwrite().
+ * [Value Creation]
+ */
+mpdm_t mpdm_new_b(const void *ptr, int size)
+{
+    mpdm_t v = mpdm_new_inline(MPDM_TYPE_BYTES, size, size);
+
+    if (ptr != NULL)
+        memcpy((void *) v->data, ptr, size);
+
+    return v;
+}
+
+
 int mpdm_wrap_pointers(mpdm_t v, int offset, int *del)
 {
     /* wrap from the end */
@@ -317,10 +1122,15 @@ extern char *mpdm_build_timestamp;
 int mpdm_startup(void)
 {
     mpdm_t r, v;
+    int n;
 
     /* set the pointer to the destroy function */
     mpdm_destroy = mpdm_real_destroy;
 
+    /* create the cached small integers before any thread can */
+    for (n = 0; n < MPDM_SMALL_INTS; n++)
+        mpdm_share(mpdm_new_i(n));
+
     r = mpdm_root();
 
     /* sets the locale */
@@ -348,14 +1158,86 @@ int mpdm_startup(void)
 }
 
 
+void mpdm_small_ints_free(void);
+void mpdm_symtab_free(void);
+
+
 /**
  * mpdm_shutdown - Shuts down MPDM.
  *
- * Shuts down MPDM. No MPDM functions should be used from now on.
+ * Shuts down MPDM. No MPDM functions should be used from now on,
+ * unless mpdm_startup() is called again.
  */
 void mpdm_shutdown(void)
 {
-    /* dummy, by now */
+#ifdef MPDM_SLAB
+    int c;
+#endif
+
+    /* destroy the root tree and the caches */
+    mpdm_global_root = mpdm_unref(mpdm_global_root);
+    mpdm_small_ints_free();
+
+    /* release this thread, as any other */
+    mpdm_thread_exit();
+
+#ifdef MPDM_SLAB
+    /* free all chunks, as no value can be used from now on */
+    while (slab_chunks_global != NULL) {
+        void *p = slab_chunks_global;
+
+        slab_chunks_global = *((void **)p);
+        free(p);
+    }
+
+    for (c = 1; c <= SLAB_CLASSES; c++)
+        slab_free_global[c] = NULL;
+#endif
+}
+
+
+/**
+ * mpdm_thread_exit - Releases the resources of the current thread.
+ *
+ * Releases the interned strings of the current thread, finishes
+ * its pending destructions and releases the memory it keeps for
+ * creating new values, so it can be reused by others. It's called at the end of threads started
+ * by mpdm_exec_thread(); other threads that use MPDM must call it
+ * before finishing. No MPDM functions should be used from the
+ * thread after calling it.
+ * [Threading]
+ */
+void mpdm_thread_exit(void)
+{
+#ifdef CONFOPT_TLS
+    mpdm_symtab_free();
+#endif
+
+#ifdef MPDM_WORK_LIST
+    destroy_pending(0);
+#endif
+
+#ifdef MPDM_GC
+    /* collections can leave destructions pending,
+       and these can buffer new candidates */
+    while (gc_roots.n) {
+        mpdm_gc();
+        destroy_pending(0);
+    }
+
+    val_stack_free(&gc_roots);
+    val_stack_free(&gc_work);
+    val_stack_free(&gc_white);
+    val_stack_free(&gc_black);
+#endif
+
+#ifdef MPDM_WORK_LIST
+    val_stack_free(&destroy_list);
+#endif
+
+#ifdef MPDM_SLAB
+    slab_handback();
+#endif
 }
 
 /**
@@ -138,6 +138,16 @@ int mpdm_count(mpdm_t v)
         r = mpdm_count_o(v);
         break;
 
+    case MPDM_TYPE_STRING:
+        /* the size of a string is its length */
+        r = mpdm_size(v);
+        break;
+
+    case MPDM_TYPE_FILE:
+        /* the number of lines (mapped files only) */
+        r = mpdm_flines(v);
+        break;
+
     default:
         r = wcslen(mpdm_string(v));
         break;
@@ -181,6 +191,10 @@ mpdm_t mpdm_get(mpdm_t set, mpdm_t i)
 
         break;
 
+    case MPDM_TYPE_FILE:
+        r = mpdm_fline(set, mpdm_ival(i));
+        break;
+
     default:
         r = NULL;
         break;
@@ -457,6 +471,9 @@ mpdm_t mpdm_map(mpdm_t set, mpdm_t filter, mpdm_t ctxt)
     default:
         out = MPDM_A(0);
 
+        if (mpdm_type(set) == MPDM_TYPE_ARRAY || mpdm_type(set) == MPDM_TYPE_OBJECT)
+            mpdm_reserve(out, mpdm_count(set));
+
         while (mpdm_iterator(set, &n, &v, &i)) {
             mpdm_t w = NULL;
             mpdm_ref(v);
@@ -779,7 +796,8 @@ mpdm_t mpdm_splice(const mpdm_t v, const mpdm_t i,
  * Compares two values. If both has the MPDM_STRING flag set,
  * a comparison using wcscoll() is returned; if both are arrays,
  * the size is compared first and, if they have the same number
- * elements, each one is compared; otherwise, a simple visual
+ * elements, each one is compared; if both are bytes values, they
+ * are compared byte by byte; otherwise, a simple visual
  * representation comparison is done.
  * [Strings]
  */
@@ -822,7 +840,7 @@ int mpdm_cmp(const mpdm_t v1, const mpdm_t v2)
 
             if (mpdm_type(v2) == mpdm_type(v1)) {
                 /* if they are the same size, compare elements one by one */
-                if ((r = mpdm_size(v1) - mpdm_size(v2)) == 0) {
+                if ((r = mpdm_count(v1) - mpdm_count(v2)) == 0) {
                     int n = 0;
                     mpdm_t v, i;
 
@@ -837,8 +855,24 @@ int mpdm_cmp(const mpdm_t v1, const mpdm_t v2)
 
             /* fallthrough */
 
+        case MPDM_TYPE_BYTES:
+            if (mpdm_type(v1) == MPDM_TYPE_BYTES && mpdm_type(v2) == MPDM_TYPE_BYTES) {
+                /* compare the common part, then the size */
+                int s = mpdm_size(v1) < mpdm_size(v2) ? mpdm_size(v1) : mpdm_size(v2);
+
+                if ((r = memcmp(v1->data, v2->data, s)) == 0)
+                    r = mpdm_size(v1) - mpdm_size(v2);
+
+                break;
+            }
+
+            /* fallthrough */
+
         default:
-            r = mpdm_cmp_wcs(v1, v2 ? mpdm_string(v2) : NULL);
+            if (mpdm_type(v1) == MPDM_TYPE_STRING && mpdm_type(v2) == MPDM_TYPE_STRING)
+                r = mpdm_cmp_s(v1, v2);
+            else
+                r = mpdm_cmp_wcs(v1, v2 ? mpdm_string(v2) : NULL);
             break;
         }
     }
@@ -10,6 +10,8 @@
 #include <string.h>
 #include <stdlib.h>
 #include <wchar.h>
+#include <locale.h>
+#include <float.h>
 
 #include <time.h>
 
@@ -83,6 +85,10 @@ void test_basic(void)
 
     mpdm_unref(v);
 
+    do_test("small integers are cached", MPDM_I(100) == MPDM_I(100));
+    do_test("big integers", mpdm_ival(MPDM_I(-123456)) == -123456);
+    do_test("reals", mpdm_rval(MPDM_R(-1.5)) == -1.5);
+
     if (verbose) {
         printf("mpdm_string: %ls\n", mpdm_string(MPDM_O()));
         printf("mpdm_string: %ls\n", mpdm_string(MPDM_O()));
@@ -94,6 +100,14 @@ void test_basic(void)
 
     do_test("Partial string values", mpdm_cmp(v, MPDM_S(L" is ")) == 0);
 
+    v = MPDM_S(L"short");
+    do_test("Short strings are stored inline", v->flags & MPDM_F_INLINE);
+    do_test("Inline strings 1", wcscmp(mpdm_string(v), L"short") == 0);
+    v = MPDM_ENS(wcsdup(L"owned"), 5);
+    do_test("Inline strings 2", mpdm_cmp_wcs(v, L"owned") == 0);
+    v = MPDM_S(L"a string too long to be stored inline in the value");
+    do_test("Long strings are not stored inline", !(v->flags & MPDM_F_INLINE));
+
     v = mpdm_ref(MPDM_S(L"MUAHAHAHA!"));
     w = mpdm_ref(mpdm_clone(v));
     do_test("Testing mpdm_clone semantics 1", w == v);
@@ -265,6 +279,49 @@ void test_array(void)
     do_test("acollapse unrefs values", (v->ref < n));
     mpdm_unref(v);
 
+    v = mpdm_reserve(MPDM_A(0), 100);
+    do_test("mpdm_reserve does not change the size", mpdm_size(v) == 0);
+    do_test("mpdm_reserve allocates", v->alloc == 100);
+    for (n = 0; n < 1000; n++)
+        mpdm_push(v, MPDM_I(n));
+    do_test("arrays grow geometrically", v->alloc >= 1000 && v->alloc < 2000);
+    while (mpdm_size(v) > 10)
+        mpdm_pop(v);
+    do_test("arrays shrink", v->alloc >= 10 && v->alloc <= 40);
+    do_test("arrays keep data after shrinking", mpdm_ival(mpdm_get_i(v, 9)) == 9);
+    mpdm_void(v);
+
+    v = mpdm_ref(MPDM_A(0));
+    for (n = 0; n < 100; n++)
+        mpdm_push(v, MPDM_I(n));
+    for (n = 0; n < 50; n++)
+        mpdm_shift(v);
+    do_test("shift 1", mpdm_size(v) == 50 && mpdm_ival(mpdm_get_i(v, 0)) == 50);
+    mpdm_ins(v, MPDM_I(1000), 0);
+    mpdm_ins(v, MPDM_I(1001), 1);
+    do_test("shift 2", mpdm_ival(mpdm_get_i(v, 0)) == 1000);
+    do_test("shift 3", mpdm_ival(mpdm_get_i(v, 1)) == 1001);
+    do_test("shift 4", mpdm_ival(mpdm_get_i(v, 2)) == 50);
+    for (n = 0; n < 100; n++)
+        mpdm_push(v, MPDM_I(n + 100));
+    do_test("shift 5", mpdm_size(v) == 152 && mpdm_ival(mpdm_get_i(v, -1)) == 199);
+    mpdm_sort(v, 1);
+    do_test("shift 6", mpdm_ival(mpdm_get_i(v, 0)) == 50 && mpdm_ival(mpdm_get_i(v, -1)) == 1001);
+    mpdm_unref(v);
+
+    /* inserting at the start grows head room */
+    v = mpdm_ref(MPDM_A(0));
+    for (n = 0; n < 1000; n++)
+        mpdm_ins(v, MPDM_I(n), 0);
+    do_test("ins at start 1", mpdm_size(v) == 1000 && v->head > 0);
+    do_test("ins at start 2", mpdm_ival(mpdm_get_i(v, 0)) == 999 &&
+        mpdm_ival(mpdm_get_i(v, -1)) == 0);
+    mpdm_push(v, MPDM_I(-1));
+    mpdm_ins(v, MPDM_I(1000), 0);
+    do_test("ins at start 3", mpdm_size(v) == 1002 && mpdm_ival(mpdm_get_i(v, 0)) == 1000 &&
+        mpdm_ival(mpdm_get_i(v, 1000)) == 0 && mpdm_ival(mpdm_get_i(v, -1)) == -1);
+    mpdm_unref(v);
+
     mpdm_unref(a);
 
     /* test queues */
@@ -349,7 +406,7 @@ void test_array(void)
 void test_hash(void)
 {
     mpdm_t h;
-    mpdm_t v;
+    mpdm_t v, w;
     int i, n;
 
     h = MPDM_O();
@@ -404,6 +461,29 @@ void test_hash(void)
 
     mpdm_unref(h);
 
+    /* many keys, deleted while iterating */
+    h = mpdm_ref(MPDM_O());
+
+    for (n = 0; n < 2000; n++)
+        mpdm_set(h, MPDM_I(n), MPDM_I(n));
+
+    w = mpdm_ref(mpdm_clone(h));
+    do_test("hash: clones are equal", mpdm_cmp(h, w) == 0);
+
+    n = 0;
+    while (mpdm_iterator(h, &n, &v, NULL)) {
+        if (mpdm_ival(v) % 2)
+            mpdm_del(h, v);
+    }
+
+    do_test("hash: deleting while iterating", mpdm_count(h) == 1000);
+    do_test("hash: deleted keys", mpdm_get(h, MPDM_I(777)) == NULL);
+    do_test("hash: kept keys", mpdm_ival(mpdm_get(h, MPDM_I(778))) == 778);
+    do_test("hash: clones are not affected", mpdm_count(w) == 2000);
+
+    mpdm_unref(w);
+    mpdm_unref(h);
+
 /*
     mpdm_dump(h);
 
@@ -614,6 +694,183 @@ void test_split(void)
 }
 
 
+void test_slice(void)
+{
+    mpdm_t v, w, a;
+    wchar_t str[20 * 100 + 1];
+    wchar_t tmp[128];
+    int n;
+
+    /* a string of 20 lines of 100 characters */
+    for (n = 0; n < 20; n++)
+        swprintf(str + n * 100, 101, L"%02d%097d\n", n, 0);
+
+    v = mpdm_ref(MPDM_S(str));
+
+    a = mpdm_ref(mpdm_split(v, MPDM_S(L"\n")));
+    w = mpdm_get_i(a, 5);
+    do_test("slice: split parts are slices", w->flags & MPDM_F_SLICE);
+    do_test("slice: parent is sliced", v->flags & MPDM_F_SLICED);
+    do_test("slice: size", mpdm_size(w) == 99);
+    do_test("slice: content", wcsncmp(mpdm_string(mpdm_get_i(a, 7)), L"07000", 5) == 0);
+    do_test("slice: last part is a copy", mpdm_size(mpdm_get_i(a, 20)) == 0);
+
+    w = mpdm_ref(mpdm_new_slice(w, 2, 80));
+    do_test("slice: slices of slices", (w->flags & MPDM_F_SLICE) &&
+        *(mpdm_t *) w->data == v);
+    mpdm_string_n(w, 0, tmp, 80);
+    do_test("slice: slice of slice content", tmp[0] == L'0' && tmp[79] == L'0');
+    mpdm_unref(w);
+
+    w = mpdm_new_slice(v, 100, 10);
+    do_test("slice: short slices are copies", !(w->flags & MPDM_F_SLICE) &&
+        mpdm_cmp_wcs(w, L"0100000000") == 0);
+
+    mpdm_unref(a);
+    do_test("slice: parent not sliced after freeing them", !(v->flags & MPDM_F_SLICED));
+
+    w = mpdm_regex(v, MPDM_S(L"/12[0-9]+/"), 0);
+    do_test("slice: regex match is a slice",
+        w != NULL && (w->flags & MPDM_F_SLICE) && mpdm_size(w) == 99);
+
+    mpdm_splice(v, NULL, 0, 100, &w, NULL);
+    do_test("slice: deleting the start is a slice",
+        (w->flags & MPDM_F_SLICE) && mpdm_size(w) == 1900);
+    mpdm_void(w);
+
+    /* a tiny slice is compacted when only slices keep the parent */
+    w = mpdm_ref(mpdm_new_slice(v, 1000, 99));
+    mpdm_unref(v);
+    mpdm_string_n(w, 0, tmp, 10);
+    do_test("slice: tiny slices get their own copy",
+        (w->flags & MPDM_F_ASCII) == MPDM_F_ASCII && mpdm_cmp_wcs(w, L"10") > 0);
+
+    /* a slice converted to wide chars */
+    v = mpdm_ref(MPDM_S(mpdm_string(w)));
+    mpdm_unref(w);
+    w = mpdm_ref(mpdm_new_slice(v, 1, 80));
+    do_test("slice: converted when accessed",
+        wcsncmp(mpdm_string(w), L"00000", 5) == 0 && !(w->flags & MPDM_F_REPR) &&
+        !(v->flags & MPDM_F_SLICED));
+    mpdm_unref(w);
+    mpdm_unref(v);
+
+    /* UTF-8 */
+    v = mpdm_ref(mpdm_new_utf8(
+        "Cuando despert\xc3\xb3" ", el dinosaurio todav\xc3\xad" "a estaba all\xc3\xad. "
+        "Augusto Monterroso, en un libro de cuentos que se public\xc3\xb3 en 1959.|"
+        "El dinosaurio, de Augusto Monterroso, es uno de los relatos m\xc3\xa1s breves.", -1, 1));
+
+    a = mpdm_ref(mpdm_split(v, MPDM_S(L"|")));
+    do_test("slice: UTF-8 split", mpdm_size(a) == 2 && (v->flags & MPDM_F_UTF8) &&
+        (mpdm_get_i(a, 1)->flags & MPDM_F_SLICE));
+    w = mpdm_ref(mpdm_join(a, MPDM_S(L"|")));
+    do_test("slice: UTF-8 join", (w->flags & MPDM_F_UTF8) && mpdm_cmp(w, v) == 0);
+    mpdm_unref(w);
+
+    w = mpdm_get_i(a, 1);
+    do_test("slice: UTF-8 content", mpdm_utf8(w, &n) != NULL && n == 72 &&
+        mpdm_cmp_wcs(w, L"El dinosaurio, de Augusto Monterroso, es uno de los relatos m\x00e1s breves.") == 0);
+    mpdm_unref(a);
+    mpdm_unref(v);
+}
+
+
+void test_rope(void)
+{
+    mpdm_t v, w, p;
+    wchar_t *str = malloc(10000 * 5 * sizeof(wchar_t) + sizeof(wchar_t));
+    wchar_t tmp[16];
+    int n;
+
+    v = mpdm_ref(MPDM_S(L""));
+    p = mpdm_ref(MPDM_S(L""));
+
+    for (n = 0; n < 10000; n++) {
+        swprintf(str + n * 5, 6, L"%04d;", n);
+
+        /* appended */
+        w = mpdm_ref(mpdm_strcat_wcs(v, str + n * 5));
+        mpdm_unref(v);
+        v = w;
+
+        /* prepended */
+        w = mpdm_ref(mpdm_strcat(MPDM_S(str + n * 5), p));
+        mpdm_unref(p);
+        p = w;
+    }
+
+    do_test("rope: strcat makes ropes", (v->flags & MPDM_F_ROPE) && (p->flags & MPDM_F_ROPE));
+    do_test("rope: size", mpdm_size(v) == 50000 && mpdm_size(p) == 50000);
+    do_test("rope: appending keeps it balanced", ((int *) ((mpdm_t *) v->data + 2))[0] < 16);
+    do_test("rope: prepending keeps it balanced", ((int *) ((mpdm_t *) p->data + 2))[0] < 16);
+
+    tmp[mpdm_string_n(v, 31415, tmp, 10)] = L'\0';
+    do_test("rope: random access", wcscmp(tmp, L"6283;6284;") == 0 && (v->flags & MPDM_F_ROPE));
+    tmp[mpdm_string_n(p, 5, tmp, 10)] = L'\0';
+    do_test("rope: random access (prepended)", wcscmp(tmp, L"9998;9997;") == 0);
+
+    w = mpdm_ref(mpdm_strcat(v, p));
+    do_test("rope: ropes of ropes", (w->flags & MPDM_F_ROPE) && mpdm_size(w) == 100000);
+
+    do_test("rope: flattened by mpdm_string()", wcscmp(mpdm_string(v), str) == 0 &&
+        !(v->flags & MPDM_F_REPR));
+    do_test("rope: compare", mpdm_cmp_wcs(v, str) == 0);
+
+    tmp[mpdm_string_n(w, 49995, tmp, 10)] = L'\0';
+    do_test("rope: parts flattened under it", wcscmp(tmp, L"9999;9999;") == 0);
+    mpdm_unref(w);
+
+    w = mpdm_strcat_wcs(MPDM_S(L"short"), L" string");
+    do_test("rope: short strings are copied", !(w->flags & MPDM_F_REPR) &&
+        mpdm_cmp_wcs(w, L"short string") == 0);
+
+    mpdm_unref(p);
+    mpdm_unref(v);
+    free(str);
+}
+
+
+void test_sb(void)
+{
+    struct mpdm_sb sb;
+    mpdm_t v;
+    wchar_t *ptr;
+    int n;
+
+    mpdm_sb_init(&sb);
+    ptr = mpdm_sb_detach(&sb, &n);
+    do_test("sb: empty builder", ptr == NULL && n == 0);
+
+    v = mpdm_sb_finish(&sb);
+    do_test("sb: empty string", mpdm_type(v) == MPDM_TYPE_STRING && mpdm_size(v) == 0);
+
+    for (n = 0; n < 10000; n++)
+        mpdm_sb_add_wc(&sb, L'a' + n % 26);
+    do_test("sb: geometric growth", sb.size == 10000 && sb.alloc >= 10001 && sb.alloc < 20002);
+
+    mpdm_sb_add_wcs(&sb, L"-");
+    mpdm_sb_add_wcsn(&sb, L"0123456789", 5);
+    mpdm_sb_add_v(&sb, MPDM_I(42));
+    mpdm_sb_add_v(&sb, mpdm_new_compact(L"compact", -1, 1));
+
+    v = mpdm_ref(mpdm_sb_finish(&sb));
+    do_test("sb: finish", mpdm_size(v) == 10000 + 1 + 5 + 2 + 7 && sb.ptr == NULL);
+    do_test("sb: content", wcscmp(mpdm_string(v) + 9998, L"op-0123442compact") == 0);
+    mpdm_unref(v);
+
+    mpdm_sb_reserve(&sb, 100);
+    do_test("sb: reserve", sb.alloc >= 101 && sb.size == 0);
+    mpdm_sb_add_wcs(&sb, L"reserved");
+    ptr = mpdm_sb_detach(&sb, &n);
+    do_test("sb: detach", n == 8 && wcscmp(ptr, L"reserved") == 0);
+    free(ptr);
+
+    v = mpdm_escape(MPDM_S(L"tab\there"), L' ', L'~', MPDM_S(L"\\x%02x"));
+    do_test("sb: mpdm_escape()", mpdm_cmp_wcs(v, L"tab\\x09here") == 0);
+}
+
+
 void test_join(void)
 {
     mpdm_t v;
@@ -701,6 +958,26 @@ void test_file(void)
     do_test("unlink",
             mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"r")) == NULL);
 
+    /* plain streams */
+    {
+        FILE *fp = tmpfile();
+        wchar_t *ptr;
+        int s;
+
+        mpdm_write_wcs(fp, L"plain\nstream");
+        rewind(fp);
+
+        ptr = mpdm_read_mbs(fp, &s);
+        do_test("mpdm_read_mbs 1", s == 6 && wcscmp(ptr, L"plain\n") == 0);
+        free(ptr);
+
+        ptr = mpdm_read_mbs(fp, &s);
+        do_test("mpdm_read_mbs 2", s == 6 && wcscmp(ptr, L"stream") == 0);
+        free(ptr);
+
+        fclose(fp);
+    }
+
     v = mpdm_stat(MPDM_S(L"stress.c"));
     if (verbose) {
         printf("Stat from stress.c:\n");
@@ -715,6 +992,52 @@ void test_file(void)
     }
 
     mpdm_unref(eol);
+
+    /* compact strings */
+    f = mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"w"));
+    mpdm_write(f, MPDM_S(L"a line of text\n"));
+    mpdm_write(f, MPDM_S(L"a much longer line of text, stored outside the value as it "
+                          "does not fit into its inline storage\n"));
+    mpdm_close(f);
+
+    f = mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"r"));
+    v = mpdm_ref(mpdm_read(f));
+    eol = mpdm_ref(mpdm_read(f));
+    mpdm_close(f);
+
+    do_test("compact: lines are read compact",
+        (v->flags & MPDM_F_LATIN1) && (eol->flags & MPDM_F_LATIN1));
+    do_test("compact: size", mpdm_size(v) == 15);
+
+    f = mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"w"));
+    mpdm_write(f, v);
+    mpdm_write(f, eol);
+    mpdm_close(f);
+    do_test("compact: written without conversion",
+        (v->flags & MPDM_F_LATIN1) && (eol->flags & MPDM_F_LATIN1));
+
+    f = mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"r"));
+    do_test("compact: written content 1", mpdm_cmp(mpdm_read(f), v) == 0);
+    do_test("compact: written content 2", mpdm_cmp(mpdm_read(f), eol) == 0);
+    mpdm_close(f);
+
+    do_test("compact: converted when accessed",
+        wcscmp(mpdm_string(v), L"a line of text\n") == 0 && !(v->flags & MPDM_F_REPR));
+    mpdm_unref(eol);
+    mpdm_unref(v);
+
+    v = mpdm_ref(mpdm_new_compact(L"10 \x20ac", -1, 1));
+    do_test("compact: 2 byte chars", v->flags & MPDM_F_UCS2);
+    do_test("compact: 2 byte content", mpdm_cmp_wcs(v, L"10 \x20ac") == 0);
+    mpdm_unref(v);
+
+    if (sizeof(wchar_t) > 2) {
+        v = mpdm_new_compact(L"\x1f600", -1, 1);
+        do_test("compact: 4 byte chars", !(v->flags & MPDM_F_REPR));
+        mpdm_void(v);
+    }
+
+    mpdm_unlink(MPDM_S(L"test.txt"));
 }
 
 
@@ -1118,7 +1441,7 @@ void test_encoding(void)
     mpdm_close(f);
 
     if (verbose) {
-        for (ptr = w->data; *ptr != L'\0'; ptr++)
+        for (ptr = mpdm_string(w); *ptr != L'\0'; ptr++)
             printf("%d", mpdm_wcwidth(*ptr));
         printf("\n");
     }
@@ -1155,152 +1478,1418 @@ void test_encoding(void)
 }
 
 
-void test_gettext(void)
+void test_utf8(void)
 {
-    mpdm_t v;
-    mpdm_t h;
+    mpdm_t f, v, w, o;
+    const wchar_t *line = L"\x00a1" L"Espa\x00f1" L"a, \x20ac 10!\n";
+    int n;
 
-    mpdm_gettext_domain(MPDM_S(L"stress"), MPDM_S(L"./po"));
+    if (mpdm_encoding(MPDM_S(L"utf-8")) < 0)
+        return;
 
-    if (verbose)
-        printf("Should follow a translated string of 'This is a test string':\n");
+    f = mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"w"));
+    mpdm_write(f, MPDM_S(line));
+    mpdm_write(f, MPDM_S(L"plain ascii\n"));
+    mpdm_close(f);
 
-    v = mpdm_gettext(MPDM_S(L"This is a test string"));
-    if (verbose)
-        mpdm_dump(v);
+    f = mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"r"));
+    v = mpdm_ref(mpdm_read(f));
+    w = mpdm_ref(mpdm_read(f));
+    mpdm_close(f);
 
-    if (verbose)
-        printf("The same, but cached:\n");
-    v = mpdm_gettext(MPDM_S(L"This is a test string"));
-    if (verbose)
-        mpdm_dump(v);
+    do_test("utf8: lines are read as UTF-8",
+        (v->flags & MPDM_F_ASCII) == MPDM_F_UTF8);
+    do_test("utf8: ascii lines are also 1 byte",
+        (w->flags & MPDM_F_ASCII) == MPDM_F_ASCII);
+    do_test("utf8: size in characters", mpdm_size(v) == wcslen(line));
 
-    v = mpdm_gettext(MPDM_S(L"This string is not translated"));
-    if (verbose)
-        mpdm_dump(v);
+    f = mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"r"));
+    do_test("utf8: compared without conversion",
+        mpdm_cmp(mpdm_read(f), v) == 0 && (v->flags & MPDM_F_UTF8));
+    do_test("utf8: compared with ascii",
+        mpdm_cmp(w, mpdm_new_utf8("plain ascii, and more", -1, 1)) < 0);
+    mpdm_close(f);
 
-    h = MPDM_O();
-    mpdm_ref(h);
-    mpdm_set(h, MPDM_S(L"cadena de prueba"), MPDM_S(L"test string"));
+    o = mpdm_ref(MPDM_O());
+    mpdm_set_wcs(o, MPDM_I(1), line);
+    do_test("utf8: hashed without conversion",
+        mpdm_ival(mpdm_get(o, v)) == 1 && (v->flags & MPDM_F_UTF8));
+    mpdm_unref(o);
+
+    o = mpdm_ref(mpdm_split(v, MPDM_S(L" ")));
+    do_test("utf8: split", mpdm_size(o) == 3 && (v->flags & MPDM_F_UTF8));
+    do_test("utf8: split pieces are UTF-8",
+        (mpdm_get_i(o, 0)->flags & MPDM_F_ASCII) == MPDM_F_UTF8 &&
+        (mpdm_get_i(o, 2)->flags & MPDM_F_ASCII) == MPDM_F_ASCII);
+    do_test("utf8: split content", mpdm_cmp_wcs(mpdm_get_i(o, 1), L"\x20ac") == 0);
+
+    w = mpdm_ref(mpdm_join(o, MPDM_S(L" ")));
+    do_test("utf8: join is UTF-8", (w->flags & MPDM_F_ASCII) == MPDM_F_UTF8);
+    do_test("utf8: join content", mpdm_cmp(w, v) == 0);
+    mpdm_unref(w);
+    mpdm_unref(o);
 
-    mpdm_gettext_domain(MPDM_S(L"stress"), h);
-    v = mpdm_gettext(MPDM_S(L"test string"));
-    if (verbose)
-        mpdm_dump(v);
-    mpdm_unref(h);
-}
+    f = mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"w"));
+    n = mpdm_write(f, v);
+    mpdm_close(f);
+    do_test("utf8: written without conversion",
+        n == (int) wcslen(line) + 4 && (v->flags & MPDM_F_UTF8));
+
+    /* other elements are encoded after a UTF-8 one */
+    o = mpdm_ref(MPDM_A(0));
+    mpdm_push(o, v);
+    mpdm_push(o, MPDM_S(L"\x20ac"));
+    mpdm_push(o, MPDM_I(1000));
+    mpdm_push(o, MPDM_S(L""));
+    w = mpdm_ref(mpdm_join(o, MPDM_S(L"\xf1")));
+    do_test("utf8: join mixed is UTF-8", (w->flags & MPDM_F_ASCII) == MPDM_F_UTF8);
+    do_test("utf8: join mixed content", mpdm_cmp(w,
+        mpdm_strcat(v, MPDM_S(L"\xf1\x20ac\xf1" L"1000\xf1"))) == 0);
+    mpdm_unref(w);
+    mpdm_unref(o);
 
+    /* read again, autodetecting the encoding */
+    mpdm_encoding(NULL);
 
-void timer(int secs)
-{
-    static clock_t clks = 0;
+    f = mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"r"));
+    w = mpdm_ref(mpdm_read(f));
+    mpdm_close(f);
+    do_test("utf8: autodetected", (w->flags & MPDM_F_ASCII) == MPDM_F_UTF8);
+    do_test("utf8: written content", mpdm_cmp(w, v) == 0);
+    mpdm_unref(w);
 
-    switch (secs) {
-    case 0:
-        clks = clock();
-        break;
+    /* write into another encoding */
+    mpdm_encoding(MPDM_S(L"iso8859-1"));
+    f = mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"w"));
+    mpdm_write(f, mpdm_get_i(mpdm_split(v, MPDM_S(L",")), 0));
+    mpdm_close(f);
+    f = mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"r"));
+    w = mpdm_read(f);
+    do_test("utf8: written as iso8859-1",
+        (w->flags & MPDM_F_ASCII) == MPDM_F_LATIN1 &&
+        mpdm_cmp_wcs(w, L"\x00a1" L"Espa\x00f1" L"a") == 0);
+    mpdm_close(f);
+    mpdm_encoding(NULL);
 
-    case -1:
-        printf("%.2f seconds\n",
-               (float) (clock() - clks) / (float) CLOCKS_PER_SEC);
-        break;
+    do_test("utf8: regex", mpdm_regex(v, MPDM_S(L"/Espa.a/"), 0) != NULL);
+    do_test("utf8: converted when accessed",
+        wcscmp(mpdm_string(v), line) == 0 && !(v->flags & MPDM_F_REPR));
+    mpdm_unref(v);
+
+    v = mpdm_ref(mpdm_new_utf8("a\xffz\xe2\x82", -1, 1));
+    do_test("utf8: invalid sequences",
+        mpdm_size(v) == 5 && mpdm_cmp_wcs(v, L"a\xfffdz\xfffd\xfffd") == 0);
+    mpdm_unref(v);
+
+    mpdm_unlink(MPDM_S(L"test.txt"));
+}
+
+
+void test_mbs_utf8(void)
+{
+    char *prev = strdup(setlocale(LC_CTYPE, NULL));
+    wchar_t wstr[1001];
+    wchar_t *wptr, *wptr2;
+    char *ptr, *ptr2;
+    int n, s;
+
+    if (setlocale(LC_CTYPE, "C.UTF-8") == NULL && setlocale(LC_CTYPE, "en_US.UTF-8") == NULL) {
+        printf("No UTF-8 locale; skipping UTF-8 transcoding tests\n");
+        free(prev);
+        return;
     }
+
+    wptr = mpdm_mbstowcs("Espa\xc3\xb1" "a, \xe2\x82\xac", &s, -1);
+    do_test("mbs utf8: decode", s == 9 && wcscmp(wptr, L"Espa\x00f1" L"a, \x20ac") == 0);
+    free(wptr);
+
+    wptr = mpdm_mbstowcs("a\xff" "b\xe2\x82", &s, -1);
+    do_test("mbs utf8: invalid bytes", s == 5 && wcscmp(wptr, L"a\xfffd" L"b\xfffd\xfffd") == 0);
+    free(wptr);
+
+    wptr = mpdm_mbstowcs("\xc0\xaf\xed\xa0\x80", &s, -1);
+    do_test("mbs utf8: overlong and surrogates", s == 5 && wptr[0] == 0xfffd && wptr[4] == 0xfffd);
+    free(wptr);
+
+    wptr = mpdm_mbstowcs("hello, world", &s, 5);
+    do_test("mbs utf8: limit", s == 5 && wcscmp(wptr, L"hello") == 0);
+    free(wptr);
+
+    ptr = mpdm_wcstombs(L"Espa\x00f1" L"a, \x20ac \xd800!", &s);
+    do_test("mbs utf8: encode", s == 15 && strcmp(ptr, "Espa\xc3\xb1" "a, \xe2\x82\xac ?!") == 0);
+    free(ptr);
+
+    /* long strings with non-ASCII chars here and there (to cross
+       the SIMD blocks), compared with the libc conversion */
+    for (n = 0; n < 1000; n++)
+        wstr[n] = n % 37 == 36 ? 0xe1 + n : n % 101 == 100 ? 0x1f600 : L'a' + n % 26;
+    wstr[n] = L'\0';
+
+    ptr  = mpdm_wcstombs(wstr, &s);
+    ptr2 = calloc(s + 1, 1);
+    wcstombs(ptr2, wstr, s);
+    do_test("mbs utf8: long encode", strcmp(ptr, ptr2) == 0);
+
+    wptr  = mpdm_mbstowcs(ptr, &s, -1);
+    wptr2 = calloc(1001, sizeof(wchar_t));
+    mbstowcs(wptr2, ptr, 1000);
+    do_test("mbs utf8: long decode", s == 1000 && wcscmp(wptr, wstr) == 0 && wcscmp(wptr, wptr2) == 0);
+
+    free(wptr2);
+    free(wptr);
+    free(ptr2);
+    free(ptr);
+
+    setlocale(LC_CTYPE, prev);
+    free(prev);
 }
 
 
-void bench_hash(int i, mpdm_t l, int buckets)
+void test_read_chunks(void)
 {
-    mpdm_t h;
-    mpdm_t v;
+    const wchar_t *encs[] = {
+        L"utf-8", L"iso8859-1", L"utf-16le", L"utf-16be", L"utf-32le",
+        L"utf-32be", L"msdos-437", L"msdos-850", L"windows-1252",
+        L"ISO-8859-15", NULL
+    };
+    const wchar_t *line = L" Espa\x00f1" L"a, pa\x00ed" L"s de \x00e1rboles\r\n";
+    char tmp[128];
+    mpdm_t f, v;
+    FILE *o;
     int n;
 
-    printf("Hash of %d buckets: \n", buckets);
-    h = MPDM_H(buckets);
-    mpdm_ref(h);
+    for (n = 0; encs[n] != NULL; n++) {
+        int i, ok = 1;
 
-    timer(0);
-    for (n = 0; n < i; n++) {
-        v = mpdm_get_i(l, n);
-        mpdm_set(h, v, v);
-    }
-    timer(-1);
+        if (mpdm_encoding(MPDM_S(encs[n])) < 0)
+            continue;
 
-    mpdm_unref(h);
+        /* bigger than the read buffer, so lines cross its boundaries */
+        f = mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"w"));
+        for (i = 0; i < 3000; i++) {
+            mpdm_write(f, MPDM_I(i));
+            mpdm_write(f, MPDM_S(line));
+        }
+        mpdm_close(f);
 
-/*
-    printf("Bucket usage:\n");
-    for(n=0;n < mpdm_size(h);n++)
-        printf("\t%d: %d\n", n, mpdm_size(mpdm_get_i(h, n)));
-*/
-}
+        /* the UTF ones are read back by BOM autodetection */
+        if (wcsncmp(encs[n], L"utf-", 4) == 0)
+            mpdm_encoding(NULL);
 
+        f = mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"r"));
+        for (i = 0; ok && i < 3000; i++) {
+            v = mpdm_ref(mpdm_strcat_wcs(MPDM_I(i), line));
+            ok = mpdm_cmp(mpdm_read(f), v) == 0 && wcscmp(mpdm_eol(f), L"\r\n") == 0;
+            mpdm_unref(v);
+        }
 
-void benchmark(void)
-{
-    mpdm_t l;
-    int i, n;
-    char tmp[64];
+        /* the empty line after the last eol, and EOF */
+        ok = ok && mpdm_size(mpdm_read(f)) == 0 && mpdm_read(f) == NULL;
+        mpdm_close(f);
 
-    if (!do_benchmarks) {
-        printf("Benchmarks disabled -- use -b\n");
-        return;
+        sprintf(tmp, "read by chunks: %ls", encs[n]);
+        do_test(tmp, ok);
     }
 
-    printf("BENCHMARKS\n");
+    /* reading position inside the read buffer */
+    mpdm_encoding(MPDM_S(L"iso8859-1"));
+    f = mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"r"));
+    mpdm_read(f);
+    do_test("read by chunks: ftell", mpdm_ftell(f) == (long) wcslen(line) + 1);
+    mpdm_fseek(f, 0, SEEK_SET);
+    do_test("read by chunks: fseek",
+        mpdm_cmp(mpdm_read(f), mpdm_strcat_wcs(MPDM_I(0), line)) == 0);
+    mpdm_close(f);
 
-    i = 500000;
+    /* bytes written and chars out of the Latin-1 range */
+    mpdm_encoding(MPDM_S(L"msdos-437"));
+    f = mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"w"));
+    n = mpdm_write(f, MPDM_S(L"\x2554\x2550\x2557 \x00e7\x20ac\n"));
+    mpdm_close(f);
+    do_test("write by chunks: msdos-437 bytes", n == 7);
 
-    printf("Creating %d values...\n", i);
+    f = mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"r"));
+    do_test("write by chunks: msdos-437 box drawing",
+        mpdm_cmp_wcs(mpdm_read(f), L"\x2554\x2550\x2557 \x00e7?\n") == 0);
+    mpdm_close(f);
 
-    l = mpdm_ref(MPDM_A(i));
-    for (n = 0; n < i; n++) {
-        sprintf(tmp, "%08x", n);
-/*      mpdm_set_i(l, MPDM_MBS(tmp), n);*/
-        mpdm_set_i(l, MPDM_I(n), n);
-    }
+    mpdm_encoding(MPDM_S(L"utf-32be"));
+    f = mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"w"));
+    mpdm_write(f, MPDM_S(L"A"));
+    n = mpdm_write(f, MPDM_S(L"\x00e7\x20ac\n"));
+    mpdm_close(f);
+    do_test("write by chunks: utf-32be bytes", n == 12);
 
-    printf("OK\n");
+    /* incomplete sequence at EOF */
+    if ((o = fopen("test.txt", "wb")) != NULL) {
+        fwrite("A\0\n\0B", 5, 1, o);
+        fclose(o);
+    }
 
-    bench_hash(i, l, 0);
-    bench_hash(i, l, 61);
-    bench_hash(i, l, 89);
-    bench_hash(i, l, 127);
+    mpdm_encoding(MPDM_S(L"utf-16le"));
+    f = mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"r"));
+    mpdm_read(f);
+    v = mpdm_read(f);
+    do_test("read by chunks: incomplete char at EOF",
+        mpdm_cmp_wcs(v, L"\xfffd") == 0 && mpdm_read(f) == NULL);
+    mpdm_close(f);
 
-    mpdm_unref(l);
+    mpdm_encoding(NULL);
+    mpdm_unlink(MPDM_S(L"test.txt"));
 }
 
 
-void test_conversion(void)
+void test_bytes(void)
 {
-    wchar_t *wptr = NULL;
-    char *ptr = NULL;
-    int size = 0;
+    mpdm_t f, v, w;
+    unsigned char *ptr = malloc(100000);
+    int n, s;
 
-    ptr = mpdm_wcstombs(L"", &size);
-    do_test("mpdm_wcstombs converts an empty string", ptr != NULL);
+    for (n = 0; n < 100000; n++)
+        ptr[n] = n * 7;
 
-    wptr = mpdm_mbstowcs("", &size, 0);
-    do_test("mpdm_mbstowcs converts an empty string", wptr != NULL);
-}
+    v = mpdm_ref(MPDM_B(ptr, 100000));
+    do_test("bytes: type", wcscmp(mpdm_type_wcs(v), L"bytes") == 0);
+    do_test("bytes: size", mpdm_size(v) == 100000);
+    do_test("bytes: copied", memcmp(v->data, ptr, 100000) == 0);
 
+    w = mpdm_ref(MPDM_B(ptr, 99999));
+    do_test("bytes: cmp", mpdm_cmp(v, w) > 0 && mpdm_cmp(w, MPDM_B(ptr, 99999)) == 0);
+    mpdm_unref(w);
 
-void test_pipes(void)
-{
-    mpdm_t f;
+    /* an array is not compared as bytes (not even
+       with the ones of its element pointers) */
+    f = mpdm_ref(MPDM_A(0));
+    mpdm_push(f, MPDM_I(1));
+    mpdm_push(f, MPDM_I(2));
+    w = mpdm_ref(MPDM_B(f->data, mpdm_size(f)));
+    do_test("bytes: cmp with an array", mpdm_cmp(f, w) != 0 &&
+        (mpdm_cmp(f, w) < 0) == (mpdm_cmp(w, f) > 0));
+    mpdm_unref(w);
+    mpdm_unref(f);
 
-    if ((f = mpdm_popen(MPDM_S(L"date"), MPDM_S(L"r"))) != NULL) {
-        mpdm_t v;
+    f = mpdm_open(MPDM_S(L"test.bin"), MPDM_S(L"wb"));
+    do_test("bytes: bwrite", mpdm_bwrite(f, v, -1) == 100000);
+    do_test("bytes: bwrite size", mpdm_bwrite(f, v, 10) == 10);
+    mpdm_close(f);
 
-        v = mpdm_read(f);
-        mpdm_pclose(f);
+    /* small blocks, then one bigger than the read buffer */
+    f = mpdm_open(MPDM_S(L"test.bin"), MPDM_S(L"rb"));
+    w = mpdm_ref(mpdm_bread(f, 1000));
+    do_test("bytes: bread", mpdm_size(w) == 1000 && memcmp(w->data, ptr, 1000) == 0);
+    mpdm_unref(w);
+    do_test("bytes: ftell", mpdm_ftell(f) == 1000);
 
-        if (verbose) {
-            printf("Pipe from 'date':\n");
-            mpdm_dump(v);
+    w = mpdm_ref(mpdm_bread(f, 90000));
+    do_test("bytes: bread big", mpdm_size(w) == 90000 && memcmp(w->data, ptr + 1000, 90000) == 0);
+    mpdm_unref(w);
+
+    w = mpdm_ref(mpdm_bread(f, 100000));
+    do_test("bytes: bread to EOF", mpdm_size(w) == 9010 &&
+        memcmp(w->data, ptr + 91000, 9000) == 0 && memcmp((char *)w->data + 9000, ptr, 10) == 0);
+    mpdm_unref(w);
+
+    do_test("bytes: bread at EOF", mpdm_bread(f, 10) == NULL && mpdm_feof(f));
+    mpdm_close(f);
+
+    /* a text line, then the rest as bytes */
+    f = mpdm_open(MPDM_S(L"test.bin"), MPDM_S(L"w"));
+    mpdm_write(f, MPDM_S(L"header\n"));
+    mpdm_bwrite(f, v, 50000);
+    mpdm_close(f);
+
+    f = mpdm_open(MPDM_S(L"test.bin"), MPDM_S(L"rb"));
+    w = mpdm_ref(mpdm_read(f));
+    do_test("bytes: text line before", mpdm_cmp_wcs(w, L"header\n") == 0);
+    mpdm_unref(w);
+    w = mpdm_ref(mpdm_bread(f, 50000));
+    do_test("bytes: bread after a line", mpdm_cmp(w, MPDM_B(ptr, 50000)) == 0);
+    mpdm_unref(w);
+    mpdm_close(f);
+
+    /* a huge size only takes what's there */
+    f = mpdm_open(MPDM_S(L"test.bin"), MPDM_S(L"rb"));
+    w = mpdm_ref(mpdm_bread(f, 0x7fffffff));
+    do_test("bytes: bread with a huge size", mpdm_size(w) == 50007 &&
+        memcmp((char *)w->data + 7, ptr, 50000) == 0);
+    mpdm_unref(w);
+    mpdm_close(f);
+
+    mpdm_unlink(MPDM_S(L"test.bin"));
+
+    /* pipes return the available bytes */
+    if ((f = mpdm_popen(MPDM_S(L"head -c 100000 /dev/zero"), MPDM_S(L"r"))) != NULL) {
+        mpdm_ref(f);
+
+        s = 0;
+        while ((w = mpdm_bread(f, 65536)) != NULL)
+            s += mpdm_size(w);
+
+        do_test("bytes: bread from a pipe", s == 100000);
+
+        mpdm_pclose(f);
+        mpdm_unref(f);
+    }
+
+    mpdm_unref(v);
+    free(ptr);
+}
+
+
+void test_mmap(void)
+{
+    mpdm_t f, v, w;
+    wchar_t tmp[64];
+    int n, c;
+
+    f = mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"w"));
+    for (n = 0; n < 5000; n++) {
+        swprintf(tmp, 64, L"line %d\n", n);
+        mpdm_write(f, MPDM_S(tmp));
+    }
+    mpdm_close(f);
+
+    f = mpdm_ref(mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"r")));
+    do_test("mmap: not mapped", mpdm_flines(f) == -1 && mpdm_fline(f, 0) == NULL);
+    mpdm_close(f);
+    mpdm_unref(f);
+
+    f = mpdm_ref(mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"rm")));
+    do_test("mmap: first line", mpdm_cmp_wcs(mpdm_fline(f, 0), L"line 0\n") == 0);
+    do_test("mmap: ftell", mpdm_ftell(f) == 7);
+    do_test("mmap: read after fline", mpdm_cmp_wcs(mpdm_read(f), L"line 1\n") == 0);
+    do_test("mmap: indexed line", mpdm_cmp_wcs(mpdm_fline(f, 64), L"line 64\n") == 0);
+    do_test("mmap: line far away", mpdm_cmp_wcs(mpdm_fline(f, 4321), L"line 4321\n") == 0);
+    do_test("mmap: line back", mpdm_cmp_wcs(mpdm_fline(f, 63), L"line 63\n") == 0);
+    do_test("mmap: last line", mpdm_cmp_wcs(mpdm_fline(f, 4999), L"line 4999\n") == 0);
+    do_test("mmap: line out of range", mpdm_fline(f, 5000) == NULL && mpdm_fline(f, -1) == NULL);
+    do_test("mmap: flines", mpdm_flines(f) == 5000);
+    do_test("mmap: count", mpdm_count(f) == 5000);
+    do_test("mmap: get", mpdm_cmp_wcs(mpdm_get(f, MPDM_I(100)), L"line 100\n") == 0);
+
+    do_test("mmap: fseek", mpdm_fseek(f, 7, SEEK_SET) == 0 &&
+        mpdm_cmp_wcs(mpdm_read(f), L"line 1\n") == 0);
+    do_test("mmap: fseek out of range", mpdm_fseek(f, 1, SEEK_END) == -1);
+    do_test("mmap: fseek to end", mpdm_fseek(f, 0, SEEK_END) == 0 &&
+        mpdm_size(mpdm_read(f)) == 0 && mpdm_feof(f));
+
+    /* iterating reads all lines from the map */
+    mpdm_fseek(f, 0, SEEK_SET);
+    n = c = 0;
+    while (mpdm_iterator(f, &n, &v, NULL)) {
+        if (mpdm_size(v))
+            c++;
+    }
+    do_test("mmap: iterator", c == 5000);
+
+    mpdm_close(f);
+    mpdm_unref(f);
+
+    /* the last line has no newline */
+    f = mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"w"));
+    mpdm_write(f, MPDM_S(L"one\ntwo"));
+    mpdm_close(f);
+
+    f = mpdm_ref(mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"rm")));
+    do_test("mmap: no final newline", mpdm_flines(f) == 2 &&
+        mpdm_cmp_wcs(mpdm_fline(f, 1), L"two") == 0);
+    mpdm_close(f);
+    mpdm_unref(f);
+
+    /* empty file */
+    f = mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"w"));
+    mpdm_close(f);
+
+    f = mpdm_ref(mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"rm")));
+    do_test("mmap: empty file", mpdm_flines(f) == 0 && mpdm_read(f) == NULL);
+    mpdm_close(f);
+    mpdm_unref(f);
+
+    /* lines of wide encodings are decoded to be found; the BOM is skipped */
+    if (mpdm_encoding(MPDM_S(L"utf-16le")) == 0) {
+        f = mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"w"));
+        for (n = 0; n < 200; n++) {
+            swprintf(tmp, 64, L"l\xednea %d\n", n);
+            mpdm_write(f, MPDM_S(tmp));
+        }
+        mpdm_close(f);
+
+        mpdm_encoding(NULL);
+
+        f = mpdm_ref(mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"rm")));
+        w = mpdm_ref(mpdm_fline(f, 0));
+        do_test("mmap: utf-16 first line", mpdm_cmp_wcs(w, L"l\xednea 0\n") == 0);
+        mpdm_unref(w);
+        do_test("mmap: utf-16 detected", mpdm_cmp_wcs(mpdm_get_wcs(mpdm_root(),
+            L"DETECTED_ENCODING"), L"utf-16le") == 0);
+        do_test("mmap: utf-16 line", mpdm_cmp_wcs(mpdm_fline(f, 150), L"l\xednea 150\n") == 0);
+        do_test("mmap: utf-16 flines", mpdm_flines(f) == 200);
+        mpdm_close(f);
+        mpdm_unref(f);
+    }
+
+    mpdm_unlink(MPDM_S(L"test.txt"));
+}
+
+
+void test_gettext(void)
+{
+    mpdm_t v;
+    mpdm_t h;
+
+    mpdm_gettext_domain(MPDM_S(L"stress"), MPDM_S(L"./po"));
+
+    if (verbose)
+        printf("Should follow a translated string of 'This is a test string':\n");
+
+    v = mpdm_gettext(MPDM_S(L"This is a test string"));
+    if (verbose)
+        mpdm_dump(v);
+
+    if (verbose)
+        printf("The same, but cached:\n");
+    v = mpdm_gettext(MPDM_S(L"This is a test string"));
+    if (verbose)
+        mpdm_dump(v);
+
+    v = mpdm_gettext(MPDM_S(L"This string is not translated"));
+    if (verbose)
+        mpdm_dump(v);
+
+    h = MPDM_O();
+    mpdm_ref(h);
+    mpdm_set(h, MPDM_S(L"cadena de prueba"), MPDM_S(L"test string"));
+
+    mpdm_gettext_domain(MPDM_S(L"stress"), h);
+    v = mpdm_gettext(MPDM_S(L"test string"));
+    if (verbose)
+        mpdm_dump(v);
+    mpdm_unref(h);
+}
+
+
+void timer(int secs)
+{
+    static clock_t clks = 0;
+
+    switch (secs) {
+    case 0:
+        clks = clock();
+        break;
+
+    case -1:
+        printf("%.2f seconds\n",
+               (float) (clock() - clks) / (float) CLOCKS_PER_SEC);
+        break;
+    }
+}
+
+
+void bench_hash(int i, mpdm_t l, int buckets)
+{
+    mpdm_t h;
+    mpdm_t v;
+    int n;
+
+    printf("Hash of %d buckets: \n", buckets);
+    h = MPDM_H(buckets);
+    mpdm_ref(h);
+
+    timer(0);
+    for (n = 0; n < i; n++) {
+        v = mpdm_get_i(l, n);
+        mpdm_set(h, v, v);
+    }
+    timer(-1);
+
+    mpdm_unref(h);
+
+/*
+    printf("Bucket usage:\n");
+    for(n=0;n < mpdm_size(h);n++)
+        printf("\t%d: %d\n", n, mpdm_size(mpdm_get_i(h, n)));
+*/
+}
+
+
+void bench_array(int i)
+{
+    mpdm_t a;
+    int n;
+
+    printf("Pushing %d values into an array: \n", i);
+    a = mpdm_ref(MPDM_A(0));
+
+    timer(0);
+    for (n = 0; n < i; n++)
+        mpdm_push(a, MPDM_I(n));
+    timer(-1);
+
+    printf("Popping them: \n");
+
+    timer(0);
+    for (n = 0; n < i; n++)
+        mpdm_pop(a);
+    timer(-1);
+
+    mpdm_unref(a);
+}
+
+
+void bench_queue(int i)
+{
+    mpdm_t a;
+    int n;
+
+    printf("Queueing %d values through a %d element queue: \n", i, i);
+    a = mpdm_ref(MPDM_A(0));
+
+    for (n = 0; n < i; n++)
+        mpdm_push(a, MPDM_I(n));
+
+    timer(0);
+    for (n = 0; n < i; n++)
+        mpdm_queue(a, MPDM_I(n), i);
+    timer(-1);
+
+    printf("Shifting them: \n");
+
+    timer(0);
+    for (n = 0; n < i; n++)
+        mpdm_shift(a);
+    timer(-1);
+
+    mpdm_unref(a);
+
+    printf("Inserting %d values at the start: \n", i);
+    a = mpdm_ref(MPDM_A(0));
+
+    timer(0);
+    for (n = 0; n < i; n++)
+        mpdm_ins(a, MPDM_I(n), 0);
+    timer(-1);
+
+    mpdm_unref(a);
+}
+
+
+void bench_values(int i)
+{
+    mpdm_t a;
+    int n;
+
+    printf("Creating and destroying %d values: \n", i);
+
+    timer(0);
+    for (n = 0; n < i; n++)
+        mpdm_void(MPDM_I(n));
+    timer(-1);
+
+    printf("Value churn through a %d element array: \n", i / 10);
+    a = mpdm_ref(MPDM_A(i / 10));
+
+    timer(0);
+    for (n = 0; n < i; n++)
+        mpdm_set_i(a, MPDM_R((double) n), n % (i / 10));
+    timer(-1);
+
+    mpdm_unref(a);
+}
+
+
+void bench_read(int i)
+{
+    mpdm_t f, a;
+    int n;
+
+    f = mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"w"));
+    for (n = 0; n < i; n++)
+        mpdm_write(f, MPDM_S(L"The quick brown fox jumps over the lazy dog, once again.\n"));
+    mpdm_close(f);
+
+    printf("Reading a file of %d lines: \n", i);
+
+    timer(0);
+    a = mpdm_ref(MPDM_A(0));
+    f = mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"r"));
+    while (mpdm_push(a, mpdm_read(f)) != NULL);
+    mpdm_close(f);
+    timer(-1);
+
+    printf("Converting them to wide chars: \n");
+
+    timer(0);
+    for (n = 0; n < i; n++)
+        mpdm_string(mpdm_get_i(a, n));
+    timer(-1);
+
+    mpdm_unref(a);
+    mpdm_unlink(MPDM_S(L"test.txt"));
+}
+
+
+void bench_utf8(int i)
+{
+    mpdm_t f, g, v;
+    int n;
+
+    mpdm_encoding(MPDM_S(L"utf-8"));
+
+    f = mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"w"));
+    for (n = 0; n < i; n++)
+        mpdm_write(f, MPDM_S(L"El ping\x00fc" L"ino Wenceslao hizo kil\x00f3metros bajo exhaustiva lluvia.\n"));
+    mpdm_close(f);
+
+    printf("Copying a UTF-8 file of %d lines: \n", i);
+
+    timer(0);
+    f = mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"r"));
+    g = mpdm_open(MPDM_S(L"test2.txt"), MPDM_S(L"w"));
+    while ((v = mpdm_read(f)) != NULL)
+        mpdm_write(g, v);
+    mpdm_close(g);
+    mpdm_close(f);
+    timer(-1);
+
+    mpdm_encoding(NULL);
+
+    mpdm_unlink(MPDM_S(L"test2.txt"));
+    mpdm_unlink(MPDM_S(L"test.txt"));
+}
+
+
+void bench_split(int i)
+{
+    mpdm_t v, a;
+    wchar_t *ptr;
+    int n;
+
+    /* a buffer of i lines of 80 characters */
+    ptr = malloc((i * 80 + 1) * sizeof(wchar_t));
+    for (n = 0; n < i * 80; n++)
+        ptr[n] = n % 80 == 79 ? L'\n' : L'a' + n % 26;
+    ptr[n] = L'\0';
+
+    v = mpdm_ref(MPDM_ENS(ptr, i * 80));
+
+    printf("Splitting a buffer of %d lines: \n", i);
+
+    timer(0);
+    a = mpdm_ref(mpdm_split(v, MPDM_S(L"\n")));
+    timer(-1);
+
+    mpdm_unref(a);
+    mpdm_unref(v);
+}
+
+
+void bench_strcat(int i)
+{
+    mpdm_t v, w;
+    int n;
+
+    v = mpdm_ref(MPDM_S(L""));
+
+    printf("Concatenating %d strings: \n", i);
+
+    timer(0);
+    for (n = 0; n < i; n++) {
+        w = mpdm_ref(mpdm_strcat_wcs(v, L"0123456789"));
+        mpdm_unref(v);
+        v = w;
+    }
+
+    mpdm_string(v);
+    timer(-1);
+
+    mpdm_unref(v);
+}
+
+
+void bench_json(int i)
+{
+    mpdm_t a, v;
+    int n;
+
+    a = mpdm_ref(MPDM_A(0));
+    for (n = 0; n < i; n++) {
+        v = MPDM_O();
+        mpdm_set_wcs(v, MPDM_I(n), L"id");
+        mpdm_set_wcs(v, MPDM_S(L"a \"quoted\" name"), L"name");
+        mpdm_push(a, v);
+    }
+
+    printf("Formatting %d objects as JSON: \n", i);
+
+    timer(0);
+    v = mpdm_ref(mpdm_fmt(MPDM_S(L"%j"), a));
+    timer(-1);
+
+    mpdm_unref(v);
+    mpdm_unref(a);
+}
+
+
+void bench_mbs(int i)
+{
+    char *prev = strdup(setlocale(LC_CTYPE, NULL));
+    wchar_t *wptr;
+    char *ptr;
+    int n, s;
+
+    if (setlocale(LC_CTYPE, "C.UTF-8") != NULL || setlocale(LC_CTYPE, "en_US.UTF-8") != NULL) {
+        /* 1 MB of mostly ASCII UTF-8 text */
+        ptr = malloc(1024 * 1024 + 1);
+        for (n = 0; n < 1024 * 1024; n++)
+            ptr[n] = n % 1000 == 998 ? '\xc3' : n % 1000 == 999 ? '\xb1' : 'a' + n % 26;
+        ptr[n] = '\0';
+
+        printf("Decoding %d MB of UTF-8: \n", i);
+
+        timer(0);
+        for (n = 0; n < i; n++)
+            free(mpdm_mbstowcs(ptr, &s, -1));
+        timer(-1);
+
+        wptr = mpdm_mbstowcs(ptr, &s, -1);
+        free(ptr);
+
+        printf("Encoding %d MB of UTF-8: \n", i);
+
+        timer(0);
+        for (n = 0; n < i; n++)
+            free(mpdm_wcstombs(wptr, &s));
+        timer(-1);
+
+        free(wptr);
+    }
+
+    setlocale(LC_CTYPE, prev);
+    free(prev);
+}
+
+
+void bench_numbers(int i)
+{
+    mpdm_t a;
+    int n;
+    double r = 0.0;
+
+    /* integers and reals, as strings */
+    a = mpdm_ref(MPDM_A(0));
+    for (n = 0; n < 1000; n++) {
+        char tmp[32];
+
+        sprintf(tmp, "%d", n * 7919);
+        mpdm_push(a, MPDM_MBS(tmp));
+        sprintf(tmp, "%.6f", n / 7.0);
+        mpdm_push(a, MPDM_MBS(tmp));
+    }
+
+    printf("Converting %d strings to numbers: \n", i * 2000);
+
+    timer(0);
+    for (n = 0; n < i; n++) {
+        int m;
+
+        for (m = 0; m < 2000; m += 2) {
+            r += mpdm_ival(mpdm_get_i(a, m));
+            r += mpdm_rval(mpdm_get_i(a, m + 1));
+        }
+    }
+    timer(-1);
+
+    mpdm_unref(a);
+}
+
+
+void bench_reals(int i)
+{
+    mpdm_t a, v;
+    int n;
+
+    a = mpdm_ref(MPDM_A(0));
+    for (n = 0; n < i; n++)
+        mpdm_push(a, MPDM_R(n / 7.0));
+
+    printf("Formatting %d reals as JSON: \n", i);
+
+    timer(0);
+    v = mpdm_ref(mpdm_fmt(MPDM_S(L"%j"), a));
+    timer(-1);
+
+    mpdm_unref(v);
+    mpdm_unref(a);
+}
+
+
+void bench_pipe(int i)
+{
+    mpdm_t f, v;
+    char tmp[128];
+    int n = 0;
+
+    /* i MB of 100 byte lines */
+    sprintf(tmp, "yes %099d | head -c %d", 0, i * 1024 * 1024);
+
+    mpdm_set_wcs(mpdm_root(), MPDM_S(L"utf-8"), L"TEMP_ENCODING");
+
+    if ((f = mpdm_popen(MPDM_MBS(tmp), MPDM_S(L"r"))) != NULL) {
+        mpdm_ref(f);
+
+        printf("Reading %d MB of UTF-8 from a pipe: \n", i);
+
+        timer(0);
+        while ((v = mpdm_read(f)) != NULL) {
+            mpdm_void(v);
+            n++;
+        }
+        timer(-1);
+
+        mpdm_pclose(f);
+        mpdm_unref(f);
+    }
+}
+
+
+void bench_encodings(int i)
+{
+    const wchar_t *encs[] = {
+        L"utf-8", L"iso8859-1", L"utf-16le", L"utf-32le", L"msdos-437",
+        L"ISO-8859-15", NULL
+    };
+    const wchar_t *line = L"El ping\x00fc" L"ino Wenceslao hizo kil\x00f3metros bajo exhaustiva lluvia y fr\x00edo.\n";
+    mpdm_t f, v;
+    int n, m;
+
+    for (n = 0; encs[n] != NULL; n++) {
+        if (mpdm_encoding(MPDM_S(encs[n])) < 0)
+            continue;
+
+        printf("Writing %d MB of %ls text: \n", i, encs[n]);
+
+        /* i MB of text (counting 1 byte per char) */
+        timer(0);
+        v = mpdm_ref(MPDM_S(line));
+        f = mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"w"));
+        for (m = 0; m < i * 1024 * 1024; m += wcslen(line))
+            mpdm_write(f, v);
+        mpdm_close(f);
+        mpdm_unref(v);
+        timer(-1);
+
+        printf("Reading %d MB of %ls text: \n", i, encs[n]);
+
+        timer(0);
+        f = mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"r"));
+        while ((v = mpdm_read(f)) != NULL)
+            mpdm_void(v);
+        mpdm_close(f);
+        timer(-1);
+    }
+
+    mpdm_encoding(NULL);
+    mpdm_unlink(MPDM_S(L"test.txt"));
+}
+
+
+void bench_bytes(int i)
+{
+    mpdm_t f, v;
+    int n;
+
+    v = mpdm_ref(MPDM_B(NULL, 1024 * 1024));
+
+    printf("Writing %d MB of bytes in 1 MB blocks: \n", i);
+
+    timer(0);
+    f = mpdm_open(MPDM_S(L"test.bin"), MPDM_S(L"wb"));
+    for (n = 0; n < i; n++)
+        mpdm_bwrite(f, v, -1);
+    mpdm_close(f);
+    timer(-1);
+
+    mpdm_unref(v);
+
+    printf("Reading %d MB of bytes in 1 MB blocks: \n", i);
+
+    timer(0);
+    f = mpdm_open(MPDM_S(L"test.bin"), MPDM_S(L"rb"));
+    while ((v = mpdm_bread(f, 1024 * 1024)) != NULL)
+        mpdm_void(v);
+    mpdm_close(f);
+    timer(-1);
+
+    mpdm_unlink(MPDM_S(L"test.bin"));
+}
+
+
+void bench_mmap(int i)
+{
+    mpdm_t f, v;
+    int n;
+
+    printf("Creating a %d lines log: \n", i);
+
+    timer(0);
+    f = mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"w"));
+    v = mpdm_ref(MPDM_S(L"2026-01-01 00:00:00 [info] some event happened in some module\n"));
+    for (n = 0; n < i; n++)
+        mpdm_write(f, v);
+    mpdm_unref(v);
+    mpdm_close(f);
+    timer(-1);
+
+    printf("Opening it mapped and reading the first 50 lines: \n");
+
+    timer(0);
+    f = mpdm_ref(mpdm_open(MPDM_S(L"test.txt"), MPDM_S(L"rm")));
+    for (n = 0; n < 50; n++)
+        mpdm_void(mpdm_fline(f, n));
+    timer(-1);
+
+    printf("Counting its lines: \n");
+
+    timer(0);
+    mpdm_flines(f);
+    timer(-1);
+
+    printf("Reading 100000 random lines: \n");
+
+    timer(0);
+    for (n = 0; n < 100000; n++)
+        mpdm_void(mpdm_fline(f, (n * 7919) % i));
+    timer(-1);
+
+    mpdm_close(f);
+    mpdm_unref(f);
+
+    mpdm_unlink(MPDM_S(L"test.txt"));
+}
+
+
+void bench_keys(int i)
+{
+    mpdm_t o, k;
+    int n;
+
+    o = mpdm_ref(MPDM_O());
+    mpdm_set_wcs(o, MPDM_I(1), L"id");
+    mpdm_set_wcs(o, MPDM_I(2), L"name");
+    mpdm_set_wcs(o, MPDM_I(3), L"description");
+
+    printf("Looking up a key %d times by string: \n", i);
+
+    timer(0);
+    for (n = 0; n < i; n++)
+        mpdm_get_wcs(o, L"description");
+    timer(-1);
+
+    printf("Looking up a key %d times by mpdm_key(): \n", i);
+    k = mpdm_ref(mpdm_key(L"description"));
+
+    timer(0);
+    for (n = 0; n < i; n++)
+        mpdm_get(o, k);
+    timer(-1);
+
+    mpdm_unref(k);
+    mpdm_unref(o);
+}
+
+
+void bench_stringify(int i)
+{
+    mpdm_t a;
+    int n;
+
+    printf("Joining %d integers: \n", i);
+    a = mpdm_ref(MPDM_A(i));
+    for (n = 0; n < i; n++)
+        mpdm_set_i(a, MPDM_I(n), n);
+
+    timer(0);
+    mpdm_void(mpdm_join_wcs(a, L","));
+    timer(-1);
+
+    mpdm_unref(a);
+}
+
+
+void benchmark(void)
+{
+    mpdm_t l;
+    int i, n;
+    char tmp[64];
+
+    if (!do_benchmarks) {
+        printf("Benchmarks disabled -- use -b\n");
+        return;
+    }
+
+    printf("BENCHMARKS\n");
+
+    i = 500000;
+
+    printf("Creating %d values...\n", i);
+
+    l = mpdm_ref(MPDM_A(i));
+    for (n = 0; n < i; n++) {
+        sprintf(tmp, "%08x", n);
+/*      mpdm_set_i(l, MPDM_MBS(tmp), n);*/
+        mpdm_set_i(l, MPDM_I(n), n);
+    }
+
+    printf("OK\n");
+
+    bench_hash(i, l, 0);
+    bench_hash(i, l, 61);
+    bench_hash(i, l, 89);
+    bench_hash(i, l, 127);
+
+    mpdm_unref(l);
+
+    bench_values(5000000);
+    bench_array(5000000);
+    bench_queue(1000000);
+    bench_stringify(1000000);
+    bench_keys(10000000);
+    bench_read(500000);
+    bench_utf8(500000);
+    bench_split(500000);
+    bench_strcat(1000000);
+    bench_json(100000);
+    bench_mbs(1000);
+    bench_numbers(500);
+    bench_reals(1000000);
+    bench_pipe(100);
+    bench_encodings(100);
+    bench_bytes(1000);
+    bench_mmap(5000000);
+}
+
+
+void test_conversion(void)
+{
+    wchar_t *wptr = NULL;
+    char *ptr = NULL;
+    int size = 0;
+
+    ptr = mpdm_wcstombs(L"", &size);
+    do_test("mpdm_wcstombs converts an empty string", ptr != NULL);
+
+    wptr = mpdm_mbstowcs("", &size, 0);
+    do_test("mpdm_mbstowcs converts an empty string", wptr != NULL);
+}
+
+
+void test_numbers(void)
+{
+    const char *reals[] = {
+        "  -1.5e3x", "0.1", "-0.0", "1e", "2.2250738585072014e-308",
+        "4.9e-324", "1.7976931348623157e308", "9007199254740993",
+        "123456789012345678901234567890", "0.000000000000000000000000001",
+        "1e23", "8.5e37", "-5.273994027622072e+50", "1e400", ".5", "5.",
+        "inf", "-Infinity", NULL
+    };
+    char tmp[64];
+    wchar_t wtmp[64];
+    int n, ok;
+
+    do_test("ival: spaces", mpdm_ival(MPDM_S(L" 42")) == 42);
+    do_test("ival: sign", mpdm_ival(MPDM_S(L"+7")) == 7);
+    do_test("ival: negative hex", mpdm_ival(MPDM_S(L"-0x10")) == -16);
+    do_test("ival: negative octal", mpdm_ival(MPDM_S(L"-010")) == -8);
+    do_test("ival: binary", mpdm_ival(MPDM_S(L"0b101")) == 5);
+    do_test("ival: trailing garbage", mpdm_ival(MPDM_S(L"12abc")) == 12);
+    do_test("ival: empty", mpdm_ival(MPDM_S(L"")) == 0);
+    do_test("ival: not a number", mpdm_ival(MPDM_S(L"abc")) == 0);
+    do_test("ival: 0x alone", mpdm_ival(MPDM_S(L"0x")) == 0);
+    do_test("ival: INT_MAX", mpdm_ival(MPDM_S(L"2147483647")) == 2147483647);
+    do_test("ival_mbs", mpdm_ival_mbs("  0xff") == 255);
+
+    /* must give exactly the same as the C library */
+    for (n = ok = 0; reals[n] != NULL; n++) {
+        double r1 = mpdm_rval_mbs((char *)reals[n]);
+        double r2 = strtod(reals[n], NULL);
+
+        if (memcmp(&r1, &r2, sizeof(double)) == 0)
+            ok++;
+        else
+            printf("rval: %s: %.17g != %.17g\n", reals[n], r1, r2);
+    }
+    do_test("rval: same as strtod()", ok == n);
+
+    do_test("rval: nan", mpdm_rval(MPDM_S(L"nan")) != mpdm_rval(MPDM_S(L"nan")));
+    do_test("rval: not a number", mpdm_rval(MPDM_S(L"e5")) == 0.0);
+
+    /* random doubles must survive a round trip */
+    srand(1);
+    for (n = ok = 0; n < 10000; n++) {
+        double r1, r2;
+
+        r1 = (double) rand() / (double) rand();
+        if (n % 3 == 0)
+            r1 *= 1e-10;
+        else
+        if (n % 3 == 1)
+            r1 = (double) (rand() % 100000) / 1000.0;
+
+        sprintf(tmp, "%.17g", r1);
+        mbstowcs(wtmp, tmp, 64);
+        r2 = mpdm_rval_wcs(wtmp);
+
+        if (r1 == r2)
+            ok++;
+        else
+            printf("rval: %s: %.17g\n", tmp, r2);
+    }
+    do_test("rval: round trip of 10000 doubles", ok == n);
+
+    /* long strings are parsed in place (leading zeros mean octal) */
+    {
+        mpdm_t v = mpdm_ref(mpdm_strcat(MPDM_S(L"000000000000000000000000000000000000000000000000000000000000000000000000"),
+                                        MPDM_S(L"00000000000000000000000000000000000000000000000000000000000000000000000012.5")));
+        do_test("rval: long string", mpdm_rval(v) == 12.5);
+        do_test("ival: long string", mpdm_ival(v) == 10);
+        mpdm_unref(v);
+    }
+}
+
+
+void test_reals(void)
+{
+    struct {
+        double r;
+        wchar_t *s;
+    } reals[] = {
+        { 0.1 + 0.2,                L"0.30000000000000004" },
+        { -0.0,                     L"-0" },
+        { 123.0,                    L"123" },
+        { -2.5,                     L"-2.5" },
+        { 1e20,                     L"100000000000000000000" },
+        { 1e21,                     L"1e+21" },
+        { 1.5e300,                  L"1.5e+300" },
+        { 0.000001,                 L"0.000001" },
+        { 1e-7,                     L"1e-7" },
+        { 5e-324,                   L"5e-324" },
+        { 2.2250738585072014e-308,  L"2.2250738585072014e-308" },
+        { 1.7976931348623157e308,   L"1.7976931348623157e+308" },
+        { 9007199254740993.0,       L"9007199254740992" },
+        { 0.0,                      NULL }
+    };
+    mpdm_t v;
+    int n, ok;
+
+    for (n = ok = 0; reals[n].s != NULL; n++) {
+        v = mpdm_ref(MPDM_R(reals[n].r));
+
+        if (wcscmp(mpdm_string(v), reals[n].s) == 0)
+            ok++;
+        else
+            printf("real: %ls != %ls\n", mpdm_string(v), reals[n].s);
+
+        mpdm_unref(v);
+    }
+    do_test("reals: shortest representation", ok == n);
+
+    v = mpdm_ref(MPDM_R(DBL_MAX * 2.0));
+    do_test("reals: inf", wcscmp(mpdm_string(v), L"inf") == 0);
+    mpdm_unref(v);
+
+    /* any double must survive a round trip */
+    srand(2);
+    for (n = ok = 0; n < 10000; n++) {
+        union { double d; unsigned int i[2]; } u;
+
+        u.i[0] = rand() ^ (rand() << 16);
+        u.i[1] = rand() ^ (rand() << 16);
+
+        if (u.d != u.d || u.d - u.d != 0.0)
+            u.d = n;
+
+        v = mpdm_ref(MPDM_R(u.d));
+
+        if (mpdm_rval(MPDM_S(mpdm_string(v))) == u.d)
+            ok++;
+        else
+            printf("real: %ls != %.17g\n", mpdm_string(v), u.d);
+
+        mpdm_unref(v);
+    }
+    do_test("reals: round trip of 10000 random doubles", ok == n);
+
+    v = mpdm_ref(MPDM_A(0));
+    mpdm_push(v, MPDM_R(0.1));
+    mpdm_push(v, MPDM_R(1e-10));
+    mpdm_push(v, MPDM_I(3));
+    do_test("reals: JSON", mpdm_cmp(mpdm_fmt(MPDM_S(L"%j"), v), MPDM_S(L"[0.1,1e-10,3]")) == 0);
+    do_test("reals: %s", mpdm_cmp(mpdm_fmt(MPDM_S(L"<%s>"), mpdm_get_i(v, 0)), MPDM_S(L"<0.1>")) == 0);
+    mpdm_unref(v);
+}
+
+
+void test_intern(void)
+{
+    mpdm_t v, w, o1, o2, k1, k2;
+    int n;
+
+    v = mpdm_intern_wcs(L"name", -1);
+    w = mpdm_intern_wcs(L"name", -1);
+    do_test("intern: same value", v == w);
+    do_test("intern: hash is precomputed", v->flags & MPDM_F_HASHED);
+    do_test("intern: mpdm_intern", mpdm_intern(MPDM_S(L"name")) == v);
+    do_test("intern: sized", mpdm_intern_wcs(L"namespace", 4) == v);
+
+    v = mpdm_ref(mpdm_intern_wcs(L"a string that is too long to be used as a symbol", -1));
+    w = mpdm_ref(mpdm_intern_wcs(L"a string that is too long to be used as a symbol", -1));
+    do_test("intern: long strings are not interned", v != w && mpdm_cmp(v, w) == 0);
+    mpdm_unref(w);
+    mpdm_unref(v);
+
+    o1 = mpdm_ref(MPDM_O());
+    o2 = mpdm_ref(MPDM_O());
+    mpdm_set_wcs(o1, MPDM_I(1), L"key");
+    mpdm_set_wcs(o2, MPDM_I(2), L"key");
+
+    n = 0;
+    mpdm_iterator(o1, &n, NULL, &k1);
+    n = 0;
+    mpdm_iterator(o2, &n, NULL, &k2);
+    do_test("intern: mpdm_set_wcs keys are shared", k1 == k2);
+    do_test("intern: lookup with interned keys",
+        mpdm_ival(mpdm_get(o2, mpdm_intern_wcs(L"key", -1))) == 2);
+    do_test("intern: lookup with other keys",
+        mpdm_ival(mpdm_get(o1, MPDM_S(L"key"))) == 1);
+
+    mpdm_unref(o2);
+    mpdm_unref(o1);
+
+    /* cached hashes */
+    o1 = mpdm_ref(MPDM_O());
+    v = mpdm_ref(MPDM_S(L"a key long enough not to be interned"));
+    mpdm_set(o1, MPDM_I(1), v);
+    do_test("hash is cached in strings", v->flags & MPDM_F_HASHED);
+
+    w = mpdm_ref(mpdm_key(L"a key long enough not to be interned"));
+    do_test("mpdm_key: hash is precalculated", w->flags & MPDM_F_HASHED && v != w);
+    do_test("mpdm_key: lookup", mpdm_ival(mpdm_get(o1, w)) == 1);
+    do_test("mpdm_key: short keys are interned", mpdm_key(L"key") == k1);
+
+    mpdm_unref(w);
+    mpdm_unref(v);
+    mpdm_unref(o1);
+
+    do_test("mpdm_count of strings", mpdm_count(MPDM_S(L"hello")) == 5);
+}
+
+
+void test_stringify(void)
+{
+    mpdm_t v, w, o;
+    wchar_t *p1, *p2;
+    int n;
+
+    v = mpdm_ref(MPDM_I(12345));
+    w = mpdm_ref(MPDM_R(3.5));
+    p1 = mpdm_string(v);
+    p2 = mpdm_string(w);
+    do_test("stringify: two at once",
+        wcscmp(p1, L"12345") == 0 && wcscmp(p2, L"3.5") == 0);
+    mpdm_unref(w);
+    mpdm_unref(v);
+
+    for (n = 0; n < 100000; n++)
+        mpdm_string(MPDM_I(n));
+    do_test("stringify: no cache in the root object",
+        mpdm_get_wcs(mpdm_root(), L"__STRINGIFY__") == NULL);
+
+    /* integer keys */
+    o = mpdm_ref(MPDM_O());
+    for (n = 0; n < 1000; n++)
+        mpdm_set(o, MPDM_I(n * 2), MPDM_I(n + 1000));
+
+    for (n = 0; n < 1000; n++) {
+        if (mpdm_ival(mpdm_get(o, MPDM_I(n + 1000))) != n * 2)
+            break;
+    }
+    do_test("stringify: integer keys", n == 1000);
+    mpdm_unref(o);
+}
+
+
+void test_pipes(void)
+{
+    mpdm_t f;
+
+    if ((f = mpdm_popen(MPDM_S(L"date"), MPDM_S(L"r"))) != NULL) {
+        mpdm_t v;
+
+        v = mpdm_read(f);
+        mpdm_pclose(f);
+
+        if (verbose) {
+            printf("Pipe from 'date':\n");
+            mpdm_dump(v);
         }
     }
     else
         printf("Can't pipe to 'date'\n");
+
+    /* lines written to an interactive program are sent at once */
+    if ((f = mpdm_popen(MPDM_S(L"cat"), MPDM_S(L"r+"))) != NULL) {
+        mpdm_ref(f);
+
+        mpdm_write(f, MPDM_S(L"hello\n"));
+        do_test("pipe: write and read back", mpdm_cmp(mpdm_read(f), MPDM_S(L"hello\n")) == 0);
+
+        mpdm_write(f, MPDM_S(L"world\n"));
+        do_test("pipe: write and read back 2", mpdm_cmp(mpdm_read(f), MPDM_S(L"world\n")) == 0);
+
+        mpdm_pclose(f);
+        mpdm_unref(f);
+    }
+
+    if ((f = mpdm_popen(MPDM_S(L"seq 1 20000; printf '\\351'"), MPDM_S(L"r"))) != NULL) {
+        mpdm_t v, w = NULL;
+        int n = 0;
+
+        mpdm_ref(f);
+
+        while ((v = mpdm_read(f)) != NULL) {
+            mpdm_store(&w, v);
+            n++;
+
+            if (n == 20000)
+                break;
+        }
+
+        do_test("pipe: read many lines", n == 20000 && mpdm_cmp(w, MPDM_S(L"20000\n")) == 0);
+        mpdm_store(&w, NULL);
+
+        v = mpdm_getchar(f);
+        do_test("pipe: bytes over 0x7f", v && mpdm_string(v)[0] == 0xe9);
+        do_test("pipe: EOF", mpdm_getchar(f) == NULL && mpdm_feof(f));
+
+        mpdm_pclose(f);
+        mpdm_unref(f);
+    }
+
+    mpdm_set_wcs(mpdm_root(), MPDM_S(L"utf-8"), L"TEMP_ENCODING");
+
+    if ((f = mpdm_popen(MPDM_S(L"printf 'a\\r\\n\\303\\261b\\rc\\nd'"), MPDM_S(L"r"))) != NULL) {
+        mpdm_ref(f);
+
+        do_test("pipe utf-8: line 1", mpdm_cmp(mpdm_read(f), MPDM_S(L"a\r\n")) == 0 &&
+            wcscmp(mpdm_eol(f), L"\r\n") == 0);
+        do_test("pipe utf-8: line 2", mpdm_cmp(mpdm_read(f), MPDM_S(L"\x00f1" L"b\rc\n")) == 0 &&
+            wcscmp(mpdm_eol(f), L"\rc") == 0);
+        do_test("pipe utf-8: line 3", mpdm_cmp(mpdm_read(f), MPDM_S(L"d")) == 0 &&
+            mpdm_read(f) == NULL);
+
+        mpdm_pclose(f);
+        mpdm_unref(f);
+    }
 }
 
 
@@ -1629,6 +3218,256 @@ void test_thread(void)
 }
 
 
+mpdm_t shared_thread(mpdm_t t, mpdm_t ctxt)
+/* walks a shared tree from a thread */
+{
+    int n, m;
+
+    for (m = 0; m < 200; m++) {
+        for (n = 0; n < mpdm_size(t); n++) {
+            mpdm_t v = mpdm_ref(mpdm_get_i(t, n));
+            mpdm_ref(mpdm_get_wcs(v, L"name"));
+            mpdm_unref(mpdm_get_wcs(v, L"name"));
+            mpdm_unref(v);
+        }
+    }
+
+    mpdm_mutex_lock(mutex);
+    t_finished++;
+    mpdm_mutex_unlock(mutex);
+
+    return NULL;
+}
+
+
+void test_shared(void)
+{
+    mpdm_t t, x, v, th;
+    int n, done;
+
+    /* a configuration tree */
+    t = mpdm_ref(MPDM_A(0));
+    for (n = 0; n < 1000; n++) {
+        v = mpdm_push(t, MPDM_O());
+        mpdm_set_wcs(v, MPDM_S(L"value"), L"name");
+    }
+
+    x = mpdm_ref(MPDM_X(shared_thread));
+    mutex = mpdm_ref(mpdm_new_mutex());
+    t_finished = 0;
+
+    th = mpdm_ref(MPDM_A(0));
+    for (n = 0; n < 4; n++)
+        mpdm_push(th, mpdm_exec_thread(x, t, NULL));
+
+    do_test("values sent to threads are shared", t->flags & MPDM_F_SHARED);
+    do_test("their content is also shared",
+        mpdm_get_wcs(mpdm_get_i(t, 500), L"name")->flags & MPDM_F_SHARED);
+
+    /* walk it also from here */
+    shared_thread(t, NULL);
+
+    done = 0;
+    while (!done) {
+        mpdm_sleep(10);
+
+        mpdm_mutex_lock(mutex);
+        done = t_finished == 5;
+        mpdm_mutex_unlock(mutex);
+    }
+
+    /* threads unref their arguments on exit */
+    mpdm_sleep(100);
+
+    v = mpdm_get_i(t, 500);
+    do_test("shared reference counts 1", v->ref == 1);
+    do_test("shared reference counts 2", mpdm_get_wcs(v, L"name")->ref == 1);
+
+    v = MPDM_O();
+    mpdm_push(t, v);
+    do_test("values stored into shared arrays are shared", v->flags & MPDM_F_SHARED);
+
+    mpdm_unref(th);
+    mpdm_unref(mutex);
+    mpdm_unref(x);
+    mpdm_unref(t);
+}
+
+
+void test_gc(void)
+{
+    mpdm_t a, o, e, v;
+    int n, c;
+
+    mpdm_gc_threshold(1000000);
+    mpdm_gc();
+
+    a = mpdm_ref(MPDM_A(0));
+    mpdm_push(a, a);
+    mpdm_unref(a);
+    do_test("gc: an array containing itself is collected", mpdm_gc() == 1);
+
+    o = mpdm_ref(MPDM_O());
+    a = MPDM_A(0);
+    mpdm_set_wcs(o, a, L"array");
+    mpdm_push(a, o);
+    mpdm_push(a, MPDM_S(L"a string"));
+    mpdm_push(a, MPDM_I(1000));
+    mpdm_unref(o);
+    do_test("gc: an object / array cycle is collected", mpdm_gc() == 2);
+
+    o = mpdm_ref(MPDM_O());
+    a = MPDM_A(0);
+    mpdm_set_wcs(o, a, L"array");
+    mpdm_push(a, o);
+    mpdm_ref(a);
+    mpdm_unref(o);
+    do_test("gc: referenced cycles are kept", mpdm_gc() == 0);
+    do_test("gc: reference counts are restored 1", a->ref == 2 && o->ref == 1);
+    mpdm_unref(a);
+    do_test("gc: unreferenced cycles are collected", mpdm_gc() == 2);
+
+    /* a long ring pointing to a live value */
+    e = mpdm_ref(MPDM_A(0));
+    o = v = mpdm_ref(MPDM_O());
+    for (n = 0; n < 10000; n++) {
+        mpdm_t w = MPDM_O();
+
+        mpdm_set_wcs(v, w, L"next");
+        mpdm_set_wcs(v, e, L"live");
+        v = w;
+    }
+    mpdm_set_wcs(v, o, L"next");
+    mpdm_unref(o);
+    do_test("gc: long rings are collected", mpdm_gc() == 10001);
+    do_test("gc: reference counts are restored 2", e->ref == 1);
+    mpdm_unref(e);
+
+    /* destroyed while being a candidate */
+    a = mpdm_ref(mpdm_ref(MPDM_A(0)));
+    mpdm_push(a, MPDM_A(0));
+    mpdm_unref(a);
+    mpdm_unref(a);
+    do_test("gc: destroyed candidates", mpdm_gc() == 0);
+
+    /* shared values are not traced */
+    a = mpdm_ref(MPDM_A(0));
+    mpdm_push(a, a);
+    mpdm_share(a);
+    mpdm_unref(a);
+    do_test("gc: shared cycles are not collected", mpdm_gc() == 0 && a->ref == 1);
+
+    /* collections are not run while an array is being changed */
+    mpdm_gc_threshold(2);
+    e = mpdm_ref(MPDM_A(0));
+    a = mpdm_ref(MPDM_A(0));
+    mpdm_push(a, MPDM_A(0));
+    mpdm_push(a, e);
+    mpdm_void(a);
+    mpdm_collapse(a, 0, 2);
+    do_test("gc: candidates buffered while collapsing", mpdm_size(a) == 0 && e->ref == 1);
+    mpdm_unref(a);
+    mpdm_unref(e);
+    mpdm_gc();
+
+    /* cycles built from new values are not collected while building */
+    mpdm_gc_threshold(1);
+    o = MPDM_O();
+    mpdm_set_wcs(o, o, L"self");
+    mpdm_set_wcs(o, MPDM_S(L"node"), L"name");
+    a = MPDM_A(0);
+    e = MPDM_A(0);
+    mpdm_push(a, e);
+    mpdm_push(e, a);
+    mpdm_push(a, MPDM_S(L"pair"));
+    mpdm_ref(o);
+    mpdm_ref(a);
+    do_test("gc: referenced new cycles are kept", mpdm_gc_check() == 0);
+    do_test("gc: new cycles are intact", mpdm_cmp_wcs(mpdm_get_wcs(o, L"name"), L"node") == 0 &&
+        mpdm_cmp_wcs(mpdm_get_i(a, 1), L"pair") == 0);
+    mpdm_unref(o);
+    mpdm_unref(a);
+    do_test("gc: new cycles are collected once unreferenced", mpdm_gc() == 3);
+
+    /* automatic collections */
+    mpdm_gc_threshold(100);
+    v = mpdm_ref(mpdm_gc_stats());
+    c = mpdm_ival(mpdm_get_wcs(v, L"collections"));
+    mpdm_unref(v);
+
+    for (n = 0; n < 1000; n++) {
+        a = mpdm_ref(MPDM_A(0));
+        mpdm_push(a, a);
+        mpdm_unref(a);
+        mpdm_gc_check();
+    }
+
+    v = mpdm_ref(mpdm_gc_stats());
+    do_test("gc: automatic collections",
+        mpdm_ival(mpdm_get_wcs(v, L"collections")) >= c + 9);
+    do_test("gc: pending candidates",
+        mpdm_ival(mpdm_get_wcs(v, L"candidates")) < 100);
+    mpdm_unref(v);
+
+    mpdm_gc_threshold(0);
+    mpdm_gc();
+}
+
+
+void test_destroy(void)
+{
+    mpdm_t a, v, w;
+    int n, b;
+
+    /* a deeply nested array */
+    a = v = mpdm_ref(MPDM_A(0));
+    for (n = 0; n < 1000000; n++) {
+        w = MPDM_A(0);
+        mpdm_push(v, MPDM_S(L"a string"));
+        mpdm_push(v, w);
+        v = w;
+    }
+    mpdm_unref(a);
+    do_test("destroying a 1M-deep nested array", 1);
+
+    /* a long linked list of objects */
+    a = v = mpdm_ref(MPDM_O());
+    for (n = 0; n < 100000; n++) {
+        w = MPDM_O();
+        mpdm_set_wcs(v, w, L"next");
+        v = w;
+    }
+    mpdm_unref(a);
+    do_test("destroying a 100K-long linked list", 1);
+
+    /* batched destruction */
+    b = mpdm_destroy_budget(100);
+
+    a = v = mpdm_ref(MPDM_A(0));
+    for (n = 0; n < 100000; n++) {
+        w = MPDM_A(0);
+        mpdm_push(v, w);
+        v = w;
+    }
+    mpdm_unref(a);
+
+    v = mpdm_ref(mpdm_gc_stats());
+    do_test("destroy budget: values are pending",
+        mpdm_ival(mpdm_get_wcs(v, L"pending")) > 0);
+    mpdm_unref(v);
+
+    for (n = 0; n < 2000; n++)
+        mpdm_void(MPDM_O());
+
+    v = mpdm_ref(mpdm_gc_stats());
+    do_test("destroy budget: destroyed on allocation",
+        mpdm_ival(mpdm_get_wcs(v, L"pending")) == 0);
+    mpdm_unref(v);
+
+    mpdm_destroy_budget(b);
+}
+
+
 mpdm_t sem = NULL;
 
 mpdm_t sem_thread(mpdm_t args, mpdm_t ctxt)
@@ -1766,6 +3605,32 @@ void test_json_in(void)
     mpdm_ref(v);
     do_test("JSON 7", mpdm_type(v) == MPDM_TYPE_OBJECT);
     mpdm_unref(v);
+
+    v = json_parser_t(L"[{\"id\": 1, \"name\": \"a\"}, {\"id\": 2, \"name\": \"b\"}]");
+    mpdm_ref(v);
+    {
+        mpdm_t k1, k2;
+        int n = 0;
+
+        mpdm_iterator(mpdm_get_i(v, 0), &n, NULL, &k1);
+        n = 0;
+        mpdm_iterator(mpdm_get_i(v, 1), &n, NULL, &k2);
+
+        do_test("JSON 8: keys are interned", k1 == k2);
+        do_test("JSON 8.1", mpdm_ival(mpdm_get_wcs(mpdm_get_i(v, 1), L"id")) == 2);
+    }
+    mpdm_unref(v);
+
+    v = json_parser_t(L"[-12, 0.25, 1e3, 2.5E-2, -7e+1]");
+    mpdm_ref(v);
+    do_test("JSON 9: numbers", mpdm_type(mpdm_get_i(v, 0)) == MPDM_TYPE_INTEGER &&
+        mpdm_ival(mpdm_get_i(v, 0)) == -12 &&
+        mpdm_rval(mpdm_get_i(v, 1)) == 0.25 &&
+        mpdm_type(mpdm_get_i(v, 2)) == MPDM_TYPE_REAL &&
+        mpdm_rval(mpdm_get_i(v, 2)) == 1000.0 &&
+        mpdm_rval(mpdm_get_i(v, 3)) == 0.025 &&
+        mpdm_rval(mpdm_get_i(v, 4)) == -70.0);
+    mpdm_unref(v);
 }
 
 
@@ -1826,6 +3691,26 @@ void test_gzip(void)
 
 void (*func) (void) = NULL;
 
+void test_restart(void)
+{
+    mpdm_t o;
+
+    /* run after mpdm_shutdown() */
+    do_test("restart: startup", mpdm_startup() == 0);
+
+    o = mpdm_ref(MPDM_O());
+    mpdm_set_wcs(o, MPDM_I(1), L"one");
+    mpdm_set(o, MPDM_S(L"value"), mpdm_intern_wcs(L"key", -1));
+    mpdm_set_wcs(o, MPDM_A(0), L"array");
+    do_test("restart: small integers", mpdm_ival(mpdm_get_wcs(o, L"one")) == 1);
+    do_test("restart: interned keys", mpdm_cmp_wcs(mpdm_get_wcs(o, L"key"), L"value") == 0);
+    do_test("restart: root", mpdm_get_wcs(mpdm_root(), L"ENV") != NULL);
+    mpdm_unref(o);
+
+    mpdm_shutdown();
+}
+
+
 int main(int argc, char *argv[])
 {
     printf("MPDM stress tests\n\n");
@@ -1859,19 +3744,34 @@ int main(int argc, char *argv[])
     test_splice();
     test_strcat();
     test_split();
+    test_slice();
+    test_rope();
+    test_sb();
     test_join();
     test_file();
     test_regex();
     test_exec();
     test_encoding();
+    test_utf8();
+    test_mbs_utf8();
+    test_read_chunks();
+    test_bytes();
+    test_mmap();
     test_gettext();
     test_conversion();
+    test_numbers();
+    test_reals();
+    test_stringify();
+    test_intern();
     test_pipes();
     test_misc();
     test_sprintf();
     test_ulc();
     test_scanf();
     test_thread();
+    test_shared();
+    test_gc();
+    test_destroy();
     test_sem();
     test_sock();
     test_json_in();
@@ -1882,6 +3782,8 @@ int main(int argc, char *argv[])
 
     mpdm_shutdown();
 
+    test_restart();
+
     printf("\n*** Total tests passed: %d/%d\n", oks, tests);
 
     if (oks == tests)